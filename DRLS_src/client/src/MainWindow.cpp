@@ -7,6 +7,10 @@
 
 #include "common/src/service/ResourceLockService.h"
 #include "common/src/service/DelayedResourceLockService.h"
+#include "common/src/LockAuditLog.h"
+
+#include <QFileDialog>
+#include <QMessageBox>
 
 using namespace view;
 
@@ -30,6 +34,20 @@ MainWindow::MainWindow(QWidget *parent)
         dialog.setModal(true);
         dialog.exec();
     });
+
+    connect(ui->dumpLockAuditAction, &QAction::triggered, this, [this] {
+        auto path = QFileDialog::getSaveFileName(this,
+                                                 tr("Dump lock audit log"),
+                                                 "locks.audit",
+                                                 tr("Lock audit dumps (*.audit)"));
+        if (path.isEmpty())
+            return;
+
+        if (!common::LockAuditLog::dumpToFile(path))
+            QMessageBox::warning(this,
+                                 tr("Dump lock audit log"),
+                                 tr("Could not write %1").arg(path));
+    });
     auto resourceLockService = common::ResourceLockService::getInstance();
 
     connect(resourceLockService->meta(),
@@ -47,6 +65,9 @@ MainWindow::MainWindow(QWidget *parent)
 
 MainWindow::~MainWindow()
 {
+    for (auto& handle : pendingLogs_)
+        handle->cancel();
+
     delete ui;
 }
 
@@ -76,11 +97,22 @@ void MainWindow::logUsersWithFruitPreferences() {
         qDebug() << "[LIKE]" << "----------------------------------------------------";
     });
 
-    drls->addAsyncSystemLock("MainWindow::logUsersWithFruitPreferences" + QTime::currentTime().toString(),
-                             {{common::LockableResource(db::EntityType::Fruit),
-                               common::ResourceLockType::Read},
-                              {common::LockableResource(db::EntityType::User),
-                               common::ResourceLockType::Read}},
-                             task,
-                             3600'000);
+    pendingLogs_.removeIf([](const common::AsyncLockHandlePtr& handle) {
+        return handle->getStatus() != common::AsyncLockStatus::Pending &&
+               handle->getStatus() != common::AsyncLockStatus::Queued;
+    });
+
+    // every change of the locks asks for the report, one queued report is enough
+    common::AsyncLockOptions options;
+    options.coalesceKey = "MainWindow::logUsersWithFruitPreferences";
+
+    auto handle = drls->addAsyncSystemLock(
+            "MainWindow::logUsersWithFruitPreferences" + QTime::currentTime().toString(),
+            {{common::LockableResource(db::EntityType::Fruit), common::ResourceLockType::Read},
+             {common::LockableResource(db::EntityType::User), common::ResourceLockType::Read}},
+            task,
+            3600'000,
+            nullptr,
+            options);
+    pendingLogs_.append(handle);
 }
@@ -2,6 +2,8 @@
 
 #include <QMainWindow>
 
+#include "common/src/service/interface/IDelayedResourceLockService.h"
+
 namespace view {
 
 namespace Ui { class MainWindow; }
@@ -24,6 +26,9 @@ private:
 
     bool logOnCooldown_ = false;
     int isEvenRun_ = true;
+
+    // queued log requests refer to this window, they are withdrawn when it closes
+    QList<common::AsyncLockHandlePtr> pendingLogs_;
 };
 
 } // namespace view
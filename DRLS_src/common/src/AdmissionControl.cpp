@@ -0,0 +1,145 @@
+#include "AdmissionControl.h"
+
+using namespace common;
+
+AdmissionControl::AdmissionControl(std::shared_ptr<IClock> clock)
+    : clock_(clock)
+{
+    if (clock_ == nullptr)
+        throw std::invalid_argument("Clock is not specified.");
+}
+
+void AdmissionControl::setLimits(AdmissionLimits limits) {
+    std::lock_guard guard(limitsMutex_);
+    limits_ = limits;
+}
+
+AdmissionLimits AdmissionControl::getLimits() const {
+    std::lock_guard guard(limitsMutex_);
+    return limits_;
+}
+
+void AdmissionControl::setClock(std::shared_ptr<IClock> clock) {
+    if (clock == nullptr)
+        throw std::invalid_argument("Clock is not specified.");
+
+    std::lock_guard guard(limitsMutex_);
+
+    // the buckets keep what they have refilled so far
+    auto shiftMs = clock_->now().msecsTo(clock->now());
+    clock_       = clock;
+    for (auto& shard : shards_) {
+        std::lock_guard shardGuard(shard.mutex);
+        for (auto& state : shard.states)
+            state.refilled = state.refilled.addMSecs(shiftMs);
+    }
+}
+
+void AdmissionControl::getSettings(AdmissionLimits& limits, QDateTime& now) const {
+    std::shared_ptr<IClock> clock;
+    {
+        std::lock_guard guard(limitsMutex_);
+        limits = limits_;
+        clock  = clock_;
+    }
+    now = clock->now();
+}
+
+AdmissionControl::Result AdmissionControl::tryAdmit(const QString& token) {
+    AdmissionLimits limits;
+    QDateTime now;
+    getSettings(limits, now);
+
+    auto& shard = shardOf(token);
+    {
+        std::lock_guard guard(shard.mutex);
+
+        auto it = shard.states.find(token);
+        if (it == shard.states.end()) {
+            TokenState state;
+            state.tokens   = std::max(limits.burst, 1);
+            state.refilled = now;
+            it             = shard.states.insert(token, state);
+        }
+
+        auto& state = it.value();
+        if (limits.maxConcurrentRequests > 0 && state.inFlight >= limits.maxConcurrentRequests) {
+            ++concurrencyLimited_;
+            return Result::ConcurrencyLimited;
+        }
+
+        if (limits.requestsPerSecond > 0) {
+            refill(state, limits, now);
+            if (state.tokens < 1) {
+                ++rateLimited_;
+                return Result::RateLimited;
+            }
+
+            state.tokens -= 1;
+        }
+
+        ++state.inFlight;
+    }
+
+    ++admitted_;
+    return Result::Admitted;
+}
+
+void AdmissionControl::leave(const QString& token) {
+    AdmissionLimits limits;
+    QDateTime now;
+    getSettings(limits, now);
+
+    auto& shard = shardOf(token);
+    std::lock_guard guard(shard.mutex);
+
+    auto it = shard.states.find(token);
+    if (it == shard.states.end())
+        return;
+
+    auto& state = it.value();
+    --state.inFlight;
+
+    // an idle token with a full bucket is the same as an unknown one, forget it
+    refill(state, limits, now);
+    if (state.inFlight <= 0 &&
+        (limits.requestsPerSecond <= 0 || state.tokens >= std::max(limits.burst, 1)))
+        shard.states.erase(it);
+}
+
+AdmissionStatistics AdmissionControl::getStatistics() const {
+    AdmissionStatistics statistics;
+    statistics.admitted           = admitted_;
+    statistics.rateLimited        = rateLimited_;
+    statistics.concurrencyLimited = concurrencyLimited_;
+    return statistics;
+}
+
+AdmissionControl::Shard& AdmissionControl::shardOf(const QString& token) {
+    return shards_[qHash(token) % ShardCount];
+}
+
+void AdmissionControl::refill(TokenState& state,
+                              const AdmissionLimits& limits,
+                              const QDateTime& now)
+{
+    if (limits.requestsPerSecond <= 0)
+        return;
+
+    // a clock set back in time refills nothing
+    double elapsedSeconds = qMax<qint64>(0, state.refilled.msecsTo(now)) / 1000.0;
+    state.tokens   = std::min<double>(std::max(limits.burst, 1),
+                                    state.tokens + elapsedSeconds * limits.requestsPerSecond);
+    state.refilled = now;
+}
+
+AdmissionRejected::AdmissionRejected(AdmissionControl::Result result)
+    : std::runtime_error(result == AdmissionControl::Result::RateLimited
+                                 ? "Request rate of the token is over its limit."
+                                 : "Too many concurrent requests of the token.")
+    , result_(result)
+{}
+
+AdmissionControl::Result AdmissionRejected::getResult() const {
+    return result_;
+}
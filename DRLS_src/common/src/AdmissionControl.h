@@ -0,0 +1,94 @@
+#pragma once
+
+#include <QtCore>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+
+#include "common/src/Clock.h"
+
+namespace common {
+
+struct AdmissionLimits {
+    // sustained requests per second allowed for one token, zero or negative means unlimited
+    double requestsPerSecond = 0;
+    // requests a token may issue at once after being idle
+    int burst = 0;
+    // requests of one token being processed at the same time, zero or negative means unlimited
+    int maxConcurrentRequests = 0;
+};
+
+struct AdmissionStatistics {
+    quint64 admitted           = 0;
+    quint64 rateLimited        = 0;
+    quint64 concurrencyLimited = 0;
+};
+
+// Per-token token bucket and in-flight cap in front of the lock table. The state is sharded by
+// token, so rejecting a noisy caller never touches the lock table or blocks other tokens.
+class AdmissionControl {
+public:
+    enum class Result {
+        Admitted,
+        RateLimited,
+        ConcurrencyLimited,
+    };
+
+    AdmissionControl(std::shared_ptr<IClock> clock);
+
+    void setLimits(AdmissionLimits limits);
+    AdmissionLimits getLimits() const;
+
+    // the buckets refill by the time of this clock
+    void setClock(std::shared_ptr<IClock> clock);
+
+    // every Admitted result has to be paired with a leave() of the same token
+    Result tryAdmit(const QString& token);
+    void leave(const QString& token);
+
+    AdmissionStatistics getStatistics() const;
+
+private:
+    struct TokenState {
+        double tokens = 0;
+        QDateTime refilled;
+        int inFlight = 0;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        QHash<QString, TokenState> states;
+    };
+
+    Shard& shardOf(const QString& token);
+    void getSettings(AdmissionLimits& limits, QDateTime& now) const;
+    static void refill(TokenState& state, const AdmissionLimits& limits, const QDateTime& now);
+
+private:
+    static constexpr int ShardCount = 16;
+
+    mutable std::mutex limitsMutex_;
+    AdmissionLimits limits_;
+    std::shared_ptr<IClock> clock_;
+
+    std::array<Shard, ShardCount> shards_;
+
+    std::atomic<quint64> admitted_{0};
+    std::atomic<quint64> rateLimited_{0};
+    std::atomic<quint64> concurrencyLimited_{0};
+};
+
+// a call rejected by the admission control, it has not touched the lock table
+class AdmissionRejected : public std::runtime_error {
+public:
+    AdmissionRejected(AdmissionControl::Result result);
+
+    AdmissionControl::Result getResult() const;
+
+private:
+    AdmissionControl::Result result_;
+};
+
+}  // namespace common
@@ -1,4 +1,5 @@
 #include "AsyncTask.h"
+#include "TaskCore.h"
 #include "service/AsyncTaskService.h"
 #include "utils/ThreadHelper.h"
 #include "utils/Finally.h"
@@ -9,11 +10,9 @@
 
 using namespace common;
 
-std::recursive_mutex AsyncTask::aliveTasksCountMutex;
-int AsyncTask::aliveTasksCount = 0;
+std::atomic_int AsyncTask::aliveTasksCount{0};
 
-std::mutex AsyncTask::priorityMapMutex;
-std::map<QThread*, AsyncTask::Priority> AsyncTask::priorityMap;
+thread_local AsyncTask::Priority AsyncTask::currentPriority = AsyncTask::Priority::Normal;
 
 QString AsyncTask::priorityToString(const AsyncTask::Priority& priority) {
     switch (priority) {
@@ -34,21 +33,14 @@ QString AsyncTask::priorityToString(const AsyncTask::Priority& priority) {
 
 AsyncTask::AsyncTask(std::shared_ptr<AsyncTaskService> taskService,
                      std::function<bool(std::shared_ptr<AsyncTask>)> function)
-    : QObject(nullptr)
-    , taskService(taskService)
+    : taskService(taskService)
     , function(function)
-    , state(State::NotStarted)
-    , stateMutex()
-    , waitingForDeletion(false)
+    , core(new Core())
 {
-    {
-        std::lock_guard<std::recursive_mutex> lock(aliveTasksCountMutex);
-        aliveTasksCount++;
-        if (AsyncTaskService::log)
-            if (AsyncTaskService::log)
-                qDebug() << "Task created: " << reinterpret_cast<intptr_t>(this)
-                         << "(alive tasks: " << aliveTasksCount << ")";
-    }
+    int alive = aliveTasksCount.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (AsyncTaskService::log)
+        qDebug() << "Task created: " << reinterpret_cast<intptr_t>(this)
+                 << "(alive tasks: " << alive << ")";
 
 #ifdef DEBUG_SAVE_STACKTRACE
     constructedFrom = StackTraceHelper::getStackTrace();
@@ -56,27 +48,48 @@ AsyncTask::AsyncTask(std::shared_ptr<AsyncTaskService> taskService,
 }
 
 void AsyncTask::initialize() {
-    initialized = true;
+    core->initialized = true;
 }
 
 bool AsyncTask::isInitialized() const {
-    return initialized;
+    return core->initialized;
 }
 
 AsyncTask::~AsyncTask() {
+    int alive = aliveTasksCount.fetch_sub(1, std::memory_order_relaxed) - 1;
+    if (AsyncTaskService::log) qDebug() << "Task destroyed: " << reinterpret_cast<intptr_t>(this)
+             << "(alive tasks: " << alive << ")";
+
+    taskService->forgetTask(weak_from_this());
+    prepareForDeletion();
+
+    // the Destroyed handlers stay pinned in their slots while they are called
+    QVarLengthArray<HandlerSlot*, Core::InlineHandlers> destroyedHandlers;
     {
-        std::lock_guard<std::recursive_mutex> lock(aliveTasksCountMutex);
-        aliveTasksCount--;
-        if (AsyncTaskService::log) qDebug() << "Task destroyed: " << reinterpret_cast<intptr_t>(this)
-                 << "(alive tasks: " << aliveTasksCount << ")";
+        std::lock_guard<std::recursive_mutex> lock(core->signalHandlerMutex);
+        while (core->firstHandler != nullptr) {
+            auto slot = core->firstHandler;
+            if (slot->handler.signal == Signal::Destroyed) {
+                core->pin(slot);
+                destroyedHandlers.append(slot);
+            }
+            core->removeHandler(slot);
+        }
     }
 
-    prepareForDeletion();
+    if (destroyedHandlers.isEmpty())
+        return;
+
+    for (auto slot : destroyedHandlers)
+        slot->handler.callback(nullptr, State::Terminated);
+
+    std::lock_guard<std::recursive_mutex> lock(core->signalHandlerMutex);
+    for (auto slot : destroyedHandlers)
+        core->unpin(slot);
 }
 
 AsyncTask::State AsyncTask::getState() const {
-    std::lock_guard<std::recursive_mutex> lock(stateMutex);
-    return state;
+    return core->state.load(std::memory_order_acquire);
 }
 
 void AsyncTask::setState(const AsyncTask::State& value) {
@@ -86,48 +99,49 @@ void AsyncTask::setState(const AsyncTask::State& value) {
     //    from"
     //             << stateToString(state) << "to " << stateToString(v);
 
+    // Prevent immediately jumping over states
+    if (v == State::Running)
+        v = State::Starting;
+    if (v == State::Canceled)
+        v = State::Cancelling;
+    if (v == State::TimedOut)
+        v = State::TimingOut;
+    if (v == State::Finished)
+        v = State::Finishing;
+    if (v == State::Failed)
+        v = State::Failing;
+
     {
         // change the state
-        std::lock_guard<std::recursive_mutex> lock(stateMutex);
-        if (state == v)
-            return;
+        auto current = core->state.load(std::memory_order_acquire);
+        do {
+            if (current == v)
+                return;
 
-        // Prevent immediately jumping over states
-        if (v == State::Running)
-            v = State::Starting;
-        if (v == State::Canceled)
-            v = State::Cancelling;
-        if (v == State::TimedOut)
-            v = State::TimingOut;
-        if (v == State::Finished)
-            v = State::Finishing;
-        if (v == State::Failed)
-            v = State::Failing;
-
-        // Finished, Failed, Timeout and Canceled is only reachable from Running
-        if (state != State::Running && (v == State::Cancelling || v == State::TimingOut ||
-                                        v == State::Finishing || v == State::Failing))
-        {
-            //            if (AsyncTaskService::log) qDebug() << "Task's (" << reinterpret_cast<intptr_t>(this) << ") state
-            //            DIDN'T change to"
-            //                     << stateToString(v) << "because it's not Running.";
-            return;
-        }
+            // Finished, Failed, Timeout and Canceled is only reachable from Running
+            if (current != State::Running && (v == State::Cancelling || v == State::TimingOut ||
+                                              v == State::Finishing || v == State::Failing))
+            {
+                //            if (AsyncTaskService::log) qDebug() << "Task's (" << reinterpret_cast<intptr_t>(this) << ") state
+                //            DIDN'T change to"
+                //                     << stateToString(v) << "because it's not Running.";
+                return;
+            }
+        } while (!core->state.compare_exchange_weak(current, v, std::memory_order_acq_rel));
 
         if (AsyncTaskService::log) qDebug() << "Task's (" << reinterpret_cast<intptr_t>(this) << ") state changed from"
-                 << stateToString(state) << "to " << stateToString(v);
-        state = v;
+                 << stateToString(current) << "to " << stateToString(v);
     }
 
     auto f = util::finally([this]() {
         if (AsyncTaskService::log) qDebug() << "Task's (" << reinterpret_cast<intptr_t>(this) << ") new state is"
-                 << stateToString(state);
+                 << stateToString(getState());
     });
 
     bool ended                 = false;
     auto changeAllowedHandlers = [this](auto s) {
-        std::lock_guard<std::recursive_mutex> lock(signalHandlerMutex);
-        this->allowedHandlers = {s};
+        std::lock_guard<std::recursive_mutex> lock(core->signalHandlerMutex);
+        core->allowedHandlers = Core::stateBit(s);
     };
 
     if (v == State::Starting) {
@@ -152,9 +166,12 @@ void AsyncTask::setState(const AsyncTask::State& value) {
     } else if (v == State::Terminated) {
         changeAllowedHandlers(v);
         {
-            std::lock_guard<std::mutex> lock(this->noPendingHandlerCondVarsMutex);
-            for (auto cv : this->noPendingHandlerCondVars)
-                cv->notify_all();
+            std::lock_guard<std::recursive_mutex> lock(core->signalHandlerMutex);
+            for (auto& pending : core->pendingHandlers) {
+                // taking the mutex makes sure a waiter is either asleep or sees the new state
+                { std::lock_guard<std::mutex> pendingLock(pending->mutex); }
+                pending->noneLeft.notify_all();
+            }
         }
 
         emitTerminated(false);
@@ -162,22 +179,22 @@ void AsyncTask::setState(const AsyncTask::State& value) {
 
     if (ended) {
         emitEnded(true, v);
-        if (v != State::Finishing && !subtasks.empty()) {
-            std::lock_guard<std::recursive_mutex> lock(stateMutex);
-            if (AsyncTaskService::log) qDebug() << "Canceling" << subtasks.count() << "subtasks of"
+        if (v != State::Finishing && !core->subtasks.empty()) {
+            std::lock_guard<std::recursive_mutex> lock(core->stateMutex);
+            if (AsyncTaskService::log) qDebug() << "Canceling" << core->subtasks.count() << "subtasks of"
                      << reinterpret_cast<intptr_t>(this);
-            for (auto subtask : subtasks) {
+            for (auto subtask : core->subtasks) {
                 auto t = subtask.lock();
                 if (t != nullptr)
                     t->cancel();
             }
         }
     } else {
-        if (v == State::Terminated && !subtasks.empty()) {
-            std::lock_guard<std::recursive_mutex> lock(stateMutex);
-            if (AsyncTaskService::log) qDebug() << "Terminating" << subtasks.count() << "subtasks of"
+        if (v == State::Terminated && !core->subtasks.empty()) {
+            std::lock_guard<std::recursive_mutex> lock(core->stateMutex);
+            if (AsyncTaskService::log) qDebug() << "Terminating" << core->subtasks.count() << "subtasks of"
                      << reinterpret_cast<intptr_t>(this);
-            for (auto subtask : subtasks) {
+            for (auto subtask : core->subtasks) {
                 auto t = subtask.lock();
                 if (t != nullptr)
                     t->terminate();
@@ -185,88 +202,74 @@ void AsyncTask::setState(const AsyncTask::State& value) {
 
             if (AsyncTaskService::log) qDebug() << "Clearing subtasks on termination of"
                      << reinterpret_cast<intptr_t>(this);
-            subtasks.clear();
-        }
-    }
-
-    QList<State> finalStates = {State::Finished,
-                                State::Canceled,
-                                State::Failed,
-                                State::TimedOut,
-                                State::Terminated};
-
-    bool deleteTask = false;
-    {
-        // change the state
-        std::lock_guard<std::recursive_mutex> lock(stateMutex);
-        {
-            if (state != v)
-                return;
-
-            if (state == State::Starting)
-                v = State::Running;
-            else if (state == State::Finishing)
-                v = State::Finished;
-            else if (state == State::Cancelling)
-                v = State::Canceled;
-            else if (state == State::Failing)
-                v = State::Failed;
-            else if (state == State::TimingOut)
-                v = State::TimedOut;
-
-            if (state != v) {
-                if (AsyncTaskService::log) qDebug() << "Task's (" << reinterpret_cast<intptr_t>(this)
-                         << ") state changed from" << stateToString(state) << "to "
-                         << stateToString(v);
-                state = v;
-            }
-
-            if (autoRemove && finalStates.contains(v))
-                deleteTask = true;
+            core->subtasks.clear();
         }
     }
 
-    changeAllowedHandlers(state);
-
-    if (deleteTask)
+    // settle the intermediate state, unless the state has been changed by someone else meanwhile
+    auto settled = v;
+    if (v == State::Starting)
+        settled = State::Running;
+    else if (v == State::Finishing)
+        settled = State::Finished;
+    else if (v == State::Cancelling)
+        settled = State::Canceled;
+    else if (v == State::Failing)
+        settled = State::Failed;
+    else if (v == State::TimingOut)
+        settled = State::TimedOut;
+
+    auto expected = v;
+    if (!core->state.compare_exchange_strong(expected, settled, std::memory_order_acq_rel))
+        return;
+
+    if (settled != v && AsyncTaskService::log)
+        qDebug() << "Task's (" << reinterpret_cast<intptr_t>(this) << ") state changed from"
+                 << stateToString(v) << "to " << stateToString(settled);
+
+    changeAllowedHandlers(settled);
+
+    bool finalState = settled == State::Finished || settled == State::Canceled ||
+                      settled == State::Failed || settled == State::TimedOut ||
+                      settled == State::Terminated;
+    if (finalState && getAutoRemove())
         taskService->deleteTask(sfthis);
 }
 
 bool AsyncTask::isRunning() const {
-    std::lock_guard<std::recursive_mutex> lock(stateMutex);
+    auto state = getState();
     return state == State::Running || state == State::Starting;
 }
 
 bool AsyncTask::isFinished() const {
-    std::lock_guard<std::recursive_mutex> lock(stateMutex);
+    auto state = getState();
     return state == State::Finished || state == State::Finishing;
 }
 
 bool AsyncTask::isCanceled() const {
-    std::lock_guard<std::recursive_mutex> lock(stateMutex);
+    auto state = getState();
     return state == State::Canceled || state == State::Cancelling;
 }
 
 bool AsyncTask::isFailed() const {
-    std::lock_guard<std::recursive_mutex> lock(stateMutex);
+    auto state = getState();
     return state == State::Failed || state == State::Failing;
 }
 
 bool AsyncTask::isTimeout() const {
-    std::lock_guard<std::recursive_mutex> lock(stateMutex);
+    auto state = getState();
     return state == State::TimedOut || state == State::TimingOut;
 }
 
 bool AsyncTask::isEnded() const {
-    std::lock_guard<std::recursive_mutex> lock(stateMutex);
+    auto state = getState();
     return (state == State::TimedOut || state == State::TimingOut || state == State::Canceled ||
             state == State::Cancelling || state == State::Failed || state == State::Failing ||
             state == State::Finished || state == State::Finishing);
 }
 
 bool AsyncTask::isTerminated() const {
-    std::lock_guard<std::recursive_mutex> lock(stateMutex);
-    return state == State::Terminated;
+    return getState() == State::Terminated;
 }
 
 std::shared_ptr<AsyncTask> AsyncTask::runUnmanaged(std::optional<Priority> priority) {
@@ -306,95 +309,58 @@ void AsyncTask::remove() {
 }
 
 void AsyncTask::removeLater() {
-    QTimer::singleShot(0, this, std::bind(&AsyncTask::remove, this));
+    std::weak_ptr<AsyncTask> weakThis = shared_from_this();
+    QTimer::singleShot(0, taskService.get(), [weakThis]() {
+        auto task = weakThis.lock();
+        if (task != nullptr)
+            task->remove();
+    });
 }
 
 void AsyncTask::removeStartedHandler(const DelegateConnection& connection) {
-    std::lock_guard<std::recursive_mutex> lock(signalHandlerMutex);
-    BasicSignalConnection conn(connection);
-    for (auto& ptr : startedHandlers) {
-        if (*ptr == conn) {
-            this->startedHandlers.removeOne(ptr);
-            break;
-        }
-    }
+    removeBasicSignalHandler(Signal::Started, connection);
 }
 
 void AsyncTask::removeFinishedHandler(const DelegateConnection& connection) {
-    std::lock_guard<std::recursive_mutex> lock(signalHandlerMutex);
-    BasicSignalConnection conn(connection);
-    for (auto& ptr : finishedHandlers) {
-        if (*ptr == conn) {
-            this->finishedHandlers.removeOne(ptr);
-            break;
-        }
-    }
+    removeBasicSignalHandler(Signal::Finished, connection);
 }
 
 void AsyncTask::removeCanceledHandler(const DelegateConnection& connection) {
-    std::lock_guard<std::recursive_mutex> lock(signalHandlerMutex);
-    BasicSignalConnection conn(connection);
-    for (auto& ptr : canceledHandlers) {
-        if (*ptr == conn) {
-            this->canceledHandlers.removeOne(ptr);
-            break;
-        }
-    }
+    removeBasicSignalHandler(Signal::Canceled, connection);
 }
 
 void AsyncTask::removeFailedHandler(const DelegateConnection& connection) {
-    std::lock_guard<std::recursive_mutex> lock(signalHandlerMutex);
-    BasicSignalConnection conn(connection);
-    for (auto& ptr : failedHandlers) {
-        if (*ptr == conn) {
-            this->failedHandlers.removeOne(ptr);
-            break;
-        }
-    }
+    removeBasicSignalHandler(Signal::Failed, connection);
 }
 
 void AsyncTask::removeTimeoutHandler(const DelegateConnection& connection) {
-    std::lock_guard<std::recursive_mutex> lock(signalHandlerMutex);
-    BasicSignalConnection conn(connection);
-    for (auto& ptr : timeoutHandlers) {
-        if (*ptr == conn) {
-            this->timeoutHandlers.removeOne(ptr);
-            break;
-        }
-    }
+    removeBasicSignalHandler(Signal::Timeout, connection);
 }
 
 void AsyncTask::removeEndedHandler(const DelegateConnection& connection) {
-    std::lock_guard<std::recursive_mutex> lock(signalHandlerMutex);
-    BasicSignalConnection conn(connection);
-    for (auto ptr : endedHandlers) {
-        if (*ptr == conn) {
-            this->endedHandlers.removeOne(ptr);
-            break;
-        }
-    }
+    removeBasicSignalHandler(Signal::Ended, connection);
 }
 
 void AsyncTask::removeTerminatedHandler(const DelegateConnection& connection) {
-    std::lock_guard<std::recursive_mutex> lock(signalHandlerMutex);
-    BasicSignalConnection conn(connection);
-    for (auto& ptr : terminatedHandlers) {
-        if (*ptr == conn) {
-            this->terminatedHandlers.removeOne(ptr);
-            break;
-        }
-    }
+    removeBasicSignalHandler(Signal::Terminated, connection);
 }
 
 void AsyncTask::removeProgressHandler(const DelegateConnection& connection) {
-    std::lock_guard<std::recursive_mutex> lock(signalHandlerMutex);
-    BasicSignalConnection conn(connection);
-    for (auto ptr : progressHandlers) {
-        if (*ptr == conn) {
-            this->progressHandlers.removeOne(ptr);
-            break;
-        }
-    }
+    removeBasicSignalHandler(Signal::Progress, connection);
+}
+
+void AsyncTask::removeDestroyedHandler(const DelegateConnection& connection) {
+    removeBasicSignalHandler(Signal::Destroyed, connection);
+}
+
+void AsyncTask::removeBasicSignalHandler(Signal signal, const DelegateConnection& connection) {
+    if (connection.isEmpty())
+        return;
+
+    std::lock_guard<std::recursive_mutex> lock(core->signalHandlerMutex);
+    auto slot = core->findSlot(connection);
+    if (slot != nullptr && slot->handler.signal == signal)
+        core->removeHandler(slot);
 }
 
 bool AsyncTask::runCore(Priority priority) {
@@ -409,9 +375,9 @@ bool AsyncTask::runCore(Priority priority) {
     if (isNoOpTask())
         throw std::runtime_error("Cannot run no-op tasks.");
 
-    exception   = nullptr;
-    progress    = 0;
-    bool result = false;
+    core->exception = nullptr;
+    core->progress  = 0;
+    bool result     = false;
 
     if (this->getState() != State::Running) {
         if (AsyncTaskService::log) qDebug() << "Task (" << reinterpret_cast<intptr_t>(this)
@@ -419,30 +385,25 @@ bool AsyncTask::runCore(Priority priority) {
         return false;
     }
 
-    {
-        std::lock_guard<std::mutex> lock(priorityMapMutex);
-        priorityMap[QThread::currentThread()] = priority;
-    }
+    // tasks run synchronously from another task restore the priority of the outer one
+    auto outerPriority = currentPriority;
+    currentPriority    = priority;
+    auto restorePriority = util::finally([outerPriority]() { currentPriority = outerPriority; });
 
     try {
-        result   = function(shared_from_this());
-        progress = 100;
+        result         = function(shared_from_this());
+        core->progress = 100;
     } catch (const std::exception& e) {
         auto t = typeid(e).name();
         qCritical("Exception of type '%s' occurred while running task %ld. Message: %s",
                   t,
                   reinterpret_cast<intptr_t>(this),
                   e.what());
-        this->exception = std::current_exception();
+        core->exception = std::current_exception();
     } catch (...) {
         qCritical("Unknown error occurred while running task %ld.",
                   reinterpret_cast<intptr_t>(this));
-        this->exception = std::current_exception();
-    }
-
-    {
-        std::lock_guard<std::mutex> lock(priorityMapMutex);
-        priorityMap.erase(QThread::currentThread());
+        core->exception = std::current_exception();
     }
 
     return result;
@@ -453,143 +414,201 @@ std::shared_ptr<AsyncTaskService> AsyncTask::getTaskService() const {
 }
 
 QString AsyncTask::getStateString() const {
-    std::lock_guard<std::recursive_mutex> lock(stateMutex);
-    return stateToString(state);
+    return stateToString(getState());
 }
 
 int AsyncTask::getProgress() const {
-    std::lock_guard<std::recursive_mutex> lock(stateMutex);
-    return progress;
+    std::lock_guard<std::recursive_mutex> lock(core->stateMutex);
+    return core->progress;
 }
 
 bool AsyncTask::isWaitingForDeletion() const {
-    std::lock_guard<std::recursive_mutex> lock(stateMutex);
-    return waitingForDeletion;
+    return core->waitingForDeletion;
 }
 
-void AsyncTask::emitStarted(bool waitForCompletion) const {
-    emitBasicSignals(startedHandlers, waitForCompletion, State::Starting);
+void AsyncTask::emitStarted(bool waitForCompletion) {
+    emitBasicSignals(Signal::Started, waitForCompletion, State::Starting);
 }
 
-void AsyncTask::emitFinished(bool waitForCompletion) const {
-    emitBasicSignals(finishedHandlers, waitForCompletion, State::Finishing);
+void AsyncTask::emitFinished(bool waitForCompletion) {
+    emitBasicSignals(Signal::Finished, waitForCompletion, State::Finishing);
 }
 
-void AsyncTask::emitFailed(bool waitForCompletion) const {
-    emitBasicSignals(failedHandlers, waitForCompletion, State::Failing);
+void AsyncTask::emitFailed(bool waitForCompletion) {
+    emitBasicSignals(Signal::Failed, waitForCompletion, State::Failing);
 }
 
-void AsyncTask::emitCanceled(bool waitForCompletion) const {
-    emitBasicSignals(canceledHandlers, waitForCompletion, State::Cancelling);
+void AsyncTask::emitCanceled(bool waitForCompletion) {
+    emitBasicSignals(Signal::Canceled, waitForCompletion, State::Cancelling);
 }
 
-void AsyncTask::emitTimeout(bool waitForCompletion) const {
-    emitBasicSignals(timeoutHandlers, waitForCompletion, State::TimingOut);
+void AsyncTask::emitTimeout(bool waitForCompletion) {
+    emitBasicSignals(Signal::Timeout, waitForCompletion, State::TimingOut);
 }
 
-void AsyncTask::emitEnded(bool waitForCompletion, const State& invocationState) const {
-    emitBasicSignals(endedHandlers, waitForCompletion, invocationState);
+void AsyncTask::emitEnded(bool waitForCompletion, const State& invocationState) {
+    emitBasicSignals(Signal::Ended, waitForCompletion, invocationState);
 }
 
-void AsyncTask::emitTerminated(bool waitForCompletion) const {
-    emitBasicSignals(terminatedHandlers, waitForCompletion, State::Terminated);
+void AsyncTask::emitTerminated(bool waitForCompletion) {
+    emitBasicSignals(Signal::Terminated, waitForCompletion, State::Terminated);
 }
 
-void AsyncTask::emitProgress(bool waitForCompletion) const {
-    emitBasicSignals(progressHandlers, waitForCompletion, State::Running);
+void AsyncTask::emitProgress(bool waitForCompletion) {
+    emitBasicSignals(Signal::Progress, waitForCompletion, State::Running);
 }
 
-void AsyncTask::emitBasicSignals(const QList<std::shared_ptr<BasicSignalConnection>>& handlers,
+void AsyncTask::emitBasicSignals(Signal signal,
                                  bool waitForCompletion,
-                                 const State& invocationState) const
+                                 const State& invocationState)
 {
-    QList<std::shared_ptr<BasicSignalConnection>> copyOfHandlers;
+    // the matching slots are pinned, so a handler disconnected meanwhile stays valid till the
+    // emission is done with it
+    QVarLengthArray<HandlerSlot*, Core::InlineHandlers> matching;
     {
-        std::lock_guard<std::recursive_mutex> lock(signalHandlerMutex);
-        if (handlers.empty()) {
-            //            if (AsyncTaskService::log) qDebug() << "No handlers for task" << reinterpret_cast<intptr_t>(this)
-            //                     << "- invocationState:" << stateToString(invocationState);
-            return;
+        std::lock_guard<std::recursive_mutex> lock(core->signalHandlerMutex);
+        for (auto slot = core->firstHandler; slot != nullptr; slot = slot->next) {
+            if (slot->handler.signal == signal) {
+                core->pin(slot);
+                matching.append(slot);
+            }
         }
 
-        if (AsyncTaskService::log) qDebug() << "Emitting" << handlers.count() << " handlers of"
-                 << reinterpret_cast<intptr_t>(this)
-                 << "- invocationState:" << stateToString(invocationState);
+        if (matching.isEmpty())
+            return;
 
-        // sometimes it is required to dispose handlers immediately after its execution
-        // in this case the destruction must be done from the same thread
-        copyOfHandlers = handlers;
+        if (AsyncTaskService::log)
+            qDebug() << "Emitting" << matching.count() << " handlers of"
+                     << reinterpret_cast<intptr_t>(this)
+                     << "- invocationState:" << stateToString(invocationState);
     }
 
-    auto pendingHandlers   = std::make_shared<int>(0);
-    auto waitHandlersMutex = std::make_shared<std::mutex>();
-    auto noPendingHandlers = std::make_shared<std::condition_variable>();
+    // slots are unpinned by their receivers, the ones never handed over are unpinned here
+    int handedOver = 0;
+    auto unpinRest = util::finally([this, &matching, &handedOver]() {
+        if (handedOver == matching.count())
+            return;
 
-    {
-        std::lock_guard<std::mutex> lock(this->noPendingHandlerCondVarsMutex);
-        this->noPendingHandlerCondVars.append(noPendingHandlers);
-    }
+        std::lock_guard<std::recursive_mutex> lock(core->signalHandlerMutex);
+        for (int i = handedOver; i < matching.count(); ++i)
+            core->unpin(matching[i]);
+    });
 
-    auto decrease = util::finally([this, noPendingHandlers]() {
-        std::lock_guard<std::mutex> lock(this->noPendingHandlerCondVarsMutex);
-        this->noPendingHandlerCondVars.removeOne(noPendingHandlers);
+    // only allocated once a handler is dispatched to the application thread
+    std::shared_ptr<Core::PendingHandlers> pending;
+    auto unregister = util::finally([this, &pending]() {
+        if (pending == nullptr)
+            return;
+
+        std::lock_guard<std::recursive_mutex> lock(core->signalHandlerMutex);
+        core->pendingHandlers.removeOne(pending);
     });
 
-    while (copyOfHandlers.count() > 0) {
-        BasicSignalConnection* rawHandler;
+    std::weak_ptr<AsyncTask> weakThis = weak_from_this();
+    auto taskCore                     = core;
+
+    for (auto slot : matching) {
         {
-            std::lock_guard<std::recursive_mutex> lock(signalHandlerMutex);
-            if (!allowedHandlers.contains(invocationState)) {
+            std::lock_guard<std::recursive_mutex> lock(core->signalHandlerMutex);
+            if (!(core->allowedHandlers & Core::stateBit(invocationState))) {
                 if (AsyncTaskService::log) qDebug() << "Emission of handlers has been interrupted due to changes in task's"
                          << reinterpret_cast<intptr_t>(this) << "state";
                 break;
             }
+        }
+
+        ++handedOver;
 
+        // the slot stays pinned, so the handler is not destroyed till its execution is finished
+        auto receive = [weakThis, taskCore, slot, invocationState]() {
+            auto unpin = util::finally([taskCore, slot]() {
+                std::lock_guard<std::recursive_mutex> lock(taskCore->signalHandlerMutex);
+                taskCore->unpin(slot);
+            });
+
+            auto task = weakThis.lock();
+            if (task == nullptr)
+                return;
+
+            // if signal handler invocation is suppressed by changes in task's state, do nothing
             {
-                auto handler               = copyOfHandlers[0];
-                *handler->stateWhenInvoked = invocationState;
+                std::lock_guard<std::recursive_mutex> lock(taskCore->signalHandlerMutex);
+                if (!(taskCore->allowedHandlers & Core::stateBit(invocationState))) {
+                    if (AsyncTaskService::log)
+                        qDebug() << "Dispatching of signal has been canceled due to changes in"
+                                 << "task's (" << reinterpret_cast<intptr_t>(task.get())
+                                 << ") state.";
+                    return;
+                }
+            }
 
-                // prevent handler from deletion till its execution is finished
-                handler->receiver->keepAlive(handler);
-                rawHandler = handler.get();
+            const Handler& handler = slot->handler;
+            try {
+                handler.callback(task, invocationState);
+            } catch (const std::exception& e) {
+                qCritical("Exception occurred while running handler of task %ld. Message: %s",
+                          reinterpret_cast<intptr_t>(task.get()),
+                          e.what());
+            } catch (...) {
+                qCritical("Unknown error occurred while running handler of task %ld.",
+                          reinterpret_cast<intptr_t>(task.get()));
             }
-            copyOfHandlers.removeAt(0);
+
+            // remove callback immediately if task is disposable
+            // this ensures that destructor of lambdas will be run on the same thread
+            if (taskCore->autoRemove && handler.autoDisconnect)
+                task->removeBasicSignalHandler(handler.signal, handler.connection);
+        };
+
+        // only handlers restoring the context of the application thread need a receiver object,
+        // the rest are invoked right here
+        if (!slot->handler.restoreContext ||
+            QThread::currentThread() == QCoreApplication::instance()->thread())
+        {
+            receive();
+            continue;
         }
 
-        //            bool restore = rawHandler->restoreContext;
-        //            if (AsyncTaskService::log) qDebug() << "Doing dispatch - restore:" << restore << " task:"
-        //                     << reinterpret_cast<intptr_t>(this) << "pending handlers:" <<
-        //                     static_cast<int>(this->pendingHandlers)
-        //                     << "- invocationState:" << stateToString(invocationState);
+        if (pending == nullptr) {
+            pending = std::make_shared<Core::PendingHandlers>();
+            std::lock_guard<std::recursive_mutex> lock(core->signalHandlerMutex);
+            core->pendingHandlers.append(pending);
+        }
 
         {
-            std::lock_guard<std::mutex> lokk(*waitHandlersMutex);
-            (*pendingHandlers)++;
+            std::lock_guard<std::mutex> lock(pending->mutex);
+            pending->count++;
         }
 
-        rawHandler->doDispatch([pendingHandlers, noPendingHandlers, waitHandlersMutex]() {
+        auto onDispatchFinished = [pending]() {
             {
-                std::lock_guard<std::mutex> lokk(*waitHandlersMutex);
-                (*pendingHandlers)--;
+                std::lock_guard<std::mutex> lock(pending->mutex);
+                pending->count--;
             }
 
-            (*noPendingHandlers).notify_all();
-        });
-        //            if (AsyncTaskService::log) qDebug() << "Done dispatch - restore:" << restore << " task:"
-        //                     << reinterpret_cast<intptr_t>(this) << "pending handlers:" <<
-        //                     static_cast<int>(this->pendingHandlers);
+            pending->noneLeft.notify_all();
+        };
+
+        auto receiver = std::make_shared<util::ContextReceiver>(receive);
+        receiver->moveToThread(QCoreApplication::instance()->thread());
+        auto dispatcher =
+                std::make_shared<util::ContextDispatcher>(receiver, util::DispatchMethod::Async);
+        QObject::connect(receiver.get(), &util::ContextReceiver::finished, onDispatchFinished);
+
+        dispatcher->doDispatch();
     }
 
-    if (waitForCompletion) {
+    // handlers run right here have completed already
+    if (waitForCompletion && pending != nullptr) {
         if (AsyncTaskService::log) qDebug() << "Waiting handlers of" << reinterpret_cast<intptr_t>(this) << "to complete";
 
         // wait all tasks to complete
-        std::unique_lock<std::mutex> handlerLock(*waitHandlersMutex);
-        (*noPendingHandlers).wait(handlerLock, [this, pendingHandlers] {
+        std::unique_lock<std::mutex> handlerLock(pending->mutex);
+        pending->noneLeft.wait(handlerLock, [this, &pending] {
             if (this->isTerminated())
                 return true;
 
-            return (*pendingHandlers) == 0;
+            return pending->count == 0;
         });
 
         if (AsyncTaskService::log) qDebug() << "Handlers of" << reinterpret_cast<intptr_t>(this)
@@ -598,36 +617,31 @@ void AsyncTask::emitBasicSignals(const QList<std::shared_ptr<BasicSignalConnecti
 }
 
 void AsyncTask::prepareForDeletion() {
+    // the maintained objects are destroyed when leaving, outside of the lock
+    std::unique_ptr<std::map<std::shared_ptr<QObject>, bool>> maintainedObjects;
     {
-        std::lock_guard<std::recursive_mutex> lock(stateMutex);
-        waitingForDeletion = true;
+        std::lock_guard<std::recursive_mutex> lock(core->stateMutex);
+        core->waitingForDeletion = true;
 
-        if (state != State::Terminated)
-            subtasks.clear();
-    }
+        if (getState() != State::Terminated)
+            core->subtasks.clear();
 
-    {
-        std::lock_guard<std::mutex> lock(maintainedMutex);
-        maintainedObjects.clear();
+        maintainedObjects = std::move(core->maintainedObjects);
     }
 
-    std::lock_guard<std::recursive_mutex> lock(signalHandlerMutex);
+    std::lock_guard<std::recursive_mutex> lock(core->signalHandlerMutex);
     //    if (AsyncTaskService::log) qDebug() << "Task (" << reinterpret_cast<intptr_t>(this) << ") is preparing for
     //    deletion.";
-    startedHandlers.clear();
-    finishedHandlers.clear();
-    failedHandlers.clear();
-    canceledHandlers.clear();
-    timeoutHandlers.clear();
-    endedHandlers.clear();
-    progressHandlers.clear();
-    terminatedHandlers.clear();
+    for (auto slot = core->firstHandler; slot != nullptr;) {
+        auto next = slot->next;
+        if (slot->handler.signal != Signal::Destroyed)
+            core->removeHandler(slot);
+        slot = next;
+    }
 }
 
 AsyncTask::Priority AsyncTask::getCurrentPriority() {
-    std::lock_guard<std::mutex> lock(priorityMapMutex);
-    auto t = QThread::currentThread();
-    return priorityMap.contains(t) ? priorityMap[t] : Priority::Normal;
+    return currentPriority;
 }
 
 std::shared_ptr<AsyncTask> AsyncTask::onStarted(
@@ -635,10 +649,8 @@ std::shared_ptr<AsyncTask> AsyncTask::onStarted(
         bool restoreContext,
         DelegateConnection* connection)
 {
-    auto stateWhenInvoked = std::make_shared<State>();
-    connectBasicSignals(callback,
-                        startedHandlers,
-                        stateWhenInvoked,
+    connectBasicSignals(Signal::Started,
+                        [callback](std::shared_ptr<AsyncTask> t, State) { callback(t); },
                         restoreContext,
                         true,
                         connection);
@@ -650,10 +662,8 @@ std::shared_ptr<AsyncTask> AsyncTask::onFinished(
         bool restoreContext,
         DelegateConnection* connection)
 {
-    auto stateWhenInvoked = std::make_shared<State>();
-    connectBasicSignals(callback,
-                        finishedHandlers,
-                        stateWhenInvoked,
+    connectBasicSignals(Signal::Finished,
+                        [callback](std::shared_ptr<AsyncTask> t, State) { callback(t); },
                         restoreContext,
                         true,
                         connection);
@@ -665,10 +675,8 @@ std::shared_ptr<AsyncTask> AsyncTask::onFailed(
         bool restoreContext,
         DelegateConnection* connection)
 {
-    auto stateWhenInvoked = std::make_shared<State>();
-    connectBasicSignals(callback,
-                        failedHandlers,
-                        stateWhenInvoked,
+    connectBasicSignals(Signal::Failed,
+                        [callback](std::shared_ptr<AsyncTask> t, State) { callback(t); },
                         restoreContext,
                         true,
                         connection);
@@ -680,10 +688,8 @@ std::shared_ptr<AsyncTask> AsyncTask::onCanceled(
         bool restoreContext,
         DelegateConnection* connection)
 {
-    auto stateWhenInvoked = std::make_shared<State>();
-    connectBasicSignals(callback,
-                        canceledHandlers,
-                        stateWhenInvoked,
+    connectBasicSignals(Signal::Canceled,
+                        [callback](std::shared_ptr<AsyncTask> t, State) { callback(t); },
                         restoreContext,
                         true,
                         connection);
@@ -695,10 +701,8 @@ std::shared_ptr<AsyncTask> AsyncTask::onTimeout(
         bool restoreContext,
         DelegateConnection* connection)
 {
-    auto stateWhenInvoked = std::make_shared<State>();
-    connectBasicSignals(callback,
-                        timeoutHandlers,
-                        stateWhenInvoked,
+    connectBasicSignals(Signal::Timeout,
+                        [callback](std::shared_ptr<AsyncTask> t, State) { callback(t); },
                         restoreContext,
                         true,
                         connection);
@@ -710,17 +714,11 @@ std::shared_ptr<AsyncTask> AsyncTask::onEnded(
         bool restoreContext,
         DelegateConnection* connection)
 {
-    auto stateWhenInvoked = std::make_shared<State>();
-    auto wrapper          = [stateWhenInvoked, callback](std::shared_ptr<AsyncTask> t) {
-        callback(t, *stateWhenInvoked == State::Finishing);
+    auto wrapper = [callback](std::shared_ptr<AsyncTask> t, State stateWhenInvoked) {
+        callback(t, stateWhenInvoked == State::Finishing);
     };
 
-    connectBasicSignals(wrapper,
-                        endedHandlers,
-                        stateWhenInvoked,
-                        restoreContext,
-                        true,
-                        connection);
+    connectBasicSignals(Signal::Ended, wrapper, restoreContext, true, connection);
     return shared_from_this();
 }
 
@@ -729,10 +727,8 @@ std::shared_ptr<AsyncTask> AsyncTask::onTerminated(
         bool restoreContext,
         DelegateConnection* connection)
 {
-    auto stateWhenInvoked = std::make_shared<State>();
-    connectBasicSignals(callback,
-                        terminatedHandlers,
-                        stateWhenInvoked,
+    connectBasicSignals(Signal::Terminated,
+                        [callback](std::shared_ptr<AsyncTask> t, State) { callback(t); },
                         restoreContext,
                         true,
                         connection);
@@ -744,121 +740,64 @@ std::shared_ptr<AsyncTask> AsyncTask::onProgress(
         bool restoreContext,
         DelegateConnection* connection)
 {
-    auto stateWhenInvoked = std::make_shared<State>();
-    auto wrapper          = [stateWhenInvoked, callback](std::shared_ptr<AsyncTask> t) {
-        callback(t, t->progress);
+    auto wrapper = [callback](std::shared_ptr<AsyncTask> t, State) {
+        callback(t, t->getProgress());
     };
 
-    connectBasicSignals(wrapper,
-                        progressHandlers,
-                        stateWhenInvoked,
-                        restoreContext,
+    connectBasicSignals(Signal::Progress, wrapper, restoreContext, false, connection);
+    return shared_from_this();
+}
+
+std::shared_ptr<AsyncTask> AsyncTask::onDestroyed(std::function<void()> callback,
+                                                  DelegateConnection* connection)
+{
+    connectBasicSignals(Signal::Destroyed,
+                        [callback](std::shared_ptr<AsyncTask>, State) { callback(); },
+                        false,
                         false,
                         connection);
     return shared_from_this();
 }
 
-void AsyncTask::connectBasicSignals(std::function<void(std::shared_ptr<AsyncTask>)> callback,
-                                    QList<std::shared_ptr<BasicSignalConnection>>& handlerList,
-                                    std::shared_ptr<State> stateWhenInvokedPtr,
+void AsyncTask::connectBasicSignals(Signal signal,
+                                    std::function<void(std::shared_ptr<AsyncTask>, State)> callback,
                                     bool restoreContext,
                                     bool autoDisconnect,
                                     DelegateConnection* connection)
 {
-    auto sfthis                       = shared_from_this();
-    std::weak_ptr<AsyncTask> weakThis = sfthis;
-    auto connHolder                   = std::make_shared<DelegateConnection>();
-    auto receiver = std::make_shared<util::ContextReceiver>([this,
-                                                             weakThis,
-                                                             stateWhenInvokedPtr,
-                                                             callback,
-                                                             connHolder,
-                                                             &handlerList,
-                                                             autoDisconnect]() {
-        auto task = weakThis.lock();
-        if (task == nullptr)
-            return;
-
-        //        if (AsyncTaskService::log) qDebug() << "Preparing for dispatch of signal related to task ("
-        //                    << reinterpret_cast<intptr_t>(this) << ").";
-
-        // if signal handler invocation is suppressed by changes in task's state, do nothing
-        {
-            std::lock_guard<std::recursive_mutex> lock(signalHandlerMutex);
-            if (!allowedHandlers.contains(*stateWhenInvokedPtr)) {
-                if (AsyncTaskService::log) qDebug() << "Dispatching of signal has been canceled due to changes in task's ("
-                         << reinterpret_cast<intptr_t>(this) << ") state.";
-                return;
-            }
-        }
-
-        callback(task);
-
-        // remove callback immediately if task is disposable
-        // this ensures that destructor of lambdas will be run on the same thread
-        if (autoRemove && autoDisconnect) {
-            std::lock_guard<std::recursive_mutex> lock(signalHandlerMutex);
-            for (auto ptr : handlerList) {
-                if (ptr->connection == *connHolder) {
-                    //                    if (AsyncTaskService::log) qDebug() << "Removing handler from: " <<
-                    //                    reinterpret_cast<intptr_t>(this) <<
-                    //                    reinterpret_cast<intptr_t>(that)
-                    //                             << "receiver: " <<
-                    //                             reinterpret_cast<intptr_t>(ptr->receiver.get());
-                    handlerList.removeOne(ptr);
-                    break;
-                }
-            }
-        }
-    });
-
-    // target thread must be running an event loop
-    // update: target thread must always be the main thread
-    if (restoreContext && QCoreApplication::instance()->thread() != receiver->thread()) {
-        receiver->moveToThread(QCoreApplication::instance()->thread());
-        //        throw std::runtime_error("Task's context can be restored only if caller is
-        //        belonging to Application thread.");
-    }
-
-    auto connRaw = new BasicSignalConnection(DelegateConnection(),
-                                             receiver,
-                                             stateWhenInvokedPtr,
-                                             restoreContext);
-    auto conn    = std::shared_ptr<BasicSignalConnection>(connRaw);
-    *connHolder  = conn->connection;
+    std::lock_guard<std::recursive_mutex> lock(core->signalHandlerMutex);
+    auto slot = core->addHandler(Handler{
+            signal, DelegateConnection(), std::move(callback), restoreContext, autoDisconnect});
+    slot->handler.connection = DelegateConnection(slot);
     if (connection != nullptr)
-        *connection = conn->connection;
-
-    std::lock_guard<std::recursive_mutex> lock(signalHandlerMutex);
-    handlerList.append(conn);
+        *connection = slot->handler.connection;
 }
 
 bool AsyncTask::getAutoRemove() const {
-    return autoRemove;
+    return core->autoRemove;
 }
 
 std::shared_ptr<AsyncTask> AsyncTask::setAutoRemove(bool value) {
-    std::lock_guard<std::recursive_mutex> lock(stateMutex);
-    autoRemove = value;
+    core->autoRemove = value;
     return shared_from_this();
 }
 
 int AsyncTask::getTimeout() const {
-    return timeoutMs;
+    return core->timeoutMs;
 }
 
 std::shared_ptr<AsyncTask> AsyncTask::setTimeout(int timeoutMs) {
-    this->timeoutMs = timeoutMs;
+    core->timeoutMs = timeoutMs;
     return shared_from_this();
 }
 
 void AsyncTask::reportProgress(int percent) {
     {
-        std::lock_guard<std::recursive_mutex> lock(stateMutex);
-        if (state != AsyncTask::State::Running)
+        std::lock_guard<std::recursive_mutex> lock(core->stateMutex);
+        if (getState() != AsyncTask::State::Running)
             return;
 
-        this->progress = qMax(0, qMin(100, percent));
+        core->progress = qMax(0, qMin(100, percent));
     }
 
     emitProgress(true);
@@ -869,80 +808,58 @@ bool AsyncTask::isNoOpTask() const {
 }
 
 void AsyncTask::throwStoredException() const {
-    if (exception != nullptr)
-        std::rethrow_exception(exception);
+    if (core->exception != nullptr)
+        std::rethrow_exception(core->exception);
 }
 
 std::exception_ptr AsyncTask::getStoredException() const {
-    return exception;
+    return core->exception;
 }
 
 std::shared_ptr<AsyncTask> AsyncTask::addMaintainedObject(std::shared_ptr<QObject> object,
                                                           bool isPermanent)
 {
-    std::lock_guard<std::mutex> lock(maintainedMutex);
-    this->maintainedObjects[object] = isPermanent;
+    std::lock_guard<std::recursive_mutex> lock(core->stateMutex);
+    if (core->maintainedObjects == nullptr)
+        core->maintainedObjects = std::make_unique<std::map<std::shared_ptr<QObject>, bool>>();
+    (*core->maintainedObjects)[object] = isPermanent;
     return shared_from_this();
 }
 
 std::shared_ptr<AsyncTask> AsyncTask::removeMaintainedObject(std::shared_ptr<QObject> object) {
-    std::lock_guard<std::mutex> lock(maintainedMutex);
-    this->maintainedObjects.erase(object);
-    return shared_from_this();
-}
-
-std::shared_ptr<AsyncTask> AsyncTask::clearMaintainedObjects(bool clearPermanentObjects) {
-    std::lock_guard<std::mutex> lock(maintainedMutex);
-    for (auto [o,l] : maintainedObjects)
-        if (clearPermanentObjects || !l)
-            maintainedObjects.erase(o);
+    std::shared_ptr<QObject> removed;  // destroyed outside of the lock
+    {
+        std::lock_guard<std::recursive_mutex> lock(core->stateMutex);
+        if (core->maintainedObjects == nullptr)
+            return shared_from_this();
+
+        auto it = core->maintainedObjects->find(object);
+        if (it != core->maintainedObjects->end()) {
+            removed = it->first;
+            core->maintainedObjects->erase(it);
+        }
+    }
 
     return shared_from_this();
 }
 
-bool BasicSignalConnection::operator==(const BasicSignalConnection& other) const {
-    return this->connection == other.connection;
-}
-
-bool BasicSignalConnection::operator!=(const BasicSignalConnection& other) const {
-    return this->connection != other.connection;
-}
-
-void BasicSignalConnection::doDispatch(std::function<void()> onDispatchFinished) const {
-    if (!this->restoreContext) {
-        this->receiver->receive();
-        if (onDispatchFinished != nullptr)
-            onDispatchFinished();
-    } else {
-        auto dispatcher =
-                std::make_shared<util::ContextDispatcher>(this->receiver,
-                                                          util::DispatchMethod::Async);
-        connect(this->receiver.get(), &util::ContextReceiver::finished, onDispatchFinished);
-
-        dispatcher->doDispatch();
+std::shared_ptr<AsyncTask> AsyncTask::clearMaintainedObjects(bool clearPermanentObjects) {
+    QList<std::shared_ptr<QObject>> removed;  // destroyed outside of the lock
+    {
+        std::lock_guard<std::recursive_mutex> lock(core->stateMutex);
+        if (core->maintainedObjects == nullptr)
+            return shared_from_this();
+
+        auto& objects = *core->maintainedObjects;
+        for (auto it = objects.begin(); it != objects.end();) {
+            if (clearPermanentObjects || !it->second) {
+                removed.append(it->first);
+                it = objects.erase(it);
+            } else {
+                ++it;
+            }
+        }
     }
-}
 
-BasicSignalConnection::BasicSignalConnection()
-    : connection(), receiver(nullptr), stateWhenInvoked(nullptr), restoreContext(false)
-{
-}
-
-BasicSignalConnection::BasicSignalConnection(const DelegateConnection& connection)
-    : connection(connection)
-    , receiver(nullptr)
-    , stateWhenInvoked(nullptr)
-    , restoreContext(false)
-{
-}
-
-BasicSignalConnection::BasicSignalConnection(const DelegateConnection& connection,
-                                             std::shared_ptr<util::ContextReceiver> receiver,
-                                             std::shared_ptr<AsyncTask::State> stateWhenInvoked,
-                                             bool restoreContext)
-    : connection(connection)
-    , receiver(receiver)
-    , stateWhenInvoked(stateWhenInvoked)
-    , restoreContext(restoreContext)
-{
+    return shared_from_this();
 }
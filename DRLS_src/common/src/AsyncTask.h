@@ -10,6 +10,7 @@
 
 #include "common/src/Delegate.h"
 #include "common/src/TaskManager.h"
+#include "utils/IntrusivePtr.h"
 
 namespace  util {
 class ContextReceiver;
@@ -17,7 +18,6 @@ class ContextDispatcher;
 }
 
 namespace common {
-class BasicSignalConnection;
 class AsyncTaskService;
 
 template<typename TResult>
@@ -28,12 +28,10 @@ using AsyncTaskPtr = std::shared_ptr<common::AsyncTask>;
 template<typename Ret>
 using AsyncFuncPtr = std::shared_ptr<common::AsyncFunction<Ret>>;
 
-class AsyncTask
-    : public QObject
-    , public std::enable_shared_from_this<AsyncTask>
-{
-    Q_OBJECT
-
+// Facade of a task. The state, the handlers and everything else touched while the task runs
+// live in a pool allocated Core (see TaskCore.h), which is not a QObject, so creating, running
+// and destroying a task costs a couple of small allocations instead of a QObject per handler.
+class AsyncTask : public std::enable_shared_from_this<AsyncTask> {
     friend class AsyncTaskService;
 
 public:
@@ -98,82 +96,62 @@ public:
     virtual void initialize();
     bool isInitialized() const;
 
+protected:
+    // the signals handlers can be connected to
+    enum class Signal : quint8 {
+        Started,
+        Finished,
+        Failed,
+        Canceled,
+        Timeout,
+        Ended,
+        Terminated,
+        Progress,
+        Destroyed
+    };
+
+    struct Core;
+    struct Handler;
+    struct HandlerSlot;
+
 private:
-    static std::recursive_mutex aliveTasksCountMutex;
-    static int aliveTasksCount;
-    static std::mutex priorityMapMutex;
-    static std::map<QThread*, Priority> priorityMap;
+    static std::atomic_int aliveTasksCount;
+    static thread_local Priority currentPriority;
 
     std::shared_ptr<AsyncTaskService> taskService;
     std::function<bool(std::shared_ptr<AsyncTask>)> function;
-    QList<std::weak_ptr<AsyncTask>> subtasks = {};
-
-    bool initialized = false;
-    volatile State state;
-    mutable std::recursive_mutex stateMutex;
-    mutable std::recursive_mutex signalHandlerMutex;
-    bool autoRemove = true;
-    std::atomic_bool waitingForDeletion;
-    mutable QList<std::shared_ptr<std::condition_variable>> noPendingHandlerCondVars;
-    mutable std::mutex noPendingHandlerCondVarsMutex;
-
-    int timeoutMs                = -1;
-    int progress                 = 0;
-    std::exception_ptr exception = nullptr;
-    std::mutex maintainedMutex;
-    std::map<std::shared_ptr<QObject>, bool> maintainedObjects;
-    QList<State> allowedHandlers = {};
+    util::IntrusivePtr<Core> core;
 
 #ifdef DEBUG_SAVE_STACKTRACE
     QStringList constructedFrom;
 #endif
 
 protected:
-    QList<std::shared_ptr<BasicSignalConnection>> startedHandlers;
-    QList<std::shared_ptr<BasicSignalConnection>> finishedHandlers;
-    QList<std::shared_ptr<BasicSignalConnection>> failedHandlers;
-    QList<std::shared_ptr<BasicSignalConnection>> canceledHandlers;
-    QList<std::shared_ptr<BasicSignalConnection>> timeoutHandlers;
-    QList<std::shared_ptr<BasicSignalConnection>> endedHandlers;
-    QList<std::shared_ptr<BasicSignalConnection>> terminatedHandlers;
-    QList<std::shared_ptr<BasicSignalConnection>> progressHandlers;
-
-    void connectBasicSignals(std::function<void(std::shared_ptr<AsyncTask>)> callback,
-                             QList<std::shared_ptr<BasicSignalConnection>>& handlerList,
-                             std::shared_ptr<State> stateWhenInvokedPtr,
+    void connectBasicSignals(Signal signal,
+                             std::function<void(std::shared_ptr<AsyncTask>, State)> callback,
                              bool restoreContext,
                              bool autoDisconnect,
                              common::DelegateConnection* connection = nullptr);
+    void removeBasicSignalHandler(Signal signal, const DelegateConnection& connection);
 
     virtual bool runCore(Priority priority);
     virtual void setState(const State& value);
 
-    void emitStarted(bool waitForCompletion) const;
-    void emitFinished(bool waitForCompletion) const;
-    void emitFailed(bool waitForCompletion) const;
-    void emitCanceled(bool waitForCompletion) const;
-    void emitTimeout(bool waitForCompletion) const;
-    void emitEnded(bool waitForCompletion, const State& invocationState) const;
-    void emitTerminated(bool waitForCompletion) const;
-    void emitProgress(bool waitForCompletion) const;
-    void emitBasicSignals(const QList<std::shared_ptr<BasicSignalConnection>>& handlers,
-                          bool waitForCompletion,
-                          const State& invocationState) const;
+    void emitStarted(bool waitForCompletion);
+    void emitFinished(bool waitForCompletion);
+    void emitFailed(bool waitForCompletion);
+    void emitCanceled(bool waitForCompletion);
+    void emitTimeout(bool waitForCompletion);
+    void emitEnded(bool waitForCompletion, const State& invocationState);
+    void emitTerminated(bool waitForCompletion);
+    void emitProgress(bool waitForCompletion);
+    void emitBasicSignals(Signal signal, bool waitForCompletion, const State& invocationState);
     void prepareForDeletion();
 
-    template<typename HandlerT>
-    static inline QList<HandlerT*> getRawCopyOfHandlers(
-            const QList<std::shared_ptr<HandlerT>>& handlers)
-    {
-        QList<HandlerT*> result;
-        for (auto& ptr : handlers)
-            result.append(ptr.get());
-        return result;
-    }
-
+public:
+    // priority of the task running on the calling thread, Normal outside of tasks
     static Priority getCurrentPriority();
 
-public:
     virtual ~AsyncTask();
 
     bool isRunning() const;
@@ -242,6 +220,10 @@ public:
             bool restoreContext                    = true,
             common::DelegateConnection* connection = nullptr);
 
+    // invoked from the destructor on the destroying thread, the task cannot be locked anymore
+    std::shared_ptr<AsyncTask> onDestroyed(std::function<void()> callback,
+                                           common::DelegateConnection* connection = nullptr);
+
     std::shared_ptr<AsyncTask> addMaintainedObject(std::shared_ptr<QObject> object,
                                                    bool isPermanent = false);
     std::shared_ptr<AsyncTask> removeMaintainedObject(std::shared_ptr<QObject> object);
@@ -264,7 +246,6 @@ public:
         return runUnmanaged(priority);
     }
 
-public slots:
     std::shared_ptr<AsyncTask> runUnmanaged(std::optional<Priority> priority = std::nullopt);
 
     std::shared_ptr<AsyncTask> runSync(bool rethrowException             = false,
@@ -282,6 +263,7 @@ public slots:
     void removeEndedHandler(const DelegateConnection& connection);
     void removeTerminatedHandler(const DelegateConnection& connection);
     void removeProgressHandler(const DelegateConnection& connection);
+    void removeDestroyedHandler(const DelegateConnection& connection);
 };
 
 template<typename TResult>
@@ -362,30 +344,4 @@ public:
     }
 };
 
-class BasicSignalConnection
-    : public QObject
-    , public std::enable_shared_from_this<BasicSignalConnection>
-{
-    Q_OBJECT
-
-    friend class AsyncTaskService;
-    friend class AsyncTask;
-
-    DelegateConnection connection;
-    std::shared_ptr<util::ContextReceiver> receiver;
-    std::shared_ptr<AsyncTask::State> stateWhenInvoked;
-    bool restoreContext;
-
-    bool operator==(const BasicSignalConnection& other) const;
-    bool operator!=(const BasicSignalConnection& other) const;
-    void doDispatch(std::function<void()> onDispatchFinished) const;
-
-    BasicSignalConnection();
-    BasicSignalConnection(const DelegateConnection& connection);
-    BasicSignalConnection(const DelegateConnection& connection,
-                          std::shared_ptr<util::ContextReceiver> receiver,
-                          std::shared_ptr<AsyncTask::State> stateWhenInvoked,
-                          bool restoreContext);
-};
-
 }  // namespace common
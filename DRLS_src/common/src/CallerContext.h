@@ -8,6 +8,8 @@ struct CallerContext
 {
     QString token;
     QString username;
+    // set on the retries of a queued request, which has passed the admission control once
+    bool admitted = false;
 
     CallerContext(const QString& token = "", const QString& username = "")
         : token(token)
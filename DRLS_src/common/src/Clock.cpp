@@ -0,0 +1,103 @@
+#include "Clock.h"
+
+using namespace common;
+
+std::shared_ptr<RealClock> RealClock::instance_;
+
+std::shared_ptr<RealClock> RealClock::getInstance() {
+    if (instance_ == nullptr)
+        instance_ = std::shared_ptr<RealClock>(new RealClock());
+
+    return instance_;
+}
+
+RealClock::RealClock()
+    : start_(QDateTime::currentDateTime())
+{
+    elapsed_.start();
+}
+
+QDateTime RealClock::now() const {
+    return start_.addMSecs(elapsed_.elapsed());
+}
+
+void RealClock::singleShot(int delayMs, QObject* receiver, std::function<void()> callback) {
+    QTimer::singleShot(delayMs, receiver, callback);
+}
+
+AcceleratedClock::AcceleratedClock(double factor)
+    : factor_(factor)
+    , start_(QDateTime::currentDateTime())
+{
+    if (factor_ <= 0)
+        throw std::invalid_argument("Clock acceleration must be positive.");
+
+    elapsed_.start();
+}
+
+QDateTime AcceleratedClock::now() const {
+    return start_.addMSecs(static_cast<qint64>(elapsed_.elapsed() * factor_));
+}
+
+void AcceleratedClock::singleShot(int delayMs, QObject* receiver, std::function<void()> callback) {
+    QTimer::singleShot(static_cast<int>(delayMs / factor_), receiver, callback);
+}
+
+double AcceleratedClock::getFactor() const {
+    return factor_;
+}
+
+ManualClock::ManualClock(QDateTime start)
+    : now_(start)
+{}
+
+QDateTime ManualClock::now() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return now_;
+}
+
+void ManualClock::singleShot(int delayMs, QObject* receiver, std::function<void()> callback) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    timers_.insert({now_.addMSecs(delayMs), Timer{receiver, callback}});
+}
+
+void ManualClock::advance(qint64 ms) {
+    QDateTime target;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        target = now_.addMSecs(ms);
+    }
+
+    // timers may schedule further timers, so fire them one by one
+    while (true) {
+        Timer timer;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = timers_.begin();
+            if (it == timers_.end() || target < it->first) {
+                now_ = target;
+                return;
+            }
+
+            now_  = it->first;
+            timer = it->second;
+            timers_.erase(it);
+        }
+
+        if (timer.receiver.isNull())
+            continue;
+
+        // the callback is over before the next timer fires, so the receiver's thread has to
+        // run its event loop and must not wait for the advancing thread meanwhile
+        auto receiver = timer.receiver.data();
+        if (receiver->thread() == QThread::currentThread())
+            timer.callback();
+        else
+            QMetaObject::invokeMethod(receiver, timer.callback, Qt::BlockingQueuedConnection);
+    }
+}
+
+int ManualClock::getNumberOfPendingTimers() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return static_cast<int>(timers_.size());
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <QtCore>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace common {
+
+// Time source of the lock services. Leases and queue timeouts are computed with it, so tests
+// and benchmarks can replace the real clock and simulate hours of lock churn in seconds.
+class IClock {
+public:
+    virtual ~IClock() = default;
+
+    virtual QDateTime now() const = 0;
+
+    // calls callback on the thread of receiver after delayMs of this clock's time,
+    // nothing happens if receiver has been destroyed meanwhile
+    virtual void singleShot(int delayMs, QObject* receiver, std::function<void()> callback) = 0;
+};
+
+class RealClock : public IClock {
+public:
+    static std::shared_ptr<RealClock> getInstance();
+
+private:
+    RealClock();
+
+public:
+    // wall time at creation advanced by a monotonic timer, system clock changes don't affect
+    // lease lengths
+    QDateTime now() const override;
+    void singleShot(int delayMs, QObject* receiver, std::function<void()> callback) override;
+
+private:
+    QDateTime start_;
+    QElapsedTimer elapsed_;
+
+private:
+    static std::shared_ptr<RealClock> instance_;
+};
+
+class AcceleratedClock : public IClock {
+public:
+    AcceleratedClock(double factor);
+
+    QDateTime now() const override;
+    void singleShot(int delayMs, QObject* receiver, std::function<void()> callback) override;
+
+    double getFactor() const;
+
+private:
+    double factor_;
+    QDateTime start_;
+    QElapsedTimer elapsed_;
+};
+
+class ManualClock : public IClock {
+public:
+    ManualClock(QDateTime start = QDateTime::currentDateTime());
+
+    QDateTime now() const override;
+    void singleShot(int delayMs, QObject* receiver, std::function<void()> callback) override;
+
+    // Moves the time forward and fires every timer that became due, in deadline order. Each
+    // callback has returned before the next one fires: it is called directly if its receiver
+    // lives on the calling thread, otherwise the call blocks until the receiver's thread has
+    // run it. Advancing while that thread waits for the caller deadlocks.
+    void advance(qint64 ms);
+
+    int getNumberOfPendingTimers() const;
+
+private:
+    struct Timer {
+        QPointer<QObject> receiver;
+        std::function<void()> callback;
+    };
+
+private:
+    mutable std::mutex mutex_;
+    QDateTime now_;
+    std::multimap<QDateTime, Timer> timers_;
+};
+
+}  // namespace common
@@ -2,22 +2,37 @@
 
 using namespace common;
 
-QUuid DelegateConnection::getToken() const {
-    return token;
+std::atomic<quint64> DelegateConnection::lastId{0};
+
+DelegateConnection::DelegateConnection(void* slot)
+    : id(lastId.fetch_add(1, std::memory_order_relaxed) + 1)
+    , slot(slot)
+{}
+
+quint64 DelegateConnection::getId() const {
+    return id;
+}
+
+void* DelegateConnection::getSlot() const {
+    return slot;
+}
+
+bool DelegateConnection::isEmpty() const {
+    return id == 0;
 }
 
 bool DelegateConnection::operator==(const DelegateConnection& other) const {
-    return this->token == other.token;
+    return this->id == other.id;
 }
 
 bool DelegateConnection::operator!=(const DelegateConnection& other) const {
-    return this->token != other.token;
+    return this->id != other.id;
 }
 
 bool DelegateConnection::operator<(const DelegateConnection& other) const {
-    return this->token < other.token;
+    return this->id < other.id;
 }
 
 bool DelegateConnection::operator>(const DelegateConnection& other) const {
-    return this->token > other.token;
+    return this->id > other.id;
 }
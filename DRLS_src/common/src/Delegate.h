@@ -1,18 +1,28 @@
 #pragma once
 
 #include <QtCore>
+#include <atomic>
 #include <functional>
 #include <memory>
 
 namespace common {
 
+// Identifies a handler connected to a task. The id is unique within the process and the slot
+// points to the storage of the handler within the task, so that disconnecting does not have to
+// search for it. Default constructed connections are empty and match nothing.
 class DelegateConnection {
-    QUuid token;
+    static std::atomic<quint64> lastId;
+
+    quint64 id = 0;
+    void* slot = nullptr;
 
 public:
-    DelegateConnection() { token = QUuid::createUuid(); }
+    DelegateConnection() = default;
+    explicit DelegateConnection(void* slot);
 
-    QUuid getToken() const;
+    quint64 getId() const;
+    void* getSlot() const;
+    bool isEmpty() const;
 
     bool operator==(const DelegateConnection& other) const;
     bool operator!=(const DelegateConnection& other) const;
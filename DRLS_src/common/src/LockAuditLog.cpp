@@ -0,0 +1,139 @@
+#include "LockAuditLog.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+using namespace common;
+
+std::mutex LockAuditLog::ringsMutex_;
+std::vector<std::shared_ptr<LockAuditLog::Ring>> LockAuditLog::rings_;
+
+LockAuditLog::RingOwner::~RingOwner() {
+    if (ring != nullptr)
+        ring->owned = false;
+}
+
+uint64_t LockAuditLog::now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+}
+
+LockAuditLog::Ring& LockAuditLog::localRing() {
+    thread_local RingOwner owner;
+    if (owner.ring != nullptr)
+        return *owner.ring;
+
+    std::lock_guard<std::mutex> lock(ringsMutex_);
+
+    // prefer the ring of an already finished thread, its events are kept
+    for (auto& ring : rings_) {
+        bool owned = false;
+        if (ring->owned.compare_exchange_strong(owned, true)) {
+            owner.ring = ring;
+            return *owner.ring;
+        }
+    }
+
+    owner.ring              = std::make_shared<Ring>();
+    owner.ring->threadIndex = static_cast<uint16_t>(rings_.size());
+    rings_.push_back(owner.ring);
+    return *owner.ring;
+}
+
+void LockAuditLog::record(LockAuditEventKind kind,
+                          db::EntityType entityType,
+                          int resourceId,
+                          ResourceLockType lockType,
+                          int adminId,
+                          const QString& owner)
+{
+    auto& ring = localRing();
+
+    // only this thread writes the ring, so head needs no read-modify-write
+    uint64_t index = ring.head.load(std::memory_order_relaxed);
+    auto& slot     = ring.buffer[index & (EventsPerThread - 1)];
+
+    // odd sequence marks the slot as being written
+    slot.sequence.store(2 * index + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.event.timestampNs = now();
+    slot.event.resourceId  = resourceId;
+    slot.event.adminId     = adminId;
+    slot.event.ownerHash   = static_cast<uint32_t>(qHash(owner, 0));
+    slot.event.threadIndex = ring.threadIndex;
+    slot.event.kind        = static_cast<uint8_t>(kind);
+    slot.event.entityType  = static_cast<uint8_t>(entityType);
+    slot.event.lockType    = static_cast<uint8_t>(lockType);
+    std::memset(slot.event.reserved, 0, sizeof(slot.event.reserved));
+
+    slot.sequence.store(2 * index + 2, std::memory_order_release);
+    ring.head.store(index + 1, std::memory_order_release);
+}
+
+std::vector<LockAuditEvent> LockAuditLog::snapshot() {
+    std::vector<std::shared_ptr<Ring>> rings;
+    {
+        std::lock_guard<std::mutex> lock(ringsMutex_);
+        rings = rings_;
+    }
+
+    std::vector<LockAuditEvent> events;
+    for (const auto& ring : rings) {
+        uint64_t head  = ring->head.load(std::memory_order_acquire);
+        uint64_t first = head > EventsPerThread ? head - EventsPerThread : 0;
+
+        for (uint64_t index = first; index < head; index++) {
+            const auto& slot = ring->buffer[index & (EventsPerThread - 1)];
+
+            uint64_t before = slot.sequence.load(std::memory_order_acquire);
+            LockAuditEvent event;
+            std::memcpy(&event, &slot.event, sizeof(event));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            uint64_t after = slot.sequence.load(std::memory_order_relaxed);
+
+            // skip slots overwritten while we were reading them
+            if (before != after || before != 2 * index + 2)
+                continue;
+
+            events.push_back(event);
+        }
+    }
+
+    std::sort(events.begin(), events.end(), [](const auto& a, const auto& b) {
+        return a.timestampNs < b.timestampNs;
+    });
+
+    return events;
+}
+
+bool LockAuditLog::dumpToFile(const QString& path) {
+    auto events = snapshot();
+
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "[AUDIT] Cannot open" << path << "for writing:" << file.errorString();
+        return false;
+    }
+
+    LockAuditFileHeader header;
+    std::memcpy(header.magic, LockAuditFileMagic, sizeof(header.magic));
+    header.version    = LockAuditFileVersion;
+    header.eventSize  = sizeof(LockAuditEvent);
+    header.eventCount = events.size();
+    header.dumpedAtNs = now();
+
+    bool ok = file.write(reinterpret_cast<const char*>(&header), sizeof(header)) ==
+              static_cast<qint64>(sizeof(header));
+    if (ok && !events.empty()) {
+        qint64 size = static_cast<qint64>(events.size() * sizeof(LockAuditEvent));
+        ok = file.write(reinterpret_cast<const char*>(events.data()), size) == size;
+    }
+
+    if (!ok)
+        qWarning() << "[AUDIT] Failed to write" << path << ":" << file.errorString();
+
+    return ok;
+}
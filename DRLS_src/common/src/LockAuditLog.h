@@ -0,0 +1,63 @@
+#pragma once
+
+#include <QtCore>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "common/src/LockableResource.h"
+#include "common/src/LockAuditRecord.h"
+
+namespace common {
+
+// Always-on flight recorder of lock events. Every thread writes into its own fixed size ring
+// without taking any lock, readers only synchronize with writers through per-slot sequences.
+class LockAuditLog {
+public:
+    static constexpr int EventsPerThread = 4096;
+
+    static void record(LockAuditEventKind kind,
+                       db::EntityType entityType,
+                       int resourceId,
+                       ResourceLockType lockType,
+                       int adminId,
+                       const QString& owner);
+
+    // consistent copy of all buffered events ordered by their timestamp
+    static std::vector<LockAuditEvent> snapshot();
+
+    static bool dumpToFile(const QString& path);
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> sequence{0};
+        LockAuditEvent event;
+    };
+
+    struct Ring {
+        std::array<Slot, EventsPerThread> buffer;
+        std::atomic<uint64_t> head{0};
+        std::atomic_bool owned{true};
+        uint16_t threadIndex = 0;
+    };
+
+    // releases the ring of a finished thread so a new thread can reuse it
+    struct RingOwner {
+        std::shared_ptr<Ring> ring;
+        ~RingOwner();
+    };
+
+    static Ring& localRing();
+    static uint64_t now();
+
+private:
+    static std::mutex ringsMutex_;
+    static std::vector<std::shared_ptr<Ring>> rings_;
+
+    static_assert((EventsPerThread & (EventsPerThread - 1)) == 0,
+                  "EventsPerThread must be a power of two");
+};
+
+}  // namespace common
@@ -0,0 +1,36 @@
+#pragma once
+
+// This header is shared with the standalone decoder (tools/lockaudit), keep it free of Qt.
+
+#include <cstdint>
+
+namespace common {
+
+enum class LockAuditEventKind : uint8_t { Acquire, Conflict, Renew, Release, Expire, Escalate };
+
+struct LockAuditEvent {
+    uint64_t timestampNs;  // monotonic clock, not wall time
+    int32_t resourceId;    // -1 for type-level locks
+    int32_t adminId;       // -1 for system locks, 0 if the owner was not resolved
+    uint32_t ownerHash;    // hash of the owner's token or system tag
+    uint16_t threadIndex;
+    uint8_t kind;          // LockAuditEventKind
+    uint8_t entityType;    // db::EntityType
+    uint8_t lockType;      // common::ResourceLockType
+    uint8_t reserved[7];
+};
+
+static_assert(sizeof(LockAuditEvent) == 32, "LockAuditEvent is part of the dump format");
+
+struct LockAuditFileHeader {
+    char magic[8];  // "DRLSAUD1"
+    uint32_t version;
+    uint32_t eventSize;
+    uint64_t eventCount;
+    uint64_t dumpedAtNs;
+};
+
+constexpr char LockAuditFileMagic[8] = {'D', 'R', 'L', 'S', 'A', 'U', 'D', '1'};
+constexpr uint32_t LockAuditFileVersion = 1;
+
+}  // namespace common
@@ -30,7 +30,11 @@ struct LockableResource {
 };
 
 inline bool operator<(const LockableResource& a, const LockableResource& b) {
-    return static_cast<int>(a.entityType()) < static_cast<int>(b.entityType());
+    if (a.entityType() != b.entityType())
+        return static_cast<int>(a.entityType()) < static_cast<int>(b.entityType());
+
+    // row locks of the same type must stay distinct keys, otherwise a bulk request collapses
+    return a.targetId < b.targetId;
 }
 
 }  // namespace common
@@ -0,0 +1,107 @@
+#include "TaskCore.h"
+
+#include "utils/BlockPool.h"
+
+using namespace common;
+
+void* AsyncTask::Core::operator new(std::size_t size) {
+    Q_ASSERT(size == sizeof(Core));
+    return util::BlockPool<sizeof(Core), alignof(Core)>::allocate();
+}
+
+void AsyncTask::Core::operator delete(void* block) {
+    util::BlockPool<sizeof(Core), alignof(Core)>::deallocate(block);
+}
+
+void AsyncTask::Core::retain(Core* core) {
+    core->refCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+void AsyncTask::Core::release(Core* core) {
+    if (core->refCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        delete core;
+}
+
+AsyncTask::HandlerSlot* AsyncTask::Core::addHandler(Handler handler) {
+    HandlerSlot* slot = nullptr;
+    if (freeSlots != nullptr) {
+        slot      = freeSlots;
+        freeSlots = slot->next;
+    } else if (usedInlineSlots < InlineHandlers) {
+        slot = &inlineSlots[usedInlineSlots++];
+    } else {
+        int size   = InlineHandlers << extraSlots.size();
+        auto chunk = std::make_unique<HandlerSlot[]>(size);
+        for (int i = size - 1; i > 0; --i) {
+            chunk[i].next = freeSlots;
+            freeSlots     = &chunk[i];
+        }
+
+        slot = &chunk[0];
+        extraSlots.push_back(std::move(chunk));
+    }
+
+    slot->handler   = std::move(handler);
+    slot->connected = true;
+    slot->prev      = lastHandler;
+    slot->next    = nullptr;
+    if (lastHandler != nullptr)
+        lastHandler->next = slot;
+    else
+        firstHandler = slot;
+    lastHandler = slot;
+
+    return slot;
+}
+
+void AsyncTask::Core::removeHandler(HandlerSlot* slot) {
+    if (slot->prev != nullptr)
+        slot->prev->next = slot->next;
+    else
+        firstHandler = slot->next;
+
+    if (slot->next != nullptr)
+        slot->next->prev = slot->prev;
+    else
+        lastHandler = slot->prev;
+
+    // an emission in progress still refers to the handler, it frees the slot when done
+    slot->connected = false;
+    slot->prev      = nullptr;
+    slot->next      = nullptr;
+    if (slot->pins == 0)
+        freeSlot(slot);
+}
+
+void AsyncTask::Core::pin(HandlerSlot* slot) {
+    ++slot->pins;
+}
+
+void AsyncTask::Core::unpin(HandlerSlot* slot) {
+    if (--slot->pins == 0 && !slot->connected)
+        freeSlot(slot);
+}
+
+void AsyncTask::Core::freeSlot(HandlerSlot* slot) {
+    slot->handler = Handler();
+    slot->next    = freeSlots;
+    freeSlots     = slot;
+}
+
+AsyncTask::HandlerSlot* AsyncTask::Core::findSlot(const DelegateConnection& connection) {
+    // the slot is only dereferenced once it is known to belong to this core
+    auto slot    = static_cast<HandlerSlot*>(connection.getSlot());
+    auto within = [slot](HandlerSlot* first, int size) {
+        return std::less_equal<HandlerSlot*>()(first, slot) &&
+               std::less<HandlerSlot*>()(slot, first + size);
+    };
+
+    bool owned = within(inlineSlots, InlineHandlers);
+    for (std::size_t i = 0; !owned && i < extraSlots.size(); ++i)
+        owned = within(extraSlots[i].get(), InlineHandlers << i);
+
+    if (!owned || !slot->connected || slot->handler.connection != connection)
+        return nullptr;
+
+    return slot;
+}
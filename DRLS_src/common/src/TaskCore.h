@@ -0,0 +1,101 @@
+#pragma once
+
+#include <QtCore>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "common/src/AsyncTask.h"
+
+namespace common {
+
+struct AsyncTask::Handler {
+    Signal signal;
+    DelegateConnection connection;
+    std::function<void(std::shared_ptr<AsyncTask>, State)> callback;
+    bool restoreContext = false;
+    bool autoDisconnect = false;
+};
+
+// Storage of a connected handler. Slots do not move while the core is alive, so connections
+// point to them directly; the connection id tells whether a slot still holds the same handler.
+// Connected slots are linked in the order the handlers were connected. A slot is pinned while
+// its handler is being invoked, disconnecting unlinks it but frees it only once it is unpinned.
+struct AsyncTask::HandlerSlot {
+    Handler handler;
+    bool connected    = false;
+    int pins          = 0;
+    HandlerSlot* prev = nullptr;
+    HandlerSlot* next = nullptr;
+};
+
+// Everything a task needs while it is being run. Cores are allocated from a block pool and
+// reference counted intrusively, handlers dispatched to another thread keep the core (and so
+// the handler list and its mutex) alive without keeping the task itself alive.
+struct AsyncTask::Core {
+    // most tasks have a few handlers only, those are stored without a separate allocation
+    static const int InlineHandlers = 4;
+
+    static void* operator new(std::size_t size);
+    static void operator delete(void* block);
+
+    static void retain(Core* core);
+    static void release(Core* core);
+
+    static quint32 stateBit(State state) { return 1u << static_cast<int>(state); }
+
+    // handlers of an emission dispatched to the application thread, allocated only for those
+    struct PendingHandlers {
+        std::mutex mutex;
+        std::condition_variable noneLeft;
+        int count = 0;
+    };
+
+    // these are to be called with signalHandlerMutex held
+    HandlerSlot* addHandler(Handler handler);
+    void removeHandler(HandlerSlot* slot);
+    HandlerSlot* findSlot(const DelegateConnection& connection);
+    void pin(HandlerSlot* slot);
+    void unpin(HandlerSlot* slot);
+    void freeSlot(HandlerSlot* slot);
+
+    std::atomic_int refCount{0};
+
+    // the state is changed by compare-and-swap only, readers never wait
+    std::atomic<State> state{State::NotStarted};
+    std::atomic_bool autoRemove{true};
+    std::atomic_bool waitingForDeletion{false};
+
+    // guards the subtasks, the progress and the maintained objects
+    mutable std::recursive_mutex stateMutex;
+    bool initialized = false;
+    int timeoutMs    = -1;
+    int progress     = 0;
+    std::exception_ptr exception = nullptr;
+    QList<std::weak_ptr<AsyncTask>> subtasks;
+
+    // completes the current run, composite tasks take it over to complete from a continuation
+    std::function<void(bool)> completion;
+
+    mutable std::recursive_mutex signalHandlerMutex;
+    quint32 allowedHandlers = 0;  // bit per State, see stateBit
+    HandlerSlot* firstHandler = nullptr;
+    HandlerSlot* lastHandler  = nullptr;
+    HandlerSlot* freeSlots    = nullptr;  // linked by next
+    int usedInlineSlots       = 0;
+    HandlerSlot inlineSlots[InlineHandlers];
+    std::vector<std::unique_ptr<HandlerSlot[]>> extraSlots;  // i-th has InlineHandlers << i slots
+
+    // woken up on termination, guarded by signalHandlerMutex
+    QList<std::shared_ptr<PendingHandlers>> pendingHandlers;
+
+    // most tasks maintain nothing, so the map is created on first use
+    std::unique_ptr<std::map<std::shared_ptr<QObject>, bool>> maintainedObjects;
+};
+
+}  // namespace common
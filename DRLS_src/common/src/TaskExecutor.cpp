@@ -0,0 +1,225 @@
+#include "TaskExecutor.h"
+
+using namespace common;
+
+const int ThreadPoolExecutor::MinThreadCount = 4;
+
+ThreadPoolExecutor::ThreadPoolExecutor(QThreadPool* pool)
+    : pool_(pool)
+{
+    // we use at least 4 threads
+    if (pool_->maxThreadCount() < MinThreadCount)
+        pool_->setMaxThreadCount(MinThreadCount);
+}
+
+void ThreadPoolExecutor::execute(std::function<void()> job, int priority) {
+    pool_->start(new Runnable(std::move(job)), priority);
+}
+
+int ThreadPoolExecutor::getNumberOfWorkers() const {
+    return pool_->maxThreadCount();
+}
+
+int ThreadPoolExecutor::getNumberOfIdleWorkers() const {
+    return pool_->maxThreadCount() - pool_->activeThreadCount();
+}
+
+void ThreadPoolExecutor::modifyWorkersCount(int diff) {
+    std::lock_guard<std::mutex> lock(poolMutex_);
+    pool_->setMaxThreadCount(qMax(MinThreadCount, pool_->maxThreadCount() + diff));
+}
+
+ThreadPoolExecutor::Runnable::Runnable(std::function<void()> job)
+    : job_(std::move(job))
+{
+    setAutoDelete(true);
+}
+
+void ThreadPoolExecutor::Runnable::run() {
+    if (job_ != nullptr)
+        job_();
+}
+
+thread_local WorkStealingExecutor* WorkStealingExecutor::currentExecutor_ = nullptr;
+thread_local WorkStealingExecutor::Worker* WorkStealingExecutor::currentWorker_ = nullptr;
+
+WorkStealingExecutor::WorkStealingExecutor(int numberOfWorkers) {
+    numberOfWorkers = qMax(1, numberOfWorkers);
+
+    // every deque exists before the first worker starts stealing
+    for (int i = 0; i < numberOfWorkers; ++i)
+        workers_.push_back(std::make_unique<Worker>());
+
+    numberOfWorkers_ = numberOfWorkers;
+    for (auto& worker : workers_)
+        worker->thread = std::thread(&WorkStealingExecutor::work, this, worker.get(), nullptr);
+}
+
+WorkStealingExecutor::~WorkStealingExecutor() {
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex_);
+        stopping_ = true;
+    }
+    wakeUp_.notify_all();
+
+    auto finish = [](std::thread& thread) {
+        if (thread.get_id() == std::this_thread::get_id())
+            thread.detach();
+        else if (thread.joinable())
+            thread.join();
+    };
+
+    for (auto& worker : workers_)
+        finish(worker->thread);
+
+    std::lock_guard<std::mutex> lock(extraWorkersMutex_);
+    for (auto& extra : extraWorkers_)
+        finish(extra->thread);
+}
+
+void WorkStealingExecutor::execute(std::function<void()> job, int priority) {
+    if (currentExecutor_ == this && currentWorker_ != nullptr) {
+        std::lock_guard<std::mutex> lock(currentWorker_->mutex);
+        currentWorker_->jobs.push_back(std::move(job));
+    } else {
+        std::lock_guard<std::mutex> lock(sharedMutex_);
+        sharedJobs_.emplace(priority, std::move(job));
+    }
+
+    ++pendingJobs_;
+    wakeOne();
+}
+
+int WorkStealingExecutor::getNumberOfWorkers() const {
+    return numberOfWorkers_;
+}
+
+int WorkStealingExecutor::getNumberOfIdleWorkers() const {
+    return numberOfWorkers_ - busyWorkers_;
+}
+
+void WorkStealingExecutor::modifyWorkersCount(int diff) {
+    std::lock_guard<std::mutex> lock(extraWorkersMutex_);
+
+    // join the extra workers which have already retired
+    for (auto it = extraWorkers_.begin(); it != extraWorkers_.end();) {
+        if ((*it)->finished) {
+            (*it)->thread.join();
+            it = extraWorkers_.erase(it);
+        } else
+            ++it;
+    }
+
+    numberOfWorkers_ += diff;
+    for (int i = 0; i < diff; ++i) {
+        auto extra    = std::make_unique<ExtraWorker>();
+        extra->thread = std::thread(&WorkStealingExecutor::work, this, nullptr, extra.get());
+        extraWorkers_.push_back(std::move(extra));
+    }
+
+    if (diff < 0) {
+        {
+            std::lock_guard<std::mutex> sleepLock(sleepMutex_);
+            extraWorkersToRetire_ -= diff;
+        }
+        wakeUp_.notify_all();
+    }
+}
+
+void WorkStealingExecutor::work(Worker* self, ExtraWorker* extra) {
+    currentExecutor_ = this;
+    currentWorker_   = self;
+
+    while (!stopping_) {
+        if (extra != nullptr && retireExtraWorker())
+            break;
+
+        std::function<void()> job;
+        if (takeJob(self, job)) {
+            ++busyWorkers_;
+            try {
+                job();
+            } catch (const std::exception& e) {
+                qCritical() << "WorkStealingExecutor: job threw an exception:" << e.what();
+            } catch (...) {
+                qCritical() << "WorkStealingExecutor: job threw an exception";
+            }
+            --busyWorkers_;
+            continue;
+        }
+
+        // the sleeping counter is raised before the pending jobs are checked, and producers
+        // check the counter after raising the pending jobs, so a wake up cannot be missed
+        std::unique_lock<std::mutex> lock(sleepMutex_);
+        ++sleepingWorkers_;
+        wakeUp_.wait(lock, [this, extra] {
+            return pendingJobs_ > 0 || stopping_
+                   || (extra != nullptr && extraWorkersToRetire_ > 0);
+        });
+        --sleepingWorkers_;
+    }
+
+    currentExecutor_ = nullptr;
+    currentWorker_   = nullptr;
+    if (extra != nullptr)
+        extra->finished = true;
+}
+
+bool WorkStealingExecutor::takeJob(Worker* self, std::function<void()>& job) {
+    // own deque first, newest job while its data is still hot
+    if (self != nullptr) {
+        std::lock_guard<std::mutex> lock(self->mutex);
+        if (!self->jobs.empty()) {
+            job = std::move(self->jobs.back());
+            self->jobs.pop_back();
+            --pendingJobs_;
+            return true;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(sharedMutex_);
+        if (!sharedJobs_.empty()) {
+            job = std::move(sharedJobs_.begin()->second);
+            sharedJobs_.erase(sharedJobs_.begin());
+            --pendingJobs_;
+            return true;
+        }
+    }
+
+    // steal the oldest job, starting at a different victim each time to spread the contention
+    thread_local size_t nextVictim = 0;
+    for (size_t i = 0; i < workers_.size(); ++i) {
+        auto victim = workers_[nextVictim++ % workers_.size()].get();
+        if (victim == self)
+            continue;
+
+        std::lock_guard<std::mutex> lock(victim->mutex);
+        if (!victim->jobs.empty()) {
+            job = std::move(victim->jobs.front());
+            victim->jobs.pop_front();
+            --pendingJobs_;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool WorkStealingExecutor::retireExtraWorker() {
+    int toRetire = extraWorkersToRetire_;
+    while (toRetire > 0)
+        if (extraWorkersToRetire_.compare_exchange_weak(toRetire, toRetire - 1))
+            return true;
+
+    return false;
+}
+
+void WorkStealingExecutor::wakeOne() {
+    if (sleepingWorkers_ == 0)
+        return;
+
+    // taking the mutex orders the notification after the sleeper has started waiting
+    { std::lock_guard<std::mutex> lock(sleepMutex_); }
+    wakeUp_.notify_one();
+}
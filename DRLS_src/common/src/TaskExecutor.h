@@ -0,0 +1,117 @@
+#pragma once
+
+#include <QtCore>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace common {
+
+// Runs the jobs AsyncTaskService dispatches asynchronously. Jobs of a higher priority are
+// preferred, jobs are expected not to throw.
+class ITaskExecutor {
+public:
+    virtual ~ITaskExecutor() = default;
+
+    virtual void execute(std::function<void()> job, int priority) = 0;
+
+    virtual int getNumberOfWorkers() const = 0;
+    virtual int getNumberOfIdleWorkers() const = 0;
+
+    // adds (or removes) workers to compensate for workers blocked by waiting for other jobs
+    virtual void modifyWorkersCount(int diff) = 0;
+};
+
+// Executor on top of the global QThreadPool, one queue shared by every worker.
+class ThreadPoolExecutor : public ITaskExecutor {
+public:
+    ThreadPoolExecutor(QThreadPool* pool = QThreadPool::globalInstance());
+
+    void execute(std::function<void()> job, int priority) override;
+
+    int getNumberOfWorkers() const override;
+    int getNumberOfIdleWorkers() const override;
+    void modifyWorkersCount(int diff) override;
+
+private:
+    static const int MinThreadCount;
+
+    class Runnable : public QRunnable {
+    public:
+        Runnable(std::function<void()> job);
+        void run() override;
+
+    private:
+        std::function<void()> job_;
+    };
+
+private:
+    QThreadPool* pool_;
+    std::mutex poolMutex_;
+};
+
+// Executor with a deque per worker. Jobs dispatched from a worker are pushed to its own deque
+// and popped LIFO by that worker, so fan-outs stay on the thread which has their data in cache;
+// idle workers steal the oldest jobs of the others. Jobs dispatched from other threads go to a
+// shared queue ordered by priority, priorities are not honoured among the deques.
+class WorkStealingExecutor : public ITaskExecutor {
+public:
+    WorkStealingExecutor(int numberOfWorkers = QThread::idealThreadCount());
+    ~WorkStealingExecutor() override;
+
+    void execute(std::function<void()> job, int priority) override;
+
+    int getNumberOfWorkers() const override;
+    int getNumberOfIdleWorkers() const override;
+
+    // extra workers have no deque of their own, they take from the shared queue and steal
+    void modifyWorkersCount(int diff) override;
+
+private:
+    struct Worker {
+        std::thread thread;
+        std::mutex mutex;
+        // the owner works at the back, thieves take from the front
+        std::deque<std::function<void()>> jobs;
+    };
+
+    struct ExtraWorker {
+        std::thread thread;
+        std::atomic_bool finished{false};
+    };
+
+    void work(Worker* self, ExtraWorker* extra);
+    bool takeJob(Worker* self, std::function<void()>& job);
+    bool retireExtraWorker();
+    void wakeOne();
+
+private:
+    static thread_local WorkStealingExecutor* currentExecutor_;
+    static thread_local Worker* currentWorker_;
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+
+    std::mutex extraWorkersMutex_;
+    std::vector<std::unique_ptr<ExtraWorker>> extraWorkers_;
+    std::atomic_int extraWorkersToRetire_ = 0;
+
+    std::mutex sharedMutex_;
+    std::multimap<int, std::function<void()>, std::greater<int>> sharedJobs_;
+
+    std::atomic_int pendingJobs_ = 0;
+    std::atomic_int busyWorkers_ = 0;
+    std::atomic_int numberOfWorkers_ = 0;
+
+    std::mutex sleepMutex_;
+    std::condition_variable wakeUp_;
+    std::atomic_int sleepingWorkers_ = 0;
+    std::atomic_bool stopping_ = false;
+};
+
+}  // namespace common
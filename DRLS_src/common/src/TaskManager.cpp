@@ -36,7 +36,8 @@ AbstractTaskManager::~AbstractTaskManager() {
             qWarning() << "TaskManager destructed with non-cancellable tasks in progress";
         }
 
-        QObject::disconnect(destroyedConnections_[taskPair.first]);
+        if (task != nullptr)
+            task->removeDestroyedHandler(destroyedConnections_[taskPair.first]);
 
         std::lock_guard<std::recursive_mutex> lock(managedTaskMutex_);
         auto taskGuardIt = taskGuards_.find(task);
@@ -88,9 +89,8 @@ void AbstractTaskManager::addManagedTaskBase(std::weak_ptr<AsyncTask> task,
 
         hadTask = hasPendingManagedTask();
 
-        auto conn = QObject::connect(task.lock().get(), &QObject::destroyed, [this, task]() {
-            this->removeManagedTask(task);
-        });
+        DelegateConnection conn;
+        taskPtr->onDestroyed([this, task]() { this->removeManagedTask(task); }, &conn);
 
         this->destroyedConnections_.insert({task, conn});
         this->managedTasks_.insert({task, behaviour});
@@ -137,7 +137,8 @@ void AbstractTaskManager::removeManagedTask(std::weak_ptr<AsyncTask> task) {
 
         auto destroyedConnectionsIt = destroyedConnections_.find(task);
         if (destroyedConnectionsIt != destroyedConnections_.end()) {
-            QObject::disconnect(destroyedConnectionsIt->second);
+            if (t != nullptr)
+                t->removeDestroyedHandler(destroyedConnectionsIt->second);
             destroyedConnections_.erase(destroyedConnectionsIt);
         }
 
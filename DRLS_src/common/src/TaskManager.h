@@ -4,6 +4,7 @@
 #include <memory>
 #include <mutex>
 
+#include "common/src/Delegate.h"
 #include "common/src/TasksUpdatedSignalProxy.h"
 
 namespace common {
@@ -62,7 +63,7 @@ private:
             managedTasks_;
 
     std::map<std::weak_ptr<common::AsyncTask>,
-             QMetaObject::Connection,
+             DelegateConnection,
              std::owner_less<std::weak_ptr<common::AsyncTask>>>
             destroyedConnections_;
 
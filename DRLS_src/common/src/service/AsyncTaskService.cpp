@@ -1,32 +1,31 @@
 #include "AsyncTaskService.h"
 
 #include "common/src/Delegate.h"
+#include "common/src/TaskCore.h"
 
 #include "utils/Finally.h"
 
-#include <QtConcurrent/QtConcurrentRun>
-#include <condition_variable>
+#include <future>
+#include <thread>
+#include <utility>
 
 using namespace common;
 
-#define MIN_THREAD_COUNT 4
-
 bool AsyncTaskService::log = false;
 
 std::shared_ptr<AsyncTaskService> AsyncTaskService::instance_;
 
-AsyncTaskService::AsyncTaskService()
-    : pool(QThreadPool::globalInstance()), tasks(), runningTasks(), taskMutex()
+AsyncTaskService::AsyncTaskService(std::shared_ptr<ITaskExecutor> executor)
+    : executor(executor), tasks(), runningTasks(), taskMutex()
 {
+    if (this->executor == nullptr)
+        this->executor = std::make_shared<ThreadPoolExecutor>();
+
     qRegisterMetaType<std::shared_ptr<AsyncTask>>("std::shared_ptr<AsyncTask>");
     mainThread = QThread::currentThread();
     if (log)
         qDebug() << "Initializing AsyncTaskService - main thread is " << QThread::currentThreadId()
                  << "ptr:" << reinterpret_cast<intptr_t>(QThread::currentThread());
-
-    // we use at least 4 threads
-    if (pool->maxThreadCount() < MIN_THREAD_COUNT)
-        pool->setMaxThreadCount(MIN_THREAD_COUNT);
 }
 
 std::shared_ptr<AsyncTaskService> AsyncTaskService::getInstance() {
@@ -36,63 +35,18 @@ std::shared_ptr<AsyncTaskService> AsyncTaskService::getInstance() {
     return instance_;
 }
 
-AsyncTaskService::~AsyncTaskService() {
-    deleteAllTasks();
-}
-
-void AsyncTaskService::handleSubtaskTimeout(QList<std::shared_ptr<AsyncTask>> tasks,
-                                            QObject* parent)
+std::shared_ptr<AsyncTaskService> AsyncTaskService::createInstance(
+        std::shared_ptr<ITaskExecutor> executor)
 {
-    // this method is a little bit complex...
-    // the reason is that QTimer is hardly usable in multithreaded environment
-    // to interact with QTimer, we have to use signal-slot pattern
-
-    QTimer* timer = new QTimer();
-    timer->setSingleShot(true);
+    if (instance_ != nullptr)
+        throw std::runtime_error("AsyncTaskService instance already exists.");
 
-    for (auto& task : tasks) {
-        // invoker is for signal transmission to caller thread, which timer belongs to
-        QObject* invoker = new QObject();
-
-        invoker->setParent(timer);
-
-        connect(invoker, &QObject::destroyed, [task, timer]() {
-            // stop timer for previous subtask
-            timer->stop();
-            timer->disconnect(SIGNAL(timeout()));
-            if (log)
-                qDebug() << "Subtask timer stopped, new task:"
-                         << reinterpret_cast<intptr_t>(task.get());
-
-            // if subtask has a timeout, use the timer
-            if (task->getTimeout() > 0) {
-                if (log)
-                    qDebug() << "Subtask has a timeout:" << task->getTimeout();
-                connect(timer, &QTimer::timeout, [task]() {
-                    if (log)
-                        qDebug() << "Subtask timeout:" << reinterpret_cast<intptr_t>(task.get());
-                    task->setState(AsyncTask::State::TimingOut);
-                });
-                timer->start(task->getTimeout());
-            }
-        });
-
-        task->onStarted([invoker](auto) { invoker->deleteLater(); }, false);
-    }
-
-    timer->moveToThread(mainThread);
-
-    // as invoker objects are descendants of timer, the destruction of timer would cause
-    // the same thing as the started signal of tasks, which is not desired
-    // keep in mind the destruction chain: sequence->timerGuard->timer->invoker
-    connect(timer, &QObject::destroyed, [timer]() {
-        // prevent further timer operations...
-        for (auto child : timer->children())
-            child->disconnect(SIGNAL(destroyed(QObject*)));
-    });
+    instance_ = std::shared_ptr<AsyncTaskService>(new AsyncTaskService(executor));
+    return instance_;
+}
 
-    // signal transmission to caller thread, which timer belongs to
-    connect(parent, SIGNAL(destroyed(QObject*)), timer, SLOT(deleteLater()));
+AsyncTaskService::~AsyncTaskService() {
+    deleteAllTasks();
 }
 
 bool AsyncTaskService::checkOrigin(QList<std::shared_ptr<AsyncTask>> tasks) {
@@ -104,10 +58,10 @@ bool AsyncTaskService::checkOrigin(QList<std::shared_ptr<AsyncTask>> tasks) {
 }
 
 void AsyncTaskService::modifyWorkersCount(int diff) {
-    std::lock_guard<std::mutex> lock(poolMutex);
-    pool->setMaxThreadCount(qMax(MIN_THREAD_COUNT, pool->maxThreadCount() + diff));
+    executor->modifyWorkersCount(diff);
     if (log)
-        qDebug() << "AsyncTaskService: number of workers changed to" << pool->maxThreadCount();
+        qDebug() << "AsyncTaskService: number of workers changed to"
+                 << executor->getNumberOfWorkers();
 }
 
 void AsyncTaskService::doAsynchronously(std::function<void()> function, bool onExtraThread) {
@@ -121,7 +75,7 @@ void AsyncTaskService::doAsynchronously(std::function<void()> function, bool onE
         };
     }
 
-    Q_UNUSED(QtConcurrent::run(pool, action));
+    executor->execute(action, 0);
 }
 
 void AsyncTaskService::emitExceptionSignals(std::shared_ptr<AsyncTask> task) {
@@ -136,7 +90,7 @@ bool AsyncTaskService::initSubtasks(std::shared_ptr<AsyncTask> self,
                                     const QList<std::shared_ptr<AsyncTask>>& tasks,
                                     const QString compositeType)
 {
-    std::lock_guard<std::recursive_mutex> lock(self->stateMutex);
+    std::lock_guard<std::recursive_mutex> lock(self->core->stateMutex);
     if (self->getState() != AsyncTask::State::Running) {
         if (log)
             qDebug() << compositeType << "(" << reinterpret_cast<intptr_t>(self.get())
@@ -157,12 +111,179 @@ bool AsyncTaskService::initSubtasks(std::shared_ptr<AsyncTask> self,
     for (auto& task : tasks) {
         if (log)
             qDebug() << "    - " << reinterpret_cast<intptr_t>(task.get());
-        self->subtasks.append(task);
+        self->core->subtasks.append(task);
     }
 
     return true;
 }
 
+// a Sequence or Fallback run, its subtasks are started one by one as the previous one ends
+struct AsyncTaskService::ChainedRun {
+    QString compositeType;
+    std::shared_ptr<AsyncTask> self;
+    QList<std::shared_ptr<AsyncTask>> tasks;
+    AsyncTask::Priority priority;
+    std::function<void(bool)> complete;
+    std::exception_ptr exception = nullptr;
+};
+
+std::function<void(bool)> AsyncTaskService::deferCompletion(std::shared_ptr<AsyncTask> task) {
+    auto completion = std::exchange(task->core->completion, nullptr);
+    if (completion == nullptr)
+        throw std::runtime_error("Only the function of a running task can defer its completion.");
+
+    return completion;
+}
+
+void AsyncTaskService::runThen(
+        std::shared_ptr<AsyncTask> task,
+        AsyncTask::Priority priority,
+        std::function<void(std::shared_ptr<AsyncTask>, AsyncTask::State)> next)
+{
+    struct Connections {
+        std::atomic_bool fired = false;
+        // set till runTask returns, a task ending on the starting thread meanwhile (a no-op
+        // task for one) would otherwise start the next step recursively, a frame per task
+        std::atomic_bool starting = true;
+        std::thread::id starter   = std::this_thread::get_id();
+        DelegateConnection endedConn, terminatedConn;
+    };
+
+    auto conns   = std::make_shared<Connections>();
+    auto handler = [this, conns, next, priority](std::shared_ptr<AsyncTask> t,
+                                                 AsyncTask::State state) {
+        // a task terminated while its ended handlers are running reports twice
+        if (conns->fired.exchange(true))
+            return;
+
+        t->removeBasicSignalHandler(AsyncTask::Signal::Ended, conns->endedConn);
+        t->removeBasicSignalHandler(AsyncTask::Signal::Terminated, conns->terminatedConn);
+
+        // handlers see the intermediate state, the task settles right after them
+        if (state == AsyncTask::State::Finishing)
+            state = AsyncTask::State::Finished;
+        else if (state == AsyncTask::State::Failing)
+            state = AsyncTask::State::Failed;
+        else if (state == AsyncTask::State::Cancelling)
+            state = AsyncTask::State::Canceled;
+        else if (state == AsyncTask::State::TimingOut)
+            state = AsyncTask::State::TimedOut;
+
+        if (conns->starting && std::this_thread::get_id() == conns->starter) {
+            executor->execute([next, t, state]() { next(t, state); }, static_cast<int>(priority));
+            return;
+        }
+
+        next(t, state);
+    };
+
+    task->connectBasicSignals(AsyncTask::Signal::Ended, handler, false, true, &conns->endedConn);
+    task->connectBasicSignals(
+            AsyncTask::Signal::Terminated, handler, false, true, &conns->terminatedConn);
+
+    auto started = util::finally([conns]() { conns->starting = false; });
+    try {
+        runTask(task, true, priority);
+    } catch (...) {
+        task->removeBasicSignalHandler(AsyncTask::Signal::Ended, conns->endedConn);
+        task->removeBasicSignalHandler(AsyncTask::Signal::Terminated, conns->terminatedConn);
+        throw;
+    }
+}
+
+void AsyncTaskService::runSequenceStep(std::shared_ptr<ChainedRun> run, int index) {
+    // if sequence aborted, also abort all further tasks
+    if (index == run->tasks.count() || run->self->getState() != AsyncTask::State::Running) {
+        completeChainedRun(run, index, index == run->tasks.count());
+        return;
+    }
+
+    auto& task = run->tasks[index];
+    if (log)
+        qDebug() << "Sequence is running its next subtask:"
+                 << reinterpret_cast<intptr_t>(task.get());
+
+    try {
+        runThen(task,
+                run->priority,
+                [this, run, index](std::shared_ptr<AsyncTask> t, AsyncTask::State state) {
+                    if (state == AsyncTask::State::Finished) {
+                        runSequenceStep(run, index + 1);
+                        return;
+                    }
+
+                    // if current task has been aborted, also abort the sequence itself
+                    if (state == AsyncTask::State::Canceled ||
+                        state == AsyncTask::State::TimedOut ||
+                        state == AsyncTask::State::Terminated)
+                        run->self->setState(state);
+
+                    // if current task has failed, abort the sequence
+                    if (state == AsyncTask::State::Failed)
+                        run->exception = t->getStoredException();
+
+                    completeChainedRun(run, index + 1, false);
+                });
+    } catch (...) {
+        run->exception = std::current_exception();
+        completeChainedRun(run, index, false);
+    }
+}
+
+void AsyncTaskService::runFallbackStep(std::shared_ptr<ChainedRun> run, int index) {
+    // if fallback aborted, also abort all further tasks
+    if (index == run->tasks.count() || run->self->getState() != AsyncTask::State::Running) {
+        completeChainedRun(run, index, false);
+        return;
+    }
+
+    auto& task = run->tasks[index];
+    if (log)
+        qDebug() << "Fallback is running its next subtask:"
+                 << reinterpret_cast<intptr_t>(task.get());
+
+    try {
+        runThen(task,
+                run->priority,
+                [this, run, index](std::shared_ptr<AsyncTask>, AsyncTask::State state) {
+                    // if current task succeeded, fallback is finished
+                    if (state == AsyncTask::State::Finished)
+                        completeChainedRun(run, index + 1, true);
+                    else
+                        runFallbackStep(run, index + 1);
+                });
+    } catch (...) {
+        run->exception = std::current_exception();
+        completeChainedRun(run, index, false);
+    }
+}
+
+void AsyncTaskService::completeChainedRun(std::shared_ptr<ChainedRun> run,
+                                          int skippedFrom,
+                                          bool result)
+{
+    for (int i = skippedFrom; i < run->tasks.count(); ++i) {
+        auto& task = run->tasks[i];
+        if (log)
+            qDebug() << run->compositeType << "is prevented from running its next subtask:"
+                     << reinterpret_cast<intptr_t>(task.get());
+        if (task->getAutoRemove())
+            deleteTask(task);
+    }
+
+    if (run->exception != nullptr) {
+        if (log)
+            qDebug() << run->compositeType << "(" << reinterpret_cast<intptr_t>(run->self.get())
+                     << ") rethrowing exception stored in the failed subtask.";
+        run->self->core->exception = run->exception;
+    }
+
+    if (log)
+        qDebug() << run->compositeType << "(" << reinterpret_cast<intptr_t>(run->self.get())
+                 << ") returned.";
+    run->complete(result);
+}
+
 std::shared_ptr<AsyncTask> AsyncTaskService::createSequence(
         QList<std::shared_ptr<AsyncTask>> tasks)
 {
@@ -175,65 +296,18 @@ std::shared_ptr<AsyncTask> AsyncTaskService::createSequence(
         throw std::runtime_error("Cannot create Sequence of foreign tasks.");
 
     auto sequence = createTask<true>([this, tasks](std::shared_ptr<AsyncTask> self) {
-        bool result                  = true;
-        std::exception_ptr exception = nullptr;
-
         if (!this->initSubtasks(self, tasks, "Sequence"))
             return false;
 
-        for (auto& task : tasks) {
-            auto autoremove = task->getAutoRemove();
-            auto fin        = util::finally([this, task, autoremove] {
-                if (autoremove)
-                    deleteTask(task);
-            });
-
-            // if sequence aborted, also abort all further tasks
-            if (!result) {
-                if (log)
-                    qDebug() << "Sequence is prevented from running its next subtask:"
-                             << reinterpret_cast<intptr_t>(task.get());
-                continue;
-            }
-
-            if (log)
-                qDebug() << "Sequence is running its next subtask:"
-                         << reinterpret_cast<intptr_t>(task.get());
-
-            // prevent deletion of task, run it synchronously
-            task->setAutoRemove(false);
-            runTask(task, false, AsyncTask::getCurrentPriority());
-
-            auto state = task->getState();
-
-            // if current task has been aborted, also abort the sequence itself
-            if (state == AsyncTask::State::Canceled || state == AsyncTask::State::TimedOut ||
-                state == AsyncTask::State::Terminated) {
-                self->setState(state);
-                result = false;
-            }
-
-            // if current task has failed, abort the sequence
-            if (state == AsyncTask::State::Failed) {
-                result    = false;
-                exception = task->exception;
-            }
-        }
-
-        if (exception != nullptr) {
-            if (log)
-                qDebug() << "Sequence (" << reinterpret_cast<intptr_t>(self.get())
-                         << ") rethrowing exception stored in the failed subtask.";
-            std::rethrow_exception(exception);
-        }
-
-        if (log)
-            qDebug() << "Sequence (" << reinterpret_cast<intptr_t>(self.get()) << ") returned.";
-        return result;
+        // every subtask is started by the end of the previous one, no thread waits for them
+        auto run = std::make_shared<ChainedRun>(ChainedRun{"Sequence",
+                                                           self,
+                                                           tasks,
+                                                           AsyncTask::getCurrentPriority(),
+                                                           deferCompletion(self)});
+        runSequenceStep(run, 0);
+        return true;
     });
-
-    // sequence consists of multiple subtasks with individual timeouts
-    handleSubtaskTimeout(tasks, sequence.get());
     return sequence;
 }
 
@@ -249,55 +323,111 @@ std::shared_ptr<AsyncTask> AsyncTaskService::createFallback(
         throw std::runtime_error("Cannot create Fallback of foreign tasks.");
 
     auto fallback = createTask<true>([this, tasks](std::shared_ptr<AsyncTask> self) {
-        bool result = false;
-
         if (!this->initSubtasks(self, tasks, "Fallback"))
             return false;
 
-        for (auto& task : tasks) {
-            auto autoremove = task->getAutoRemove();
-            auto fin        = util::finally([this, task, autoremove] {
-                if (autoremove)
-                    deleteTask(task);
-            });
+        // every subtask is started by the failure of the previous one, no thread waits for them
+        auto run = std::make_shared<ChainedRun>(ChainedRun{"Fallback",
+                                                           self,
+                                                           tasks,
+                                                           AsyncTask::getCurrentPriority(),
+                                                           deferCompletion(self)});
+        runFallbackStep(run, 0);
+        return true;
+    });
+    return fallback;
+}
 
-            // if fallback aborted, also abort all further tasks
-            auto selfState = self->getState();
-            if (selfState == AsyncTask::State::Canceled ||
-                selfState == AsyncTask::State::TimedOut ||
-                selfState == AsyncTask::State::Finished ||
-                selfState == AsyncTask::State::Terminated) {
-                if (log)
-                    qDebug() << "Fallback is prevented from running its next subtask:"
-                             << reinterpret_cast<intptr_t>(task.get());
-                continue;
-            }
+// a Parallel or Attempt run, all its subtasks run at once and the last one to end completes it
+struct AsyncTaskService::GatheredRun {
+    QString compositeType;
+    std::shared_ptr<AsyncTask> self;
+    QList<std::shared_ptr<AsyncTask>> tasks;
+    std::function<void(bool)> complete;
+    bool firstSuccessDecides = false;  // Attempt, for Parallel the first failure decides
+    std::atomic_int remaining = 0;
+    std::atomic_bool decided  = false;
+    std::exception_ptr exception = nullptr;
+};
 
+void AsyncTaskService::runGathered(std::shared_ptr<GatheredRun> run,
+                                   AsyncTask::Priority priority)
+{
+    if (log)
+        qDebug() << run->compositeType << "(" << reinterpret_cast<intptr_t>(run->self.get())
+                 << ") running its children.";
+
+    run->remaining = run->tasks.count();
+    for (const auto& task : std::as_const(run->tasks)) {
+        // once the outcome is decided or the composite has been aborted, the rest is not started
+        if (run->decided || run->self->getState() != AsyncTask::State::Running) {
             if (log)
-                qDebug() << "Fallback is running its next subtask:"
+                qDebug() << run->compositeType << "is prevented from running its subtask:"
                          << reinterpret_cast<intptr_t>(task.get());
+            if (task->getAutoRemove())
+                deleteTask(task);
+            if (--run->remaining == 0)
+                completeGatheredRun(run);
+            continue;
+        }
 
-            // prevent deletion of task, run it synchronously
-            task->setAutoRemove(false);
-            runTask(task, false, AsyncTask::getCurrentPriority());
+        try {
+            runThen(task,
+                    priority,
+                    [this, run](std::shared_ptr<AsyncTask> t, AsyncTask::State state) {
+                        gatherSubtask(run, t, state, t->getStoredException());
+                    });
+        } catch (...) {
+            gatherSubtask(run, task, AsyncTask::State::Failed, std::current_exception());
+            continue;
+        }
 
-            auto state = task->getState();
+        // the subtask is Running by now, or it has ended already; a decision made after the
+        // check above may have canceled it while it was not started yet, which does nothing
+        if (run->decided)
+            task->cancel();
+    }
+}
 
-            // if current task succeeded, fallback is finished
-            if (state == AsyncTask::State::Finished) {
-                self->setState(AsyncTask::State::Finishing);
-                result = true;
-            }
-        }
+void AsyncTaskService::gatherSubtask(std::shared_ptr<GatheredRun> run,
+                                     std::shared_ptr<AsyncTask> task,
+                                     AsyncTask::State state,
+                                     std::exception_ptr exception)
+{
+    // a terminated subtask terminates a Parallel, but it is just a failed one for an Attempt
+    if (state == AsyncTask::State::Terminated && !run->firstSuccessDecides &&
+        !run->self->isTerminated())
+        run->self->terminate();
+
+    // the first decisive subtask cancels all the others
+    bool succeeded = state == AsyncTask::State::Finished;
+    if (succeeded == run->firstSuccessDecides && !run->decided.exchange(true)) {
+        if (!succeeded)
+            run->exception = exception;
+
+        for (const auto& t : std::as_const(run->tasks))
+            if (t != task)
+                t->cancel();
+    }
+
+    // the stored exception is published by the decrement
+    if (--run->remaining == 0)
+        completeGatheredRun(run);
+}
 
+void AsyncTaskService::completeGatheredRun(std::shared_ptr<GatheredRun> run) {
+    if (log)
+        qDebug() << run->compositeType << "(" << reinterpret_cast<intptr_t>(run->self.get())
+                 << ") finished running all its children.";
+
+    if (run->exception != nullptr) {
         if (log)
-            qDebug() << "Fallback (" << reinterpret_cast<intptr_t>(self.get()) << ") returned.";
-        return result;
-    });
+            qDebug() << run->compositeType << "(" << reinterpret_cast<intptr_t>(run->self.get())
+                     << ") rethrowing exception stored in the failed child task.";
+        run->self->core->exception = run->exception;
+    }
 
-    // fallback consists of multiple subtasks with individual timeouts
-    handleSubtaskTimeout(tasks, fallback.get());
-    return fallback;
+    run->complete(run->decided == run->firstSuccessDecides);
 }
 
 std::shared_ptr<AsyncTask> AsyncTaskService::createParallel(
@@ -312,193 +442,17 @@ std::shared_ptr<AsyncTask> AsyncTaskService::createParallel(
         throw std::runtime_error("Cannot create Parallel of foreign tasks.");
 
     auto parallel = createTask<true>([this, tasks](std::shared_ptr<AsyncTask> self) {
-        auto result        = std::make_shared<bool>(true);
-        auto selfFailed    = std::make_shared<bool>(false);
-        auto alreadyFailed = std::make_shared<bool>(false);
-        auto allFinished   = std::make_shared<std::condition_variable>();
-        auto tasksEnded    = std::make_shared<std::map<AsyncTaskPtr, bool>>();
-        auto mutex         = std::make_shared<std::mutex>();
-        auto exception     = std::make_shared<std::exception_ptr>(nullptr);
-
-        DelegateConnection selfEndedConn, selfTerminatedConn;
-        std::map<AsyncTaskPtr, QList<DelegateConnection>> startedConns, endedConns, terminatedConns;
-
         if (!this->initSubtasks(self, tasks, "Parallel"))
             return false;
 
-        auto childEnded = [result,
-                           alreadyFailed,
-                           tasks,
-                           mutex,
-                           tasksEnded,
-                           allFinished,
-                           exception](AsyncTaskPtr t, bool success) {
-            bool cancelTasks = false;
-
-            {
-                std::lock_guard<std::mutex> lock(*mutex);
-                if (!success) {
-                    // handle failure
-                    *result = false;
-
-                    // cancel all tasks if just failed
-                    if (!(*alreadyFailed)) {
-                        *alreadyFailed = true;
-                        cancelTasks    = true;
-                        *exception     = t->exception;
-                    }
-                }
-
-                (*tasksEnded)[t] = true;
-            }
-
-            if (cancelTasks) {
-                for (auto task : tasks) {
-                    if (task == t)
-                        continue;
-
-                    task->cancel();
-
-                    std::lock_guard<std::mutex> lock(*mutex);
-                    (*tasksEnded)[task] = true;
-                }
-            }
-
-            allFinished->notify_one();
-        };
-
-        // get tasks ready
-        for (auto task : tasks) {
-            (*tasksEnded)[task] = false;
-            DelegateConnection startedConn, endedConn, terminatedConn;
-            std::weak_ptr<AsyncTask> selfWeak = self;
-
-            task->onStarted(
-                    [selfWeak](std::shared_ptr<AsyncTask> t) {
-                        auto s = selfWeak.lock();
-                        if (s == nullptr)
-                            return;
-
-                        if (s->getState() != AsyncTask::State::Running) {
-                            if (log)
-                                qDebug() << "Parallel cancelled before running its subtask:"
-                                         << reinterpret_cast<intptr_t>(t.get());
-                            t->setState(s->getState());
-                        }
-                    },
-                    false,
-                    &startedConn);
-
-            task->onEnded([childEnded](std::shared_ptr<AsyncTask> t,
-                                       bool success) { childEnded(t, success); },
-                          false,
-                          &endedConn);
-
-            task->onTerminated(
-                    [selfWeak](std::shared_ptr<AsyncTask> t) {
-                        auto s = selfWeak.lock();
-                        if (s == nullptr)
-                            return;
-
-                        if (!s->isTerminated())
-                            s->terminate();
-                    },
-                    false,
-                    &terminatedConn);
-
-            startedConns[task].append(startedConn);
-            endedConns[task].append(endedConn);
-            terminatedConns[task].append(terminatedConn);
-        }
-
-        // this task failed (timeout, cancellation)
-        self->onEnded(
-                [tasks, selfFailed](std::shared_ptr<AsyncTask> t, bool success) {
-                    if (!success) {
-                        *selfFailed = true;
-                        for (auto task : tasks)
-                            task->cancel();
-                    }
-                },
-                false,
-                &selfEndedConn);
-
-        // this task has been terminated
-        self->onTerminated(
-                [selfFailed, allFinished](std::shared_ptr<AsyncTask> t) {
-                    *selfFailed = true;
-                    allFinished->notify_one();
-                },
-                false,
-                &selfTerminatedConn);
-
-        // if self is already cancelled / timed out, do nothing else
-        if (self->getState() != AsyncTask::State::Running) {
-            *selfFailed = true;
-            for (auto task : tasks)
-                task->cancel();
-        }
-
-        if (!(*selfFailed)) {
-            // adding extra thread - this control thread will do nothing
-            ExtraThreadLock extraThread(shared_from_this());
-
-            if (log)
-                qDebug() << "Parallel (" << reinterpret_cast<intptr_t>(self.get())
-                         << ") running its children.";
-
-            // run all tasks asynchronously
-            for (auto task : tasks)
-                runTask(task, AsyncTask::getCurrentPriority());
-
-            // wait all tasks to complete
-            std::unique_lock<std::mutex> taskLock(*mutex);
-            allFinished->wait(taskLock, [tasksEnded, self] {
-                if (self->isTerminated())
-                    return true;
-
-                for (const auto& [_, state] : *tasksEnded)
-                    if (!state)
-                        return false;
-
-                return true;
-            });
-        }
-
-        if (log)
-            qDebug() << "Parallel (" << reinterpret_cast<intptr_t>(self.get())
-                     << ") finished running all its children.";
-
-        // disconnect remaining connections
-        for (auto& [task, conns] : startedConns)
-            for (const auto& conn : conns)
-                task->removeStartedHandler(conn);
-
-        for (auto& [task, conns] : endedConns)
-            for (const auto& conn : conns)
-                task->removeEndedHandler(conn);
-
-        for (auto& [task, conns] : terminatedConns)
-            for (auto& conn : conns)
-                task->removeTerminatedHandler(conn);
-
-        startedConns.clear();
-        endedConns.clear();
-        terminatedConns.clear();
-
-        self->removeEndedHandler(selfEndedConn);
-        self->removeTerminatedHandler(selfTerminatedConn);
-
-        if (*exception != nullptr) {
-            if (log)
-                qDebug() << "Parallel (" << reinterpret_cast<intptr_t>(self.get())
-                         << ") rethrowing exception stored in the failed child task.";
-            std::rethrow_exception(*exception);
-        }
-
-        //        qDebug() << "Parallel (" << reinterpret_cast<intptr_t>(self.get()) << ")
-        //        returned.";
-        return !(*selfFailed) && (*result);
+        // the last subtask to end completes the parallel, no thread waits for them
+        auto run           = std::make_shared<GatheredRun>();
+        run->compositeType = "Parallel";
+        run->self          = self;
+        run->tasks         = tasks;
+        run->complete      = deferCompletion(self);
+        runGathered(run, AsyncTask::getCurrentPriority());
+        return true;
     });
 
     return parallel;
@@ -516,177 +470,18 @@ std::shared_ptr<AsyncTask> AsyncTaskService::createAttempt(
         throw std::runtime_error("Cannot create Attempt of foreign tasks.");
 
     auto attempt = createTask<true>([this, tasks](std::shared_ptr<AsyncTask> self) {
-        auto result           = std::make_shared<bool>(false);
-        auto selfFailed       = std::make_shared<bool>(false);
-        auto alreadySucceeded = std::make_shared<bool>(false);
-        auto allFinished      = std::make_shared<std::condition_variable>();
-        auto tasksEnded       = std::make_shared<std::map<AsyncTaskPtr, bool>>();
-        auto mutex            = std::make_shared<std::mutex>();
-
-        DelegateConnection selfEndedConn, selfTerminatedConn;
-        std::map<AsyncTaskPtr, QList<DelegateConnection>> startedConns, endedConns, terminatedConns;
-
         if (!this->initSubtasks(self, tasks, "Attempt"))
             return false;
 
-        auto childEnded = [result,
-                           alreadySucceeded,
-                           tasks,
-                           mutex,
-                           tasksEnded,
-                           allFinished](AsyncTaskPtr t, bool success) {
-
-            bool cancelTasks = false;
-
-            {
-                std::lock_guard<std::mutex> lock(*mutex);
-                if (success) {
-                    // handle success
-                    *result = true;
-
-                    // cancel all tasks if just succeeded
-                    if (!(*alreadySucceeded)) {
-                        *alreadySucceeded = true;
-                        cancelTasks       = true;
-                    }
-                }
-
-                (*tasksEnded)[t] = true;
-            }
-
-            if (cancelTasks) {
-                for (auto& task : tasks) {
-                    if (task == t)
-                        continue;
-
-                    task->cancel();
-
-                    std::lock_guard<std::mutex> lock(*mutex);
-                    (*tasksEnded)[task] = true;
-                }
-            }
-
-            allFinished->notify_one();
-        };
-
-        // get tasks ready
-        for (auto& task : tasks) {
-            (*tasksEnded)[task] = false;
-            DelegateConnection startedConn, endedConn, terminatedConn;
-            std::weak_ptr<AsyncTask> selfWeak = self;
-
-            task->onStarted(
-                    [selfWeak](std::shared_ptr<AsyncTask> t) {
-                        auto s = selfWeak.lock();
-                        if (s == nullptr)
-                            return;
-
-                        if (s->getState() != AsyncTask::State::Running) {
-                            if (log)
-                                qDebug() << "Attempt cancelled before running its subtask:"
-                                         << reinterpret_cast<intptr_t>(t.get());
-                            t->setState(s->getState());
-                        }
-                    },
-                    false,
-                    &startedConn);
-
-            task->onEnded([childEnded](std::shared_ptr<AsyncTask> t,
-                                       bool success) { childEnded(t, success); },
-                          false,
-                          &endedConn);
-
-            task->onTerminated([childEnded](
-                                       std::shared_ptr<AsyncTask> t) { childEnded(t, false); },
-                               false,
-                               &terminatedConn);
-
-            startedConns[task].append(startedConn);
-            endedConns[task].append(endedConn);
-            terminatedConns[task].append(terminatedConn);
-        }
-
-        // this task failed (timeout, cancellation)
-        self->onEnded(
-                [tasks, selfFailed](std::shared_ptr<AsyncTask> t, bool success) {
-                    if (!success) {
-                        *selfFailed = true;
-                        for (auto task : tasks)
-                            task->cancel();
-                    }
-                },
-                false,
-                &selfEndedConn);
-
-        // this task has been terminated
-        self->onTerminated(
-                [selfFailed, allFinished](std::shared_ptr<AsyncTask> t) {
-                    *selfFailed = true;
-                    allFinished->notify_one();
-                },
-                false,
-                &selfTerminatedConn);
-
-        // if self is already cancelled / timed out, do nothing else
-        if (self->getState() != AsyncTask::State::Running) {
-            *selfFailed = true;
-            for (auto task : tasks)
-                task->cancel();
-        }
-
-        if (!(*selfFailed)) {
-            // adding extra thread - this control thread will do nothing
-            ExtraThreadLock extraThread(shared_from_this());
-
-            if (log)
-                qDebug() << "Attempt (" << reinterpret_cast<intptr_t>(self.get())
-                         << ") running its children.";
-
-            // run all tasks asynchronously
-            for (auto& task : tasks)
-                runTask(task, AsyncTask::getCurrentPriority());
-
-            // wait all tasks to complete
-            std::unique_lock<std::mutex> taskLock(*mutex);
-            allFinished->wait(taskLock, [tasksEnded, self] {
-                if (self->isTerminated())
-                    return true;
-
-                for (const auto& [_, state] : *tasksEnded)
-                    if (!state)
-                        return false;
-
-                return true;
-            });
-        }
-
-        if (log)
-            qDebug() << "Attempt (" << reinterpret_cast<intptr_t>(self.get())
-                     << ") finished running all its children.";
-
-        // disconnect remaining connections
-        for (auto& [task, conns] : startedConns)
-            for (const auto& conn : conns)
-                task->removeStartedHandler(conn);
-
-        for (auto& [task, conns] : endedConns)
-            for (const auto& conn : conns)
-                task->removeEndedHandler(conn);
-
-        for (auto& [task, conns] : terminatedConns)
-            for (const auto& conn : conns)
-                task->removeTerminatedHandler(conn);
-
-        startedConns.clear();
-        endedConns.clear();
-        terminatedConns.clear();
-
-        self->removeEndedHandler(selfEndedConn);
-        self->removeTerminatedHandler(selfTerminatedConn);
-
-        //        qDebug() << "Attempt (" << reinterpret_cast<intptr_t>(self.get()) << ")
-        //        returned.";
-        return !(*selfFailed) && (*result);
+        // the last subtask to end completes the attempt, no thread waits for them
+        auto run                 = std::make_shared<GatheredRun>();
+        run->compositeType       = "Attempt";
+        run->self                = self;
+        run->tasks               = tasks;
+        run->complete            = deferCompletion(self);
+        run->firstSuccessDecides = true;
+        runGathered(run, AsyncTask::getCurrentPriority());
+        return true;
     });
 
     return attempt;
@@ -706,28 +501,22 @@ bool AsyncTaskService::addTask(std::shared_ptr<AsyncTask> task) {
         if (taskIt != tasks.end())
             return false;
 
-        std::weak_ptr<AsyncTask> weak = task;
-        connect(task.get(),
-                &QObject::destroyed,
-                this,
-                [this, weak]() {
-                    {
-                        std::lock_guard<std::recursive_mutex> lock(taskMutex);
-                        auto taskIt = tasks.find(weak);
-                        if (taskIt != tasks.end())
-                            tasks.erase(taskIt);
-                    }
+        // the task unregisters itself from its destructor, see forgetTask
+        tasks.insert(task);
+    }
 
-                    emit this->numberOfTasksChanged(getNumberOfRegisteredTasks(),
-                                                    getNumberOfRunningTasks());
-                },
-                Qt::DirectConnection);
+    emit this->numberOfTasksChanged(getNumberOfRegisteredTasks(), getNumberOfRunningTasks());
+    return true;
+}
 
-        tasks.insert(weak);
+void AsyncTaskService::forgetTask(const std::weak_ptr<AsyncTask>& task) {
+    {
+        std::lock_guard<std::recursive_mutex> lock(taskMutex);
+        if (tasks.erase(task) == 0)
+            return;
     }
 
     emit this->numberOfTasksChanged(getNumberOfRegisteredTasks(), getNumberOfRunningTasks());
-    return true;
 }
 
 bool AsyncTaskService::deleteTask(std::shared_ptr<AsyncTask> task) {
@@ -769,11 +558,11 @@ void AsyncTaskService::deleteAllTasks() {
 }
 
 int AsyncTaskService::getNumberOfAllExecutors() const {
-    return pool->maxThreadCount();
+    return executor->getNumberOfWorkers();
 }
 
 int AsyncTaskService::getNumberOfIdleExecutors() const {
-    return pool->maxThreadCount() - pool->activeThreadCount();
+    return executor->getNumberOfIdleWorkers();
     //    return AsyncTask::aliveTasksCount; // debug purposes - actual task count
 }
 
@@ -879,11 +668,16 @@ void AsyncTaskService::runTask(std::shared_ptr<AsyncTask> task,
     // calculate inherited or desired priority
     auto effectivePriority = priority ? priority.value() : AsyncTask::getCurrentPriority();
 
-    auto function = [this, task, timerGuard, effectivePriority]() {
+    auto function = [this, task, timerGuard, effectivePriority, async]() {
         if (task->isWaitingForDeletion()) {
             if (log)
                 qDebug() << "Task (" << reinterpret_cast<intptr_t>(this)
                          << ") has been removed during async dispatching.";
+
+            // settle the run so that a continuation waiting for its end is not left hanging
+            if (timerGuard != nullptr)
+                delete timerGuard;
+            task->setState(AsyncTask::State::Terminated);
             return;
         }
 
@@ -900,23 +694,55 @@ void AsyncTaskService::runTask(std::shared_ptr<AsyncTask> task,
         //                 task->isWaitingForDeletion()
         //                 << "thread:" << QThread::currentThreadId();
 
-        auto clear = util::finally([this, task]() {
-            {
-                std::lock_guard<std::recursive_mutex> tasksLock(taskMutex);
-                this->runningTasks.remove(task);
-            }
-            emit this->numberOfTasksChanged(getNumberOfRegisteredTasks(),
-                                            getNumberOfRunningTasks());
+        // ends the run, possibly from a continuation on another thread if the task has deferred it
+        auto complete = [this, task, timerGuard](std::optional<bool> ok) {
+            auto clear = util::finally([this, task]() {
+                {
+                    std::lock_guard<std::recursive_mutex> tasksLock(taskMutex);
+                    this->runningTasks.remove(task);
+                }
+                emit this->numberOfTasksChanged(getNumberOfRegisteredTasks(),
+                                                getNumberOfRunningTasks());
+
+                task->clearMaintainedObjects(false);
+
+                std::lock_guard<std::recursive_mutex> lock(task->core->stateMutex);
+                auto& subtasks = task->core->subtasks;
+                if (task->getState() != AsyncTask::State::Terminated && !subtasks.empty()) {
+                    if (log)
+                        qDebug() << "Clearing subtasks of"
+                                 << reinterpret_cast<intptr_t>(task.get());
+                    subtasks.clear();
+                }
+            });
 
-            task->clearMaintainedObjects(false);
+            if (ok && !ok.value()) {
+#ifdef DEBUG_SAVE_STACKTRACE
+                auto stream = qDebug() << "AsyncTask (" << reinterpret_cast<intptr_t>(task.get())
+                                       << ") was constructed in:" << endl;
+                for (auto& s : task->constructedFrom)
+                    stream << "   " << s.toUtf8().data() << endl;
+#endif
 
-            std::lock_guard<std::recursive_mutex> lock(task->stateMutex);
-            if (task->getState() != AsyncTask::State::Terminated && !task->subtasks.empty()) {
-                if (log)
-                    qDebug() << "Clearing subtasks of" << reinterpret_cast<intptr_t>(task.get());
-                task->subtasks.clear();
+                emitExceptionSignals(task);
             }
-        });
+
+            // stop and delete timer for task
+            if (timerGuard != nullptr)
+                delete timerGuard;
+
+            if (ok)
+                task->setState(ok.value() ? AsyncTask::State::Finishing
+                                          : AsyncTask::State::Failing);
+            else if (task->isRunning())
+                task->setState(AsyncTask::State::Terminated);
+        };
+
+        auto completed         = std::make_shared<std::promise<void>>();
+        task->core->completion = [complete, completed](bool ok) {
+            complete(ok);
+            completed->set_value();
+        };
 
         std::optional<bool> ok;
         try {
@@ -929,24 +755,14 @@ void AsyncTaskService::runTask(std::shared_ptr<AsyncTask> task,
                           "deleted).";
         }
 
-        if (ok && !ok.value()) {
-#ifdef DEBUG_SAVE_STACKTRACE
-            auto stream = qDebug() << "AsyncTask (" << reinterpret_cast<intptr_t>(task.get())
-                                   << ") was constructed in:" << endl;
-            for (auto& s : task->constructedFrom)
-                stream << "   " << s.toUtf8().data() << endl;
-#endif
-
-            emitExceptionSignals(task);
+        if (std::exchange(task->core->completion, nullptr) != nullptr)
+            complete(ok);
+        else if (!async) {
+            // the completion has been deferred, but a synchronous run returns only once it is
+            // over; this thread is blocked meanwhile, an extra worker makes up for it
+            ExtraThreadLock extraThread(shared_from_this());
+            completed->get_future().wait();
         }
-
-        // stop and delete timer for task
-        if (timerGuard != nullptr)
-            delete timerGuard;
-
-        if (ok)
-            task->setState(ok.value() ? AsyncTask::State::Finishing
-                                      : AsyncTask::State::Failing);
     };
 
     //    qDebug() << "AsyncTaskService enqued task" << reinterpret_cast<intptr_t>(task.get())
@@ -955,14 +771,9 @@ void AsyncTaskService::runTask(std::shared_ptr<AsyncTask> task,
     //             task->isWaitingForDeletion()
     //             << "thread:" << QThread::currentThreadId();
 
-    if (async) {
-        auto runnable = std::make_shared<AsyncRunnable*>();
-        *runnable     = new AsyncRunnable([function, runnable] {
-            function();
-            delete *runnable;
-        });
-        pool->start(*runnable, static_cast<int>(effectivePriority));
-    } else
+    if (async)
+        executor->execute(function, static_cast<int>(effectivePriority));
+    else
         function();
 }
 
@@ -997,14 +808,3 @@ AsyncTaskService::ExtraThreadLock::ExtraThreadLock(std::shared_ptr<AsyncTaskServ
 AsyncTaskService::ExtraThreadLock::~ExtraThreadLock() {
     service->modifyWorkersCount(-1);
 }
-
-AsyncTaskService::AsyncRunnable::AsyncRunnable(std::function<void()> function)
-    : QRunnable(), function(function)
-{
-    setAutoDelete(false);
-}
-
-void AsyncTaskService::AsyncRunnable::run() {
-    if (function != nullptr)
-        function();
-}
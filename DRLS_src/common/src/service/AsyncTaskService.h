@@ -10,6 +10,7 @@
 #include <typeindex>
 
 #include "common/src/AsyncTask.h"
+#include "common/src/TaskExecutor.h"
 
 namespace std {
 
@@ -48,20 +49,18 @@ class AsyncTaskService
 public:
     static std::shared_ptr<AsyncTaskService> getInstance();
 
+    // creates the shared instance on top of the given executor, must precede getInstance()
+    static std::shared_ptr<AsyncTaskService> createInstance(
+            std::shared_ptr<ITaskExecutor> executor);
+
 private:
     friend class AsyncTask;
 
-    class AsyncRunnable : public QRunnable {
-        friend class AsyncTaskService;
-
-        std::function<void()> function;
-
-        AsyncRunnable(std::function<void()> function);
-        void run() override;
-    };
+    struct ChainedRun;
+    struct GatheredRun;
 
 private:
-    QThreadPool* pool;
+    std::shared_ptr<ITaskExecutor> executor;
     QThread* mainThread;
     std::set<std::weak_ptr<common::AsyncTask>,
              std::owner_less<std::weak_ptr<common::AsyncTask>>>
@@ -69,14 +68,14 @@ private:
 
     QSet<std::shared_ptr<AsyncTask>> runningTasks;
     mutable std::recursive_mutex taskMutex;
-    std::mutex poolMutex;
     bool runOnMainThreadEnabled = false;
 
     bool addTask(std::shared_ptr<AsyncTask> task);
+    // called by the destructor of a task, which can no longer be locked
+    void forgetTask(const std::weak_ptr<AsyncTask>& task);
     void runTask(std::shared_ptr<AsyncTask> task,
                  bool async,
                  std::optional<AsyncTask::Priority> priority);
-    void handleSubtaskTimeout(QList<std::shared_ptr<AsyncTask>> tasks, QObject* parent);
     bool checkOrigin(QList<std::shared_ptr<AsyncTask>> tasks);
     void modifyWorkersCount(int diff);
     void doAsynchronously(std::function<void()> function, bool onExtraThread = false);
@@ -84,6 +83,24 @@ private:
                       const QList<std::shared_ptr<AsyncTask>>& tasks,
                       const QString compositeType);
 
+    // called by the function of a running task to return before the run is over, the run ends
+    // when the returned callback is invoked with the result
+    std::function<void(bool)> deferCompletion(std::shared_ptr<AsyncTask> task);
+
+    // runs the task asynchronously, next gets its settled state once it has ended
+    void runThen(std::shared_ptr<AsyncTask> task,
+                 AsyncTask::Priority priority,
+                 std::function<void(std::shared_ptr<AsyncTask>, AsyncTask::State)> next);
+    void runSequenceStep(std::shared_ptr<ChainedRun> run, int index);
+    void runFallbackStep(std::shared_ptr<ChainedRun> run, int index);
+    void completeChainedRun(std::shared_ptr<ChainedRun> run, int skippedFrom, bool result);
+    void runGathered(std::shared_ptr<GatheredRun> run, AsyncTask::Priority priority);
+    void gatherSubtask(std::shared_ptr<GatheredRun> run,
+                       std::shared_ptr<AsyncTask> task,
+                       AsyncTask::State state,
+                       std::exception_ptr exception);
+    void completeGatheredRun(std::shared_ptr<GatheredRun> run);
+
 protected:
     virtual void emitExceptionSignals(std::shared_ptr<AsyncTask> task);
 
@@ -101,12 +118,12 @@ public:
         ExtraThreadLock& operator=(ExtraThreadLock&&) = delete;
     };
 
-    AsyncTaskService();
+    // a null executor stands for the ThreadPoolExecutor on top of the global QThreadPool
+    AsyncTaskService(std::shared_ptr<ITaskExecutor> executor = nullptr);
     ~AsyncTaskService();
 
     std::shared_ptr<common::AsyncTask> createNoOpTask() {
-        auto taskPtr = new AsyncTask(shared_from_this(), nullptr);
-        auto task    = std::shared_ptr<AsyncTask>(taskPtr);
+        auto task = std::make_shared<AsyncTask>(shared_from_this(), nullptr);
         addTask(task);
         return task;
     }
@@ -124,8 +141,7 @@ public:
     std::shared_ptr<common::AsyncTask> createTask(
             std::function<bool(std::shared_ptr<common::AsyncTask>)> function)
     {
-        auto taskPtr = new AsyncTask(shared_from_this(), function);
-        auto task    = std::shared_ptr<AsyncTask>(taskPtr);
+        auto task = std::make_shared<AsyncTask>(shared_from_this(), function);
         addTask(task);
         return task;
     }
@@ -144,11 +160,20 @@ public:
     std::shared_ptr<AsyncFunction<T>> createFunction(
             std::function<bool(std::shared_ptr<AsyncFunction<T>>)> function)
     {
-        auto funPtr = new AsyncFunction<T>(shared_from_this(),
-                                           [function](std::shared_ptr<AsyncTask> task) {
-                                               return function(task->asFunction<T>());
-                                           });
-        auto fun    = std::shared_ptr<AsyncFunction<T>>(funPtr);
+        // the constructor is protected, make_shared reaches it through a derived type, so the
+        // function and its control block share one allocation
+        struct Enabler : AsyncFunction<T> {
+            Enabler(std::shared_ptr<AsyncTaskService> taskService,
+                    std::function<bool(std::shared_ptr<AsyncTask>)> function)
+                : AsyncFunction<T>(taskService, function)
+            {}
+        };
+
+        std::shared_ptr<AsyncFunction<T>> fun =
+                std::make_shared<Enabler>(shared_from_this(),
+                                          [function](std::shared_ptr<AsyncTask> task) {
+                                              return function(task->asFunction<T>());
+                                          });
         addTask(fun);
         return fun;
     }
@@ -172,6 +197,9 @@ public:
 public slots:
     void runTask(std::shared_ptr<AsyncTask> task,
                  std::optional<common::AsyncTask::Priority> priority = std::nullopt);
+    // Runs the task on the calling thread. The subtasks of a composite run on the executor
+    // even then, the calling thread blocks until they are over and an extra worker is added
+    // for the time being, so a synchronous composite costs a blocked thread.
     void runTaskSync(std::shared_ptr<AsyncTask> task,
                      bool rethrowException                                = false,
                      std::optional<common::AsyncTask::Priority> priority = std::nullopt);
@@ -6,81 +6,414 @@
 
 using namespace common;
 
+const int DelayedResourceLockService::AgingIntervalMs = 1000;
+// a renewal lost to a busy lock table is retried well before the lease expires
+const int DelayedResourceLockService::LeaseRenewalsPerLease = 4;
+
+std::atomic<quint64> DelayedResourceLockService::nextSequence_ = 0;
+
 std::shared_ptr<DelayedResourceLockService> DelayedResourceLockService::instance_;
 
 std::shared_ptr<DelayedResourceLockService> DelayedResourceLockService::getInstance() {
     if (instance_ == nullptr)
         instance_ = std::shared_ptr<DelayedResourceLockService>(
             new DelayedResourceLockService(common::ResourceLockService::getInstance(),
-                                           common::AsyncTaskService::getInstance()));
+                                           common::AsyncTaskService::getInstance(),
+                                           common::RealClock::getInstance()));
 
     return instance_;
 }
 
 DelayedResourceLockService::DelayedResourceLockService(
         std::shared_ptr<IResourceLockService> resourceLockService,
-        std::shared_ptr<AsyncTaskService> asyncTaskService)
+        std::shared_ptr<AsyncTaskService> asyncTaskService,
+        std::shared_ptr<IClock> clock)
     : TaskManager<CancellableOnly>(asyncTaskService)
     , resourceLockService_(resourceLockService)
+    , queuedDemandRegistry_(
+              std::dynamic_pointer_cast<IQueuedDemandRegistry>(resourceLockService))
     , asyncTaskService_(asyncTaskService)
+    , clock_(clock)
 {
     connect(resourceLockService_->meta(),
-            &IResourceLockService::Meta::locksChanged,
+            &IResourceLockService::Meta::resourcesReleased,
             this,
-            [this] {
-                if (!inProgress_) {
-                    bool isEmpty;
-                    {
-                        auto lock = std::lock_guard(asyncLocksMutex_);
-                        isEmpty   = asyncLocks_.isEmpty();
-                    }
+            [this](QList<LockableResource> resources) { wakeWaitersOf(resources); });
+}
 
-                    if (!isEmpty)
-                        onLocksChanged();
-                } else {
-                    hasMissedSignal_ = true;
-                }
-            });
+void DelayedResourceLockService::wakeWaitersOf(const QList<LockableResource>& resources) {
+    {
+        auto lock = std::lock_guard(releasedResourcesMutex_);
+        releasedResources_.append(resources);
+    }
+
+    if (!inProgress_)
+        onLocksChanged();
+    else
+        hasMissedSignal_ = true;
+}
+
+void DelayedResourceLockService::addWaiter(std::shared_ptr<AsyncLock> asyncLock) {
+    asyncLocks_[asyncLock->sequence_] = asyncLock;
+    indexWaiter(asyncLock);
+}
+
+void DelayedResourceLockService::removeWaiter(std::shared_ptr<AsyncLock> asyncLock) {
+    auto it = asyncLocks_.find(asyncLock->sequence_);
+    if (it == asyncLocks_.end() || it->second != asyncLock)
+        return;
+
+    asyncLocks_.erase(it);
+
+    {
+        // cancels the timeout, its heap entry is dropped when it comes up
+        auto lock             = std::lock_guard(deadlinesMutex_);
+        asyncLock->onTimeout_ = nullptr;
+    }
+
+    unindexWaiter(asyncLock);
+}
+
+void DelayedResourceLockService::replaceWaiter(std::shared_ptr<AsyncLock> replaced,
+                                               std::shared_ptr<AsyncLock> asyncLock)
+{
+    // the replacing waiter has inherited the sequence, so it takes the same place
+    auto it = asyncLocks_.find(replaced->sequence_);
+    if (it == asyncLocks_.end() || it->second != replaced) {
+        addWaiter(asyncLock);
+        return;
+    }
+
+    asyncLocks_.erase(it);
+    asyncLocks_[asyncLock->sequence_] = asyncLock;
+    {
+        auto lock            = std::lock_guard(deadlinesMutex_);
+        replaced->onTimeout_ = nullptr;
+    }
+
+    unindexWaiter(replaced);
+    indexWaiter(asyncLock);
+}
+
+void DelayedResourceLockService::indexWaiter(std::shared_ptr<AsyncLock> asyncLock) {
+    std::set<db::EntityType> entityTypes;
+    for (const auto& [res, type] : asyncLock->resources_) {
+        waitersByResource_[res][asyncLock->sequence_] = asyncLock;
+        entityTypes.insert(res.entityType());
+    }
+    for (auto entityType : entityTypes)
+        ++queueDepth_[entityType];
+
+    ++queuedPerOwner_[getOwner(*asyncLock)];
+
+    if (asyncLock->durable_)
+        scheduleJournalFlush();
+
+    if (!asyncLock->coalesceKey_.isEmpty())
+        waitersByCoalesceKey_[asyncLock->coalesceKey_] = asyncLock;
+}
+
+void DelayedResourceLockService::unindexWaiter(std::shared_ptr<AsyncLock> asyncLock) {
+    std::set<db::EntityType> entityTypes;
+    for (const auto& [res, type] : asyncLock->resources_) {
+        entityTypes.insert(res.entityType());
+
+        auto it = waitersByResource_.find(res);
+        if (it == waitersByResource_.end())
+            continue;
+
+        it->second.erase(asyncLock->sequence_);
+        if (it->second.empty())
+            waitersByResource_.erase(it);
+    }
+    for (auto entityType : entityTypes) {
+        if (--queueDepth_[entityType] <= 0)
+            queueDepth_.erase(entityType);
+    }
+
+    auto owner = getOwner(*asyncLock);
+    if (--queuedPerOwner_[owner] <= 0)
+        queuedPerOwner_.erase(owner);
+
+    if (asyncLock->durable_)
+        scheduleJournalFlush();
+
+    auto coalesced = waitersByCoalesceKey_.find(asyncLock->coalesceKey_);
+    if (coalesced != waitersByCoalesceKey_.end() && coalesced->second == asyncLock)
+        waitersByCoalesceKey_.erase(coalesced);
+}
+
+bool DelayedResourceLockService::makeRoomFor(std::shared_ptr<AsyncLock> asyncLock,
+                                             std::shared_ptr<AsyncLock>& evicted,
+                                             AsyncLockStatus& evictedStatus)
+{
+    // the limits don't matter, the queue does not grow
+    auto coalesced = waitersByCoalesceKey_.find(asyncLock->coalesceKey_);
+    if (!asyncLock->coalesceKey_.isEmpty() && coalesced != waitersByCoalesceKey_.end() &&
+        coalesced->second->handle_->finish(AsyncLockStatus::Coalesced)) {
+        evicted       = coalesced->second;
+        evictedStatus = AsyncLockStatus::Coalesced;
+        return true;
+    }
+
+    auto owner       = getOwner(*asyncLock);
+    auto ownerQueued = queuedPerOwner_.find(owner);
+    bool ownerFull   = queueLimits_.maxQueuedPerOwner > 0 &&
+                     ownerQueued != queuedPerOwner_.end() &&
+                     ownerQueued->second >= queueLimits_.maxQueuedPerOwner;
+    bool full = queueLimits_.maxQueued > 0 &&
+                asyncLocks_.size() >= static_cast<size_t>(queueLimits_.maxQueued);
+    if (!ownerFull && !full)
+        return true;
+
+    auto sameResources = [&asyncLock](const AsyncLock& queued) {
+        return std::equal(queued.resources_.begin(),
+                          queued.resources_.end(),
+                          asyncLock->resources_.begin(),
+                          asyncLock->resources_.end(),
+                          [](const auto& a, const auto& b) {
+                              return !(a.first < b.first) && !(b.first < a.first) &&
+                                     a.second == b.second;
+                          });
+    };
+
+    switch (queueLimits_.policy) {
+    case DelayedLockQueueLimits::OverflowPolicy::Reject:
+        return false;
+    case DelayedLockQueueLimits::OverflowPolicy::DropOldest: {
+        // waiters are ordered by arrival
+        auto it = std::find_if(asyncLocks_.begin(), asyncLocks_.end(), [&](const auto& queued) {
+            return !ownerFull || getOwner(*queued.second) == owner;
+        });
+        if (it != asyncLocks_.end())
+            evicted = it->second;
+        evictedStatus = AsyncLockStatus::Dropped;
+        break;
+    }
+    case DelayedLockQueueLimits::OverflowPolicy::Coalesce: {
+        auto it = std::find_if(asyncLocks_.rbegin(), asyncLocks_.rend(), [&](const auto& queued) {
+            return getOwner(*queued.second) == owner && sameResources(*queued.second);
+        });
+        if (it != asyncLocks_.rend())
+            evicted = it->second;
+        evictedStatus = AsyncLockStatus::Coalesced;
+        break;
+    }
+    }
+
+    // a request leaving the queue on its own meanwhile does not make room for another one
+    if (evicted == nullptr || !evicted->handle_->finish(evictedStatus)) {
+        evicted = nullptr;
+        return false;
+    }
+
+    return true;
+}
+
+void DelayedResourceLockService::discard(std::shared_ptr<AsyncLock> asyncLock,
+                                         AsyncLockStatus status)
+{
+    clearQueuedDemand(*asyncLock);
+
+    {
+        auto lock = std::lock_guard(statisticsMutex_);
+        switch (status) {
+        case AsyncLockStatus::Cancelled:
+            ++statistics_.cancelled;
+            break;
+        case AsyncLockStatus::Rejected:
+            ++statistics_.rejected;
+            break;
+        case AsyncLockStatus::Dropped:
+            ++statistics_.dropped;
+            break;
+        case AsyncLockStatus::Coalesced:
+            ++statistics_.coalesced;
+            break;
+        default:
+            break;
+        }
+    }
+
+    asyncLock->task_->terminate();
+
+    // an overloaded queue is reported like a timeout, a cancelling caller knows already and
+    // a coalesced request is served by the one replacing it
+    bool overloaded = status == AsyncLockStatus::Rejected || status == AsyncLockStatus::Dropped;
+    if (overloaded && asyncLock->timeoutTask_ != nullptr)
+        asyncLock->timeoutTask_->runUnmanaged();
+}
+
+QString DelayedResourceLockService::getOwner(const AsyncLock& asyncLock) {
+    if (std::holds_alternative<common::CallerContext>(asyncLock.contextOrTag_))
+        return std::get<common::CallerContext>(asyncLock.contextOrTag_).token;
+
+    return std::get<QString>(asyncLock.contextOrTag_);
+}
+
+void DelayedResourceLockService::scheduleTimeout(std::shared_ptr<AsyncLock> asyncLock,
+                                                 QDateTime deadline,
+                                                 std::shared_ptr<IClock> clock)
+{
+    auto lock = std::lock_guard(deadlinesMutex_);
+
+    // entries of granted waiters pile up with long timeouts, drop them once they dominate
+    if (deadlines_.size() > 2 * asyncLocks_.size() + 64) {
+        std::erase_if(deadlines_, [](const Deadline& deadline) {
+            auto asyncLock = deadline.asyncLock.lock();
+            return asyncLock == nullptr || asyncLock->onTimeout_ == nullptr;
+        });
+        std::make_heap(deadlines_.begin(), deadlines_.end(), std::greater<>());
+    }
+
+    deadlines_.push_back({deadline, asyncLock});
+    std::push_heap(deadlines_.begin(), deadlines_.end(), std::greater<>());
+
+    armDeadlineTimer(clock);
+}
+
+void DelayedResourceLockService::armDeadlineTimer(std::shared_ptr<IClock> clock) {
+    if (deadlines_.empty())
+        return;
+
+    auto next = deadlines_.front().at;
+    if (armedDeadline_ && *armedDeadline_ <= next)
+        return;
+
+    // a timer armed for a later deadline becomes stale, it is ignored when it fires
+    armedDeadline_  = next;
+    auto generation = ++timerGeneration_;
+    auto delayMs    = qMax<qint64>(0, clock->now().msecsTo(next));
+
+    clock->singleShot(static_cast<int>(qMin<qint64>(delayMs, std::numeric_limits<int>::max())),
+                      this,
+                      [this, generation, clock] { onDeadlineTimer(generation, clock); });
+}
+
+void DelayedResourceLockService::onDeadlineTimer(quint64 generation,
+                                                 std::shared_ptr<IClock> clock)
+{
+    QList<std::function<void()>> expired;
+    {
+        auto lock = std::lock_guard(deadlinesMutex_);
+        if (generation != timerGeneration_)
+            return;
+
+        armedDeadline_ = std::nullopt;
+
+        auto now = clock->now();
+        while (!deadlines_.empty() && deadlines_.front().at <= now) {
+            std::pop_heap(deadlines_.begin(), deadlines_.end(), std::greater<>());
+            auto asyncLock = deadlines_.back().asyncLock.lock();
+            deadlines_.pop_back();
+
+            if (asyncLock != nullptr && asyncLock->onTimeout_ != nullptr) {
+                expired.append(std::move(asyncLock->onTimeout_));
+                asyncLock->onTimeout_ = nullptr;
+            }
+        }
+
+        armDeadlineTimer(clock);
+    }
+
+    for (const auto& onTimeout : expired)
+        onTimeout();
+}
+
+QList<std::shared_ptr<DelayedResourceLockService::AsyncLock>>
+DelayedResourceLockService::takeWaitersOfReleasedResources()
+{
+    QList<LockableResource> resources;
+    {
+        auto lock = std::lock_guard(releasedResourcesMutex_);
+        resources.swap(releasedResources_);
+    }
+
+    std::set<std::shared_ptr<AsyncLock>> waiters;
+    auto insert = [&waiters](const Waiters& resourceWaiters) {
+        for (const auto& [sequence, asyncLock] : resourceWaiters)
+            waiters.insert(asyncLock);
+    };
+    auto collect = [this, &insert](const LockableResource& res) {
+        auto it = waitersByResource_.find(res);
+        if (it != waitersByResource_.end())
+            insert(it->second);
+    };
+
+    for (const auto& res : resources) {
+        if (res.targetId < 0) {
+            // a type-level release may free any row of the type
+            for (auto it = waitersByResource_.lower_bound(
+                         LockableResource(res.entityType(), std::numeric_limits<int>::min()));
+                 it != waitersByResource_.end() && it->first.entityType() == res.entityType();
+                 ++it)
+                insert(it->second);
+        } else {
+            collect(res);
+            collect(LockableResource(res.entityType()));
+        }
+    }
+
+    return QList<std::shared_ptr<AsyncLock>>(waiters.begin(), waiters.end());
 }
 
 // clang-format off
 void DelayedResourceLockService::onLocksChanged() {
     inProgress_ = true;
 
-    auto releaseCallback = [this](auto it){
-        if (std::holds_alternative<common::CallerContext>((*it)->contextOrTag_)) {
+    auto releaseCallback = [this](std::shared_ptr<AsyncLock> asyncLock) {
+        if (std::holds_alternative<common::CallerContext>(asyncLock->contextOrTag_)) {
             resourceLockService_
-            ->releaseLocks((*it)->resources_,
-                           std::get<common::CallerContext>((*it)->contextOrTag_))
-            ->runSync();
+            ->releaseLocks(asyncLock->resources_,
+                           std::get<common::CallerContext>(asyncLock->contextOrTag_))
+            ->runUnmanaged();
         } else {
             resourceLockService_
-            ->releaseSystemLocks((*it)->resources_,
-                                 std::get<QString>((*it)->contextOrTag_))
-            ->runSync();
+            ->releaseSystemLocks(asyncLock->resources_,
+                                 std::get<QString>(asyncLock->contextOrTag_))
+            ->runUnmanaged();
         }
     };
 
-    auto onResourceAvailableCallback = [this, releaseCallback](auto& it, bool result) {
+    // the task only gets dispatched here, so a long task neither blocks the other grants
+    // nor addAsyncLock() callers, its resources are released when it ends
+    auto onResourceAvailableCallback = [this, releaseCallback](auto asyncLock, bool result) {
         if (result) {
+            clearQueuedDemand(*asyncLock);
+            removeWaiter(asyncLock);
+            // timed out meanwhile, the task must not run
+            if (!asyncLock->handle_->finish(AsyncLockStatus::Granted)) {
+                releaseCallback(asyncLock);
+                return;
+            }
+
             qDebug() << "[DRLS] Executing Previously queued task";
-            (*it)->task_
-            ->onEnded([it, releaseCallback](...) {
-                releaseCallback(it);
-            },
-            false)
-            ->runSync();
-            it = asyncLocks_.erase(it);
+            recordGrant(*asyncLock, true, clock_->now());
+            runGranted(asyncLock, [asyncLock, releaseCallback] { releaseCallback(asyncLock); },
+                       clock_);
         } else {
-            ++it;
+            asyncLock->admitted_ = true;
+            ++asyncLock->attempts_;
         }
     };
 
-    auto onFailedCallback = [this](auto task, auto& it) {
-        qWarning() << logOnFailure(task);
+    // returns true for a rejected waiter, which is discarded once the queue is unlocked
+    auto onFailedCallback = [this](auto task, auto asyncLock) {
+        bool rejected = isAdmissionRejection(task);
+        if (rejected) {
+            rejected = asyncLock->handle_->finish(AsyncLockStatus::Rejected);
+        } else {
+            qWarning() << logOnFailure(task);
+            if (asyncLock->handle_->finish(AsyncLockStatus::Failed)) {
+                auto lock = std::lock_guard(statisticsMutex_);
+                ++statistics_.failed;
+            }
+        }
         // In the failing case we don't want the lock,
         // the failure won't resolv itself so get rid of it.
-        it = asyncLocks_.erase(it);
+        clearQueuedDemand(*asyncLock);
+        removeWaiter(asyncLock);
+        return rejected;
     };
 
     asyncTaskService_
@@ -94,71 +427,399 @@ void DelayedResourceLockService::onLocksChanged() {
 
         hasMissedSignal_ = false;
 
+        // discarding runs the timeout tasks, which must not find the queue locked
+        QList<std::shared_ptr<AsyncLock>> rejected;
+        auto finRejected = util::finally([this, &rejected] {
+            for (const auto& asyncLock : rejected)
+                discard(asyncLock, AsyncLockStatus::Rejected);
+        });
+
         auto lock = std::lock_guard(asyncLocksMutex_);
 
-        for (auto it = asyncLocks_.begin(); it != asyncLocks_.end();) {
-            if (std::holds_alternative<common::CallerContext>((*it)->contextOrTag_)) {
-                resourceLockService_
-                ->acquireLocks((*it)->resources_,
-                               std::get<common::CallerContext>((*it)->contextOrTag_))
-                ->onResultAvailable([&it, onResourceAvailableCallback](bool result) {
-                   onResourceAvailableCallback(it, result);
-                },
-                false)
-                ->onFailed([&it, onFailedCallback](auto task) { // Exception from aquireLocks()
-                    onFailedCallback(task, it);
-                },
-                false)
-                ->runSync();
+        // nobody else can make progress, the rest of the queue is left alone
+        auto candidates = takeWaitersOfReleasedResources();
+        if (candidates.isEmpty())
+            return;
+
+        // waiters ranking first under the fairness policy get the first chance
+        auto now = clock_->now();
+        for (auto& asyncLock : candidates)
+            asyncLock->effectivePriority_ = getEffectivePriority(*asyncLock, now);
+        std::sort(candidates.begin(), candidates.end(), [this, &now](auto& a, auto& b) {
+            return isAhead(*a, *b, now);
+        });
+
+        for (auto& asyncLock : candidates) {
+            // leaving the queue already
+            if (asyncLock->handle_->getStatus() != AsyncLockStatus::Queued)
+                continue;
+
+            // a blocked waiter keeps its resources from the ones ranking after it, granted
+            // waiters have already left the index
+            if (hasConflictingWaiterAhead(*asyncLock, now))
+                continue;
+
+            // the order has been settled above, the queued demands must not reorder it
+            auto priority = AsyncTask::Priority::High;
+            AsyncFuncPtr<bool> acquire;
+            if (std::holds_alternative<common::CallerContext>(asyncLock->contextOrTag_)) {
+                auto context     = std::get<common::CallerContext>(asyncLock->contextOrTag_);
+                context.admitted = asyncLock->admitted_;
+
+                acquire = resourceLockService_->acquireLocks(asyncLock->resources_, context);
             } else {
-                resourceLockService_
-                ->acquireSystemLocks((*it)->resources_,
-                               std::get<QString>((*it)->contextOrTag_))
-                ->onResultAvailable([&it, onResourceAvailableCallback](bool result) {
-                    onResourceAvailableCallback(it, result);
-                },
-                false)
-                ->onFailed([&it, onFailedCallback](auto task) { // Exception from aquireLocks()
-                    onFailedCallback(task, it);
-                },
-                false)
-                ->runSync();
+                acquire = resourceLockService_
+                          ->acquireSystemLocks(asyncLock->resources_,
+                                               std::get<QString>(asyncLock->contextOrTag_));
             }
+            acquire
+            ->onResultAvailable([asyncLock, onResourceAvailableCallback](bool result) {
+                onResourceAvailableCallback(asyncLock, result);
+            },
+            false)
+            // Exception from aquireLocks()
+            ->onFailed([asyncLock, onFailedCallback, &rejected](auto task) {
+                if (onFailedCallback(task, asyncLock))
+                    rejected.append(asyncLock);
+            },
+            false)
+            ->runSync(false, priority);
         }
-        if (asyncLocks_.isEmpty())
+        if (asyncLocks_.empty())
             emit lastTaskEnded();
     })
     ->run<ManagedTaskBehaviour::CancelOnExit>(this);
 }
 // clang-format on
 
-void DelayedResourceLockService::addAsyncLock(
+AsyncLockHandlePtr DelayedResourceLockService::addAsyncLock(
         CallerContext context,
         std::map<LockableResource, ResourceLockType> resources,
         AsyncTaskPtr task,
         int timeoutMs,
-        AsyncTaskPtr timeoutTask)
+        AsyncTaskPtr timeoutTask,
+        AsyncLockOptions options)
 {
-    manageAddedAsyncLock(context, resources, task, timeoutMs, timeoutTask);
+    return manageAddedAsyncLock(context, resources, task, timeoutMs, timeoutTask, options);
 }
 
-void DelayedResourceLockService::addAsyncSystemLock(
+AsyncLockHandlePtr DelayedResourceLockService::addAsyncLockPipeline(
+        CallerContext context,
+        std::map<LockableResource, ResourceLockType> resources,
+        QList<AsyncTaskPtr> steps,
+        int timeoutMs,
+        AsyncTaskPtr timeoutTask,
+        AsyncLockOptions options)
+{
+    return manageAddedAsyncLock(context,
+                                resources,
+                                asyncTaskService_->createSequence(steps),
+                                timeoutMs,
+                                timeoutTask,
+                                options);
+}
+
+AsyncLockHandlePtr DelayedResourceLockService::addAsyncSystemLockPipeline(
+        QString tag,
+        std::map<LockableResource, ResourceLockType> resources,
+        QList<AsyncTaskPtr> steps,
+        int timeoutMs,
+        AsyncTaskPtr timeoutTask,
+        AsyncLockOptions options)
+{
+    return manageAddedAsyncLock(tag,
+                                resources,
+                                asyncTaskService_->createSequence(steps),
+                                timeoutMs,
+                                timeoutTask,
+                                options);
+}
+
+AsyncLockHandlePtr DelayedResourceLockService::addAsyncSystemLock(
         QString tag,
         std::map<LockableResource, ResourceLockType> resources,
         AsyncTaskPtr task,
         int timeoutMs,
-        AsyncTaskPtr timeoutTask)
+        AsyncTaskPtr timeoutTask,
+        AsyncLockOptions options)
 {
-    manageAddedAsyncLock(tag, resources, task, timeoutMs, timeoutTask);
+    return manageAddedAsyncLock(tag, resources, task, timeoutMs, timeoutTask, options);
+}
+
+void DelayedResourceLockService::setClock(std::shared_ptr<IClock> clock) {
+    if (clock == nullptr)
+        throw std::invalid_argument("Clock is not specified.");
+
+    auto lock = std::lock_guard(asyncLocksMutex_);
+
+    // the clocks may start at different times, the queued requests are moved onto the new one
+    auto shiftMs = clock_->now().msecsTo(clock->now());
+    clock_       = clock;
+    for (const auto& [sequence, asyncLock] : asyncLocks_) {
+        asyncLock->enqueued_ = asyncLock->enqueued_.addMSecs(shiftMs);
+        asyncLock->deadline_ = asyncLock->deadline_.addMSecs(shiftMs);
+    }
+
+    // shifting every deadline by the same amount keeps the heap order
+    auto deadlinesLock = std::lock_guard(deadlinesMutex_);
+    for (auto& deadline : deadlines_)
+        deadline.at = deadline.at.addMSecs(shiftMs);
+
+    // the timer pending on the old clock is ignored when it fires
+    armedDeadline_ = std::nullopt;
+    ++timerGeneration_;
+    armDeadlineTimer(clock);
+}
+
+std::shared_ptr<IClock> DelayedResourceLockService::getClock() {
+    auto lock = std::lock_guard(asyncLocksMutex_);
+    return clock_;
+}
+
+void DelayedResourceLockService::setFairnessPolicy(FairnessPolicy policy) {
+    // the new order may let other waiters through
+    QList<LockableResource> resources;
+    {
+        auto lock       = std::lock_guard(asyncLocksMutex_);
+        fairnessPolicy_ = policy;
+        for (const auto& [res, waiters] : waitersByResource_)
+            resources.append(res);
+
+        // a direct acquire neither waits nor has a deadline, so under the arrival and deadline
+        // orders it comes after every queued waiter
+        auto order = QueuedDemandOrder::Arrival;
+        if (policy == FairnessPolicy::PriorityWithAging)
+            order = QueuedDemandOrder::Priority;
+        else if (policy == FairnessPolicy::WriterPreferring)
+            order = QueuedDemandOrder::WritersFirst;
+        if (queuedDemandRegistry_ != nullptr)
+            queuedDemandRegistry_->setQueuedDemandOrder(order);
+    }
+    wakeWaitersOf(resources);
+}
+
+DelayedResourceLockService::FairnessPolicy DelayedResourceLockService::getFairnessPolicy() {
+    auto lock = std::lock_guard(asyncLocksMutex_);
+    return fairnessPolicy_;
+}
+
+qint64 DelayedResourceLockService::getOldestWaitMs() {
+    auto lock = std::lock_guard(asyncLocksMutex_);
+    if (asyncLocks_.empty())
+        return 0;
+
+    // waiters are ordered by arrival, so the first one has waited the longest
+    return qMax<qint64>(0, asyncLocks_.begin()->second->enqueued_.msecsTo(clock_->now()));
+}
+
+void DelayedResourceLockService::setQueueLimits(DelayedLockQueueLimits limits) {
+    // requests queued already stay, they leave the queue as usual
+    auto lock    = std::lock_guard(asyncLocksMutex_);
+    queueLimits_ = limits;
+}
+
+DelayedLockQueueLimits DelayedResourceLockService::getQueueLimits() {
+    auto lock = std::lock_guard(asyncLocksMutex_);
+    return queueLimits_;
+}
+
+DelayedLockStatistics DelayedResourceLockService::getStatistics() {
+    DelayedLockStatistics statistics;
+    {
+        auto lock  = std::lock_guard(statisticsMutex_);
+        statistics = statistics_;
+    }
+
+    statistics.oldestWaitMs = getOldestWaitMs();
+
+    auto finished = statistics.grantedImmediately + statistics.grantedFromQueue +
+                    statistics.timedOut;
+    if (finished > 0)
+        statistics.deadlineMissRate = static_cast<double>(statistics.timedOut) / finished;
+
+    auto lock = std::lock_guard(asyncLocksMutex_);
+    for (const auto& [entityType, depth] : queueDepth_)
+        statistics.queueDepth.insert(entityType, depth);
+    statistics.queued = static_cast<int>(asyncLocks_.size());
+
+    return statistics;
 }
 
-void DelayedResourceLockService::manageAddedAsyncLock(
+void DelayedResourceLockService::runGranted(std::shared_ptr<AsyncLock> asyncLock,
+                                            std::function<void()> release,
+                                            std::shared_ptr<IClock> clock)
+{
+    if (asyncLock->renewLease_) {
+        asyncLock->holdingLease_ = true;
+        scheduleLeaseRenewal(asyncLock, clock);
+    }
+
+    asyncLock->task_
+            ->onEnded(
+                    [asyncLock, release](auto, bool) {
+                        asyncLock->holdingLease_ = false;
+                        release();
+                    },
+                    false)
+            ->runUnmanaged(static_cast<AsyncTask::Priority>(asyncLock->priority_));
+}
+
+void DelayedResourceLockService::scheduleLeaseRenewal(std::shared_ptr<AsyncLock> asyncLock,
+                                                      std::shared_ptr<IClock> clock)
+{
+    // the timer must not keep a finished request alive
+    std::weak_ptr<AsyncLock> weakLock = asyncLock;
+    auto intervalMs = resourceLockService_->getLeaseDuration() * 1000 / LeaseRenewalsPerLease;
+    clock->singleShot(intervalMs, this, [this, weakLock] {
+        auto asyncLock = weakLock.lock();
+        if (asyncLock == nullptr || !asyncLock->holdingLease_)
+            return;
+
+        auto renew =
+                std::holds_alternative<common::CallerContext>(asyncLock->contextOrTag_)
+                        ? resourceLockService_->renewLocksIfPossible(
+                                  asyncLock->resources_,
+                                  std::get<common::CallerContext>(asyncLock->contextOrTag_))
+                        : resourceLockService_->renewSystemLocksIfPossible(
+                                  asyncLock->resources_,
+                                  std::get<QString>(asyncLock->contextOrTag_));
+
+        // a lease that has expired or has been revoked is not taken again behind the back of
+        // whoever revoked it
+        auto onRenewed = [this, weakLock](bool renewed) {
+            auto asyncLock = weakLock.lock();
+            if (asyncLock == nullptr || !asyncLock->holdingLease_)
+                return;
+
+            if (!renewed) {
+                qWarning() << "[DRLS] Lease of a running task is lost, renewal stopped";
+                return;
+            }
+
+            scheduleLeaseRenewal(asyncLock, getClock());
+        };
+        renew->onResultAvailable(onRenewed)->runUnmanaged();
+    });
+}
+
+void DelayedResourceLockService::recordGrant(const AsyncLock& asyncLock,
+                                             bool fromQueue,
+                                             const QDateTime& now)
+{
+    auto lock = std::lock_guard(statisticsMutex_);
+    if (fromQueue)
+        ++statistics_.grantedFromQueue;
+    else
+        ++statistics_.grantedImmediately;
+
+    statistics_.timeToGrantMs.record(asyncLock.enqueued_.msecsTo(now));
+    statistics_.retriesPerGrant.record(asyncLock.attempts_);
+}
+
+void DelayedResourceLockService::recordTimeout(const QDateTime& enqueued, const QDateTime& now) {
+    auto lock = std::lock_guard(statisticsMutex_);
+    ++statistics_.timedOut;
+    statistics_.timeToTimeoutMs.record(enqueued.msecsTo(now));
+}
+
+bool DelayedResourceLockService::isAhead(const AsyncLock& a,
+                                         const AsyncLock& b,
+                                         const QDateTime& now) const
+{
+    switch (fairnessPolicy_) {
+    case FairnessPolicy::PriorityWithAging: {
+        int priorityA = getEffectivePriority(a, now);
+        int priorityB = getEffectivePriority(b, now);
+        if (priorityA != priorityB)
+            return priorityA > priorityB;
+        break;
+    }
+    case FairnessPolicy::WriterPreferring:
+        if (a.writer_ != b.writer_)
+            return a.writer_;
+        break;
+    case FairnessPolicy::EarliestDeadlineFirst:
+        if (a.deadline_ != b.deadline_)
+            return a.deadline_ < b.deadline_;
+        break;
+    case FairnessPolicy::FifoPerResource:
+        break;
+    }
+
+    return a.sequence_ < b.sequence_;
+}
+
+bool DelayedResourceLockService::hasConflictingWaiterAhead(const AsyncLock& asyncLock,
+                                                           const QDateTime& now) const
+{
+    auto conflicts = [this, &asyncLock, &now](const auto& entry, ResourceLockType type) {
+        for (const auto& [sequence, waiter] : entry.second) {
+            if (waiter.get() == &asyncLock)
+                continue;
+
+            bool shared = type == ResourceLockType::Read &&
+                          waiter->resources_.at(entry.first) == ResourceLockType::Read;
+            if (!shared && isAhead(*waiter, asyncLock, now))
+                return true;
+        }
+        return false;
+    };
+
+    for (const auto& [res, type] : asyncLock.resources_) {
+        if (res.targetId < 0) {
+            // a type-level lock overlaps every row of the type
+            for (auto it = waitersByResource_.lower_bound(
+                         LockableResource(res.entityType(), std::numeric_limits<int>::min()));
+                 it != waitersByResource_.end() && it->first.entityType() == res.entityType();
+                 ++it) {
+                if (conflicts(*it, type))
+                    return true;
+            }
+        } else {
+            for (const auto& key : {res, LockableResource(res.entityType())}) {
+                auto it = waitersByResource_.find(key);
+                if (it != waitersByResource_.end() && conflicts(*it, type))
+                    return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+int DelayedResourceLockService::getEffectivePriority(const AsyncLock& asyncLock,
+                                                     const QDateTime& now)
+{
+    qint64 agingSteps = qMax<qint64>(0, asyncLock.enqueued_.msecsTo(now) / AgingIntervalMs);
+    qint64 highest    = qMax(asyncLock.priority_, static_cast<int>(AsyncTask::Priority::High));
+
+    return static_cast<int>(qMin(asyncLock.priority_ + agingSteps, highest));
+}
+
+void DelayedResourceLockService::setQueuedDemand(const AsyncLock& asyncLock) {
+    if (queuedDemandRegistry_ != nullptr)
+        queuedDemandRegistry_->setQueuedDemand(asyncLock.demandId_,
+                                               asyncLock.resources_,
+                                               asyncLock.priority_);
+}
+
+void DelayedResourceLockService::clearQueuedDemand(const AsyncLock& asyncLock) {
+    if (queuedDemandRegistry_ != nullptr)
+        queuedDemandRegistry_->clearQueuedDemand(asyncLock.demandId_);
+}
+
+AsyncLockHandlePtr DelayedResourceLockService::manageAddedAsyncLock(
         std::variant<common::CallerContext, QString> contextOrTag,
         std::map<LockableResource, ResourceLockType> resources,
         AsyncTaskPtr task,
         int timeoutMs,
-        AsyncTaskPtr timeoutTask)
+        AsyncTaskPtr timeoutTask,
+        AsyncLockOptions options,
+        std::optional<DurableJob> durable,
+        bool restoring)
 {
+    auto priority = options.priority.value_or(AsyncTask::getCurrentPriority());
+
     std::shared_ptr<AsyncLock> asyncLock;
     if (std::holds_alternative<common::CallerContext>(contextOrTag)) {
         asyncLock = std::make_shared<AsyncLock>(std::get<common::CallerContext>(contextOrTag),
@@ -168,16 +829,31 @@ void DelayedResourceLockService::manageAddedAsyncLock(
         asyncLock =
                 std::make_shared<AsyncLock>(std::get<QString>(contextOrTag), resources, task);
     }
+    asyncLock->sequence_    = nextSequence_++;
+    asyncLock->demandId_    = QString::number(asyncLock->sequence_);
+    asyncLock->priority_    = static_cast<int>(priority);
+    asyncLock->timeoutTask_ = timeoutTask;
+    asyncLock->coalesceKey_ = options.coalesceKey;
+    asyncLock->renewLease_  = options.renewLease;
+    asyncLock->durable_     = durable;
+    asyncLock->writer_      = std::any_of(resources.begin(),
+                                          resources.end(),
+                                          [](const auto& entry) {
+                                              return entry.second == ResourceLockType::Write;
+                                          });
+    auto handle        = std::make_shared<AsyncLockHandle>(this, asyncLock);
+    asyncLock->handle_ = handle;
 
     auto release = [this, task, resources, contextOrTag, asyncLock] {
         if (!task->isRunning()) {
             task->terminate();
             {
                 auto lock = std::lock_guard(asyncLocksMutex_);
-                asyncLocks_.removeOne(asyncLock);
-                if (asyncLocks_.isEmpty())
+                removeWaiter(asyncLock);
+                if (asyncLocks_.empty())
                     emit lastTaskEnded();
             }
+            clearQueuedDemand(*asyncLock);
             if (std::holds_alternative<common::CallerContext>(contextOrTag)) {
                 resourceLockService_
                         ->releaseLocks(resources, std::get<common::CallerContext>(contextOrTag))
@@ -191,44 +867,426 @@ void DelayedResourceLockService::manageAddedAsyncLock(
     };
 
     auto onResultAvailableCallback =
-            [this, task, timeoutMs, asyncLock, release, timeoutTask](bool result)
+            [this, task, timeoutMs, asyncLock, handle, release, timeoutTask, restoring](bool result)
     {
         if (result) {
+            // cancelled while the resources were being acquired
+            if (!handle->finish(AsyncLockStatus::Granted)) {
+                release();
+                return;
+            }
+
             qDebug() << "[DRLS] Resources are available, executing task without delay";
-            task->onEnded([release](auto, bool) { release(); }, false)->runUnmanaged();
+            auto clock = getClock();
+            recordGrant(*asyncLock, false, clock->now());
+            runGranted(asyncLock, release, clock);
         } else {
-            qDebug() << "[DRLS] Resources are unavailable, queued task for Delayed execution";
+            std::shared_ptr<AsyncLock> evicted;
+            auto evictedStatus = AsyncLockStatus::Dropped;
+            bool rejected      = false;
             {
                 auto lock = std::lock_guard(asyncLocksMutex_);
-                asyncLocks_.append(asyncLock);
+                if (!handle->setQueued())
+                    return;
+
+                asyncLock->deadline_ = clock_->now().addMSecs(timeoutMs);
+                if (!makeRoomFor(asyncLock, evicted, evictedStatus)) {
+                    handle->finish(AsyncLockStatus::Rejected);
+                    rejected = true;
+                } else if (evicted != nullptr && evictedStatus == AsyncLockStatus::Coalesced) {
+                    // the place in the queue is inherited, aging included
+                    asyncLock->sequence_ = evicted->sequence_;
+                    asyncLock->enqueued_ = evicted->enqueued_;
+                    replaceWaiter(evicted, asyncLock);
+                } else {
+                    if (evicted != nullptr)
+                        removeWaiter(evicted);
+                    asyncLock->enqueued_ = clock_->now();
+                    addWaiter(asyncLock);
+                }
+
+                // the demand and the timeout are set up under the same lock as the indexing,
+                // otherwise a scan could grant the waiter in between and its demand would stay
+                if (!rejected) {
+                    asyncLock->effectivePriority_ = getEffectivePriority(*asyncLock,
+                                                                         clock_->now());
+                    asyncLock->onTimeout_         = [this,
+                                                     release,
+                                                     timeoutTask,
+                                                     handle,
+                                                     enqueued = asyncLock->enqueued_] {
+                        if (!handle->finish(AsyncLockStatus::TimedOut))
+                            return;
+
+                        qDebug() << "[DRLS] Queued task timed out";
+                        recordTimeout(enqueued, getClock()->now());
+                        release();
+                        if (timeoutTask != nullptr)
+                            timeoutTask->runUnmanaged();
+                    };
+                    setQueuedDemand(*asyncLock);
+                    scheduleTimeout(asyncLock, asyncLock->deadline_, clock_);
+                }
             }
 
-            QTimer::singleShot(timeoutMs, asyncLock->guard_.get(), [release, timeoutTask] {
-                qDebug() << "[DRLS] Queued task timed out";
-                release();
-                if (timeoutTask != nullptr)
-                    timeoutTask->runUnmanaged();
-            });
+            if (evicted != nullptr)
+                discard(evicted, evictedStatus);
+
+            if (rejected) {
+                qDebug() << "[DRLS] Resources are unavailable and the queue is full, task rejected";
+                discard(asyncLock, AsyncLockStatus::Rejected);
+                return;
+            }
+
+            qDebug() << "[DRLS] Resources are unavailable, queued task for Delayed execution";
+
+            // a restored journal wakes the waiters of all its jobs at once
+            if (restoring)
+                return;
+
+            // the resources may have been released before the waiter got indexed
+            QList<LockableResource> resources;
+            for (const auto& [res, type] : asyncLock->resources_)
+                resources.append(res);
+            wakeWaitersOf(resources);
         }
     };
 
+    // trying the lock service right away would overtake the queue, or run the work of a queued
+    // request with the same coalesce key a second time, restored jobs are left to the scan
+    bool mustQueue = restoring;
+    {
+        auto lock            = std::lock_guard(asyncLocksMutex_);
+        asyncLock->enqueued_ = clock_->now();
+        asyncLock->deadline_ = asyncLock->enqueued_.addMSecs(timeoutMs);
+        mustQueue = mustQueue || hasConflictingWaiterAhead(*asyncLock, asyncLock->enqueued_);
+        if (!asyncLock->coalesceKey_.isEmpty())
+            mustQueue = mustQueue || waitersByCoalesceKey_.count(asyncLock->coalesceKey_) > 0;
+    }
+    if (mustQueue) {
+        onResultAvailableCallback(false);
+        return handle;
+    }
+
     if (std::holds_alternative<common::CallerContext>(contextOrTag)) {
         resourceLockService_
                 ->acquireLocks(resources, std::get<common::CallerContext>(contextOrTag))
-                ->onResultAvailable(onResultAvailableCallback)
-                ->onFailed([this](auto task) {  // Exception from aquireLocks()
+                ->onResultAvailable([asyncLock, onResultAvailableCallback](bool result) {
+                    asyncLock->admitted_ = true;
+                    onResultAvailableCallback(result);
+                })
+                ->onFailed([this, asyncLock, handle](auto task) {  // Exception from aquireLocks()
+                    // over the owner's admission limits, the resources may well be free
+                    if (isAdmissionRejection(task)) {
+                        if (handle->finish(AsyncLockStatus::Rejected))
+                            discard(asyncLock, AsyncLockStatus::Rejected);
+                        return;
+                    }
+
+                    if (handle->finish(AsyncLockStatus::Failed)) {
+                        auto lock = std::lock_guard(statisticsMutex_);
+                        ++statistics_.failed;
+                    }
                     qWarning() << logOnFailure(task);
                 })
-                ->run<ManagedTaskBehaviour::CancelOnExit>(this);
+                ->run<ManagedTaskBehaviour::CancelOnExit>(this, priority);
     } else {
         resourceLockService_
                 ->acquireSystemLocks(resources, std::get<QString>(contextOrTag))
                 ->onResultAvailable(onResultAvailableCallback)
-                ->onFailed([this](auto task) {  // Exception from aquireLocks()
+                ->onFailed([this, handle](auto task) {  // Exception from aquireLocks()
+                    if (handle->finish(AsyncLockStatus::Failed)) {
+                        auto lock = std::lock_guard(statisticsMutex_);
+                        ++statistics_.failed;
+                    }
                     qWarning() << logOnFailure(task);
                 })
-                ->run<ManagedTaskBehaviour::CancelOnExit>(this);
+                ->run<ManagedTaskBehaviour::CancelOnExit>(this, priority);
+    }
+
+    return handle;
+}
+
+void DelayedResourceLockService::withdraw(std::shared_ptr<AsyncLock> asyncLock) {
+    {
+        auto lock = std::lock_guard(asyncLocksMutex_);
+        removeWaiter(asyncLock);
+        if (asyncLocks_.empty())
+            emit lastTaskEnded();
+    }
+
+    qDebug() << "[DRLS] Queued task cancelled";
+    discard(asyncLock, AsyncLockStatus::Cancelled);
+}
+
+bool DelayedResourceLockService::reprioritize(std::shared_ptr<AsyncLock> asyncLock,
+                                              AsyncTask::Priority priority)
+{
+    QList<LockableResource> resources;
+    {
+        auto lock   = std::lock_guard(asyncLocksMutex_);
+        auto status = asyncLock->handle_->getStatus();
+        if (status != AsyncLockStatus::Pending && status != AsyncLockStatus::Queued)
+            return false;
+
+        asyncLock->priority_ = static_cast<int>(priority);
+        if (status == AsyncLockStatus::Queued) {
+            asyncLock->effectivePriority_ = getEffectivePriority(*asyncLock, clock_->now());
+            setQueuedDemand(*asyncLock);
+            for (const auto& [res, type] : asyncLock->resources_)
+                resources.append(res);
+        }
+
+        if (asyncLock->durable_)
+            scheduleJournalFlush();
+    }
+
+    // the waiter may rank before the ones it has been waiting behind now
+    if (!resources.isEmpty())
+        wakeWaitersOf(resources);
+
+    return true;
+}
+
+DelayedResourceLockService::AsyncLockHandle::AsyncLockHandle(DelayedResourceLockService* service,
+                                                             std::weak_ptr<AsyncLock> asyncLock)
+    : service_(service)
+    , asyncLock_(asyncLock)
+{}
+
+AsyncLockStatus DelayedResourceLockService::AsyncLockHandle::getStatus() const {
+    return status_;
+}
+
+bool DelayedResourceLockService::AsyncLockHandle::cancel() {
+    if (!finish(AsyncLockStatus::Cancelled))
+        return false;
+
+    // the locks of a request still being acquired are released once it got them
+    if (auto asyncLock = asyncLock_.lock())
+        service_->withdraw(asyncLock);
+
+    return true;
+}
+
+bool DelayedResourceLockService::AsyncLockHandle::setPriority(AsyncTask::Priority priority) {
+    auto asyncLock = asyncLock_.lock();
+    if (asyncLock == nullptr)
+        return false;
+
+    return service_->reprioritize(asyncLock, priority);
+}
+
+bool DelayedResourceLockService::AsyncLockHandle::finish(AsyncLockStatus status) {
+    auto current = status_.load();
+    while (current == AsyncLockStatus::Pending || current == AsyncLockStatus::Queued) {
+        if (status_.compare_exchange_weak(current, status))
+            return true;
     }
+
+    return false;
+}
+
+bool DelayedResourceLockService::AsyncLockHandle::setQueued() {
+    auto expected = AsyncLockStatus::Pending;
+    return status_.compare_exchange_strong(expected, AsyncLockStatus::Queued);
+}
+
+void DelayedResourceLockService::registerJobKind(const QString& kind, JobFactory factory) {
+    if (factory == nullptr)
+        throw std::invalid_argument("Job factory is not specified.");
+
+    auto lock           = std::lock_guard(journalMutex_);
+    jobFactories_[kind] = factory;
+}
+
+AsyncLockHandlePtr DelayedResourceLockService::addDurableSystemLock(
+        QString tag,
+        std::map<LockableResource, ResourceLockType> resources,
+        QString kind,
+        QJsonObject payload,
+        int timeoutMs,
+        AsyncLockOptions options)
+{
+    return manageAddedDurableJob(tag, resources, kind, payload, timeoutMs, options, false);
+}
+
+AsyncLockHandlePtr DelayedResourceLockService::manageAddedDurableJob(
+        QString tag,
+        std::map<LockableResource, ResourceLockType> resources,
+        QString kind,
+        QJsonObject payload,
+        int timeoutMs,
+        AsyncLockOptions options,
+        bool restoring)
+{
+    JobFactory factory;
+    {
+        auto lock = std::lock_guard(journalMutex_);
+        auto it   = jobFactories_.find(kind);
+        if (it == jobFactories_.end())
+            throw std::invalid_argument("Job kind is not registered.");
+
+        factory = it->second;
+    }
+
+    auto task = factory(payload);
+    if (task == nullptr)
+        throw std::invalid_argument("Job factory did not create a task.");
+
+    return manageAddedAsyncLock(tag,
+                                resources,
+                                task,
+                                timeoutMs,
+                                nullptr,
+                                options,
+                                DurableJob{kind, payload},
+                                restoring);
+}
+
+int DelayedResourceLockService::openJournal(const QString& path) {
+    QJsonArray entries;
+    QFile file(path);
+    if (file.exists() && file.open(QIODevice::ReadOnly)) {
+        QJsonParseError error;
+        auto document = QJsonDocument::fromJson(file.readAll(), &error);
+        if (error.error != QJsonParseError::NoError || !document.isObject())
+            qWarning() << "[DRLS] Journal" << path << "is corrupt, starting with an empty one";
+        else
+            entries = document.object()["entries"].toArray();
+        file.close();
+    }
+
+    {
+        auto lock                 = std::lock_guard(journalMutex_);
+        journalPath_              = path;
+        journalOpen_              = true;
+        unrestoredJournalEntries_ = QJsonArray();
+    }
+
+    // the entries are ordered by their arrival, re-adding them keeps the order. They are queued
+    // without trying the lock service, a large journal would otherwise hit it with all its jobs
+    // at once, the scan below grants them one by one in the order of the fairness policy
+    auto now     = getClock()->now();
+    int restored = 0;
+    QList<LockableResource> restoredResources;
+    for (const auto& value : entries) {
+        auto entry       = value.toObject();
+        auto kind        = entry["kind"].toString();
+        auto deadline    = QDateTime::fromString(entry["deadline"].toString(), Qt::ISODateWithMs);
+        auto remainingMs = qMin<qint64>(now.msecsTo(deadline), std::numeric_limits<int>::max());
+        if (remainingMs <= 0) {
+            qDebug() << "[DRLS] Journaled job" << kind << "timed out meanwhile";
+            continue;
+        }
+
+        std::map<LockableResource, ResourceLockType> resources;
+        for (const auto& resourceValue : entry["resources"].toArray()) {
+            auto resource = resourceValue.toObject();
+            auto res = LockableResource(static_cast<db::EntityType>(resource["entityType"].toInt()),
+                                        resource["id"].toInt());
+            resources[res] = resource["lockType"].toString() == "Read" ? ResourceLockType::Read
+                                                                       : ResourceLockType::Write;
+        }
+
+        AsyncLockOptions options;
+        options.priority    = static_cast<AsyncTask::Priority>(entry["priority"].toInt());
+        options.coalesceKey = entry["coalesceKey"].toString();
+        options.renewLease  = entry["renewLease"].toBool();
+
+        try {
+            manageAddedDurableJob(entry["tag"].toString(),
+                                  resources,
+                                  kind,
+                                  entry["payload"].toObject(),
+                                  static_cast<int>(remainingMs),
+                                  options,
+                                  true);
+            for (const auto& [res, type] : resources)
+                restoredResources.append(res);
+            ++restored;
+        } catch (const std::exception& e) {
+            qWarning() << "[DRLS] Journaled job" << kind << "could not be restored:" << e.what();
+
+            auto lock = std::lock_guard(journalMutex_);
+            unrestoredJournalEntries_.append(entry);
+        }
+    }
+
+    if (!restoredResources.isEmpty())
+        wakeWaitersOf(restoredResources);
+
+    // only the entries which timed out meanwhile are dropped from the journal
+    scheduleJournalFlush();
+
+    qDebug() << "[DRLS] Restored" << restored << "of" << entries.size() << "journaled jobs";
+    return restored;
+}
+
+void DelayedResourceLockService::scheduleJournalFlush() {
+    if (journalOpen_ && !journalFlushScheduled_.exchange(true))
+        QMetaObject::invokeMethod(this, [this] { flushJournal(); }, Qt::QueuedConnection);
+}
+
+void DelayedResourceLockService::flushJournal() {
+    journalFlushScheduled_ = false;
+
+    auto journalLock = std::lock_guard(journalMutex_);
+
+    // the unrestored entries arrived before everything queued since the restart
+    auto entries = unrestoredJournalEntries_;
+    {
+        auto lock = std::lock_guard(asyncLocksMutex_);
+
+        // the queue is ordered by arrival already
+        for (const auto& [sequence, asyncLock] : asyncLocks_) {
+            if (!asyncLock->durable_)
+                continue;
+
+            QJsonArray resources;
+            for (const auto& [res, type] : asyncLock->resources_) {
+                QJsonObject resource;
+                resource["entityType"] = static_cast<int>(res.entityType());
+                resource["id"]         = res.targetId;
+                resource["lockType"]   = type == ResourceLockType::Read ? "Read" : "Write";
+                resources.append(resource);
+            }
+
+            QJsonObject entry;
+            entry["kind"]        = asyncLock->durable_->kind;
+            entry["payload"]     = asyncLock->durable_->payload;
+            entry["tag"]         = std::get<QString>(asyncLock->contextOrTag_);
+            entry["resources"]   = resources;
+            entry["deadline"]    = asyncLock->deadline_.toString(Qt::ISODateWithMs);
+            entry["priority"]    = asyncLock->priority_;
+            entry["coalesceKey"] = asyncLock->coalesceKey_;
+            entry["renewLease"]  = asyncLock->renewLease_;
+            entries.append(entry);
+        }
+    }
+
+    QJsonObject journal;
+    journal["version"] = 1;
+    journal["entries"] = entries;
+
+    // written aside and renamed, a crash leaves either the old or the new journal
+    QSaveFile file(journalPath_);
+    if (!file.open(QIODevice::WriteOnly) ||
+        file.write(QJsonDocument(journal).toJson(QJsonDocument::Compact)) < 0 || !file.commit())
+        qWarning() << "[DRLS] Journal could not be written to" << journalPath_;
+}
+
+bool DelayedResourceLockService::isAdmissionRejection(AsyncTaskPtr task) {
+    auto exception = task->getStoredException();
+    try {
+        if (exception != nullptr)
+            std::rethrow_exception(exception);
+    } catch (const AdmissionRejected&) {
+        return true;
+    } catch (...) {
+    }
+
+    return false;
 }
 
 QString DelayedResourceLockService::logOnFailure(AsyncTaskPtr task) {
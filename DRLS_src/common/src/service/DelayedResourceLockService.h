@@ -1,17 +1,68 @@
 #pragma once
 
+#include <limits>
+#include <set>
 #include <variant>
 
 #include "interface/IDelayedResourceLockService.h"
+#include "interface/IQueuedDemandRegistry.h"
 #include "interface/IResourceLockService.h"
 #include "AsyncTaskService.h"
 #include "common/src/TaskManager.h"
+#include "common/src/Clock.h"
+
+#include "utils/Histogram.h"
 
 namespace test {
 class DelayedResourceLockServiceTest;
 }
 namespace common {
 
+// Capacity of the queue of DelayedResourceLockService. A request for resources that are
+// available right away never counts against it.
+struct DelayedLockQueueLimits {
+    enum class OverflowPolicy {
+        // the new request is not queued
+        Reject,
+        // the longest waiting request of the full owner, or of the whole queue, makes room
+        DropOldest,
+        // the new request replaces the newest queued one of the same owner for the same
+        // resources and inherits its place, it is rejected if there is none
+        Coalesce
+    };
+
+    // zero or negative means unlimited
+    int maxQueued = 0;
+    // requests queued by one system lock tag or one caller token
+    int maxQueuedPerOwner = 0;
+    OverflowPolicy policy = OverflowPolicy::Reject;
+};
+
+struct DelayedLockStatistics {
+    // queued requests by the entity types of their resources, a request spanning several types
+    // counts for each of them
+    QMap<db::EntityType, int> queueDepth;
+    int queued          = 0;
+    qint64 oldestWaitMs = 0;
+
+    quint64 grantedImmediately = 0;
+    quint64 grantedFromQueue   = 0;
+    quint64 timedOut           = 0;
+    quint64 cancelled          = 0;
+    quint64 failed             = 0;
+    quint64 rejected           = 0;
+    quint64 dropped            = 0;
+    quint64 coalesced          = 0;
+    // share of the requests that timed out instead of being granted
+    double deadlineMissRate = 0;
+
+    // from adding a request until its task got dispatched, measured on the service's clock
+    util::Histogram timeToGrantMs;
+    util::Histogram timeToTimeoutMs;
+    // unsuccessful attempts of the queue to acquire the resources of a request it granted
+    util::Histogram retriesPerGrant;
+};
+
 class DelayedResourceLockService
     : public QObject
     , public common::IDelayedResourceLockService
@@ -26,33 +77,157 @@ public:
 private:
     DelayedResourceLockService(
             std::shared_ptr<IResourceLockService> resourceLockService,
-            std::shared_ptr<common::AsyncTaskService> asyncTaskService);
+            std::shared_ptr<common::AsyncTaskService> asyncTaskService,
+            std::shared_ptr<common::IClock> clock);
 
 public:
-    void addAsyncLock(CallerContext context,
-                      std::map<LockableResource, ResourceLockType> resources,
-                      AsyncTaskPtr task,
-                      int timeoutMs,
-                      AsyncTaskPtr timeoutTask = nullptr) override;
-
-    void addAsyncSystemLock(QString tag,
-                            std::map<LockableResource, ResourceLockType> resources,
-                            AsyncTaskPtr task,
-                            int timeoutMs,
-                            AsyncTaskPtr timeoutTask = nullptr) override;
+    AsyncLockHandlePtr addAsyncLock(CallerContext context,
+                                    std::map<LockableResource, ResourceLockType> resources,
+                                    AsyncTaskPtr task,
+                                    int timeoutMs,
+                                    AsyncTaskPtr timeoutTask = nullptr,
+                                    AsyncLockOptions options = {}) override;
+
+    AsyncLockHandlePtr addAsyncSystemLock(QString tag,
+                                          std::map<LockableResource, ResourceLockType> resources,
+                                          AsyncTaskPtr task,
+                                          int timeoutMs,
+                                          AsyncTaskPtr timeoutTask = nullptr,
+                                          AsyncLockOptions options = {}) override;
+
+    AsyncLockHandlePtr addAsyncLockPipeline(
+            CallerContext context,
+            std::map<LockableResource, ResourceLockType> resources,
+            QList<AsyncTaskPtr> steps,
+            int timeoutMs,
+            AsyncTaskPtr timeoutTask = nullptr,
+            AsyncLockOptions options = {}) override;
+
+    AsyncLockHandlePtr addAsyncSystemLockPipeline(
+            QString tag,
+            std::map<LockableResource, ResourceLockType> resources,
+            QList<AsyncTaskPtr> steps,
+            int timeoutMs,
+            AsyncTaskPtr timeoutTask = nullptr,
+            AsyncLockOptions options = {}) override;
+
+    // Queue timeouts are measured on this clock, the real clock is used by default. Queued
+    // requests keep their remaining timeouts and waiting times on the new clock. A lease
+    // renewal already pending for a running task still fires on the previous clock, the
+    // renewals after it use the new one.
+    void setClock(std::shared_ptr<common::IClock> clock);
+    std::shared_ptr<common::IClock> getClock();
+
+    // order in which queued waiters of the same resources get them
+    enum class FairnessPolicy {
+        // higher priority first, waiting raises the priority gradually, then arrival order
+        PriorityWithAging,
+        // arrival order, priorities are ignored
+        FifoPerResource,
+        // waiters for a write lock before readers, arrival order within both groups
+        WriterPreferring,
+        // the waiter timing out first, then arrival order
+        EarliestDeadlineFirst
+    };
+
+    // new addAsyncLock() callers queue up behind conflicting waiters ranking before them too,
+    // so a stream of readers cannot starve a writer; direct acquires of the lock service fail
+    // on those waiters, they rank after every waiter except under PriorityWithAging and for
+    // writers overtaking readers under WriterPreferring
+    void setFairnessPolicy(FairnessPolicy policy);
+    FairnessPolicy getFairnessPolicy();
+
+    // how long the longest waiting queued lock has been waiting, 0 if nobody waits
+    qint64 getOldestWaitMs();
+
+    // counters and histograms are cumulative since the service has been created
+    DelayedLockStatistics getStatistics();
+
+    void setQueueLimits(DelayedLockQueueLimits limits);
+    DelayedLockQueueLimits getQueueLimits();
+
+    // builds the task of a durable job from its journaled payload
+    using JobFactory = std::function<AsyncTaskPtr(const QJsonObject& payload)>;
+
+    void registerJobKind(const QString& kind, JobFactory factory);
+
+    // Queued durable jobs are journaled to path from now on. The jobs of an existing journal
+    // are queued again in their original order with their remaining timeouts, so their kinds
+    // have to be registered before. They do not try the lock service when they are queued,
+    // a single wakeup grants them afterwards like any other waiter. Entries which cannot be
+    // restored stay in the journal.
+    // A job leaves the journal once its locks are granted: if the service stops before the
+    // journal has been rewritten the job runs again, if it stops while the job runs it is lost.
+    // Returns the number of restored jobs.
+    int openJournal(const QString& path);
+
+    // like addAsyncSystemLock() with the task built by the factory of kind, the request
+    // survives a restart while it waits in the queue
+    AsyncLockHandlePtr addDurableSystemLock(QString tag,
+                                            std::map<LockableResource, ResourceLockType> resources,
+                                            QString kind,
+                                            QJsonObject payload,
+                                            int timeoutMs,
+                                            AsyncLockOptions options = {});
 
 signals:
     void lastTaskEnded();
 
 private slots:
+    // tries the waiters of the resources released since the last scan
     void onLocksChanged();
 
 private:
+    struct AsyncLock;
+
+    struct DurableJob {
+        QString kind;
+        QJsonObject payload;
+    };
+
+    class AsyncLockHandle : public IAsyncLockHandle {
+    public:
+        AsyncLockHandle(DelayedResourceLockService* service, std::weak_ptr<AsyncLock> asyncLock);
+
+        AsyncLockStatus getStatus() const override;
+        bool cancel() override;
+        bool setPriority(AsyncTask::Priority priority) override;
+
+        // the request leaves the queue with status, fails if it has left it already, so a grant,
+        // a timeout and a cancellation racing each other are settled by the first one
+        bool finish(AsyncLockStatus status);
+        bool setQueued();
+
+    private:
+        DelayedResourceLockService* service_;
+        std::weak_ptr<AsyncLock> asyncLock_;
+        std::atomic<AsyncLockStatus> status_ = AsyncLockStatus::Pending;
+    };
+
     struct AsyncLock {
         std::variant<common::CallerContext, QString> contextOrTag_;
         std::map<common::LockableResource, common::ResourceLockType> resources_;
         AsyncTaskPtr task_;
-        std::unique_ptr<QObject> guard_ = std::make_unique<QObject>();
+        AsyncTaskPtr timeoutTask_;
+        QString coalesceKey_;
+        bool renewLease_ = false;
+        std::optional<DurableJob> durable_;
+        // set while the granted task runs
+        std::atomic_bool holdingLease_ = false;
+        // set once the owner's admission has been charged, the queue's retries are not charged
+        std::atomic_bool admitted_ = false;
+
+        quint64 sequence_ = 0;
+        QString demandId_;
+        int priority_ = 0;
+        int effectivePriority_ = 0;
+        bool writer_           = false;
+        int attempts_          = 0;
+        std::shared_ptr<AsyncLockHandle> handle_;
+        QDateTime enqueued_;
+        QDateTime deadline_;
+        // cleared when the waiter leaves the queue, guarded by deadlinesMutex_
+        std::function<void()> onTimeout_;
 
         AsyncLock(common::CallerContext context,
                   std::map<common::LockableResource, common::ResourceLockType> resources,
@@ -72,24 +247,141 @@ private:
     };
 
 private:
-    void manageAddedAsyncLock(std::variant<common::CallerContext, QString> contextOrTag,
-                              std::map<LockableResource, ResourceLockType> resources,
-                              AsyncTaskPtr task,
-                              int timeoutMs,
-                              AsyncTaskPtr timeoutTask);
+    AsyncLockHandlePtr manageAddedAsyncLock(
+            std::variant<common::CallerContext, QString> contextOrTag,
+            std::map<LockableResource, ResourceLockType> resources,
+            AsyncTaskPtr task,
+            int timeoutMs,
+            AsyncTaskPtr timeoutTask,
+            AsyncLockOptions options,
+            std::optional<DurableJob> durable = std::nullopt,
+            bool restoring                    = false);
+    // a restoring job is queued without trying the lock service and without waking the
+    // waiters of its resources, the journal wakes them once all its jobs are queued
+    AsyncLockHandlePtr manageAddedDurableJob(QString tag,
+                                             std::map<LockableResource, ResourceLockType> resources,
+                                             QString kind,
+                                             QJsonObject payload,
+                                             int timeoutMs,
+                                             AsyncLockOptions options,
+                                             bool restoring);
     QString logOnFailure(AsyncTaskPtr task);
+    static bool isAdmissionRejection(AsyncTaskPtr task);
+
+    // the journal is written later on the service's thread, so callers may hold any mutex
+    void scheduleJournalFlush();
+    void flushJournal();
+
+    // called by the handles
+    void withdraw(std::shared_ptr<AsyncLock> asyncLock);
+    bool reprioritize(std::shared_ptr<AsyncLock> asyncLock, AsyncTask::Priority priority);
+
+    void wakeWaitersOf(const QList<LockableResource>& resources);
+    // callers of these hold asyncLocksMutex_
+    void addWaiter(std::shared_ptr<AsyncLock> asyncLock);
+    void removeWaiter(std::shared_ptr<AsyncLock> asyncLock);
+    // asyncLock takes the place of the queued replaced
+    void replaceWaiter(std::shared_ptr<AsyncLock> replaced, std::shared_ptr<AsyncLock> asyncLock);
+    void indexWaiter(std::shared_ptr<AsyncLock> asyncLock);
+    void unindexWaiter(std::shared_ptr<AsyncLock> asyncLock);
+    // makes room for asyncLock by coalescing or according to the queue limits, the request
+    // leaving the queue is returned in evicted, false means asyncLock must not be queued
+    bool makeRoomFor(std::shared_ptr<AsyncLock> asyncLock,
+                     std::shared_ptr<AsyncLock>& evicted,
+                     AsyncLockStatus& evictedStatus);
+    // the task of a request leaving the queue without being granted is not going to run
+    void discard(std::shared_ptr<AsyncLock> asyncLock, AsyncLockStatus status);
+    static QString getOwner(const AsyncLock& asyncLock);
+    QList<std::shared_ptr<AsyncLock>> takeWaitersOfReleasedResources();
+
+    // one timer serves every queued deadline, it is armed for the earliest one
+    void scheduleTimeout(std::shared_ptr<AsyncLock> asyncLock,
+                         QDateTime deadline,
+                         std::shared_ptr<IClock> clock);
+    void armDeadlineTimer(std::shared_ptr<IClock> clock);
+    void onDeadlineTimer(quint64 generation, std::shared_ptr<IClock> clock);
+
+    // whether a ranks before b under the fairness policy
+    bool isAhead(const AsyncLock& a, const AsyncLock& b, const QDateTime& now) const;
+    // a waiter ranking before asyncLock needs one of its resources in a conflicting mode,
+    // callers hold asyncLocksMutex_
+    bool hasConflictingWaiterAhead(const AsyncLock& asyncLock, const QDateTime& now) const;
+
+    // renews the locks of asyncLock periodically until its task ends
+    void scheduleLeaseRenewal(std::shared_ptr<AsyncLock> asyncLock,
+                              std::shared_ptr<IClock> clock);
+    // dispatches the task of a granted request, its locks are released when it ends
+    void runGranted(std::shared_ptr<AsyncLock> asyncLock,
+                    std::function<void()> release,
+                    std::shared_ptr<IClock> clock);
+
+    void recordGrant(const AsyncLock& asyncLock, bool fromQueue, const QDateTime& now);
+    void recordTimeout(const QDateTime& enqueued, const QDateTime& now);
+
+    // base priority raised by one for every AgingIntervalMs spent in the queue, up to High
+    static int getEffectivePriority(const AsyncLock& asyncLock, const QDateTime& now);
+
+    // demands rank against direct acquires by the fairness policy, see setFairnessPolicy();
+    // under PriorityWithAging by the base priority, aging only orders the queue, otherwise
+    // long waiters would fail every direct acquire of the interactive callers
+    void setQueuedDemand(const AsyncLock& asyncLock);
+    void clearQueuedDemand(const AsyncLock& asyncLock);
 
 private:
     std::shared_ptr<common::IResourceLockService> resourceLockService_;
+    // null if the lock service does not take queued demands into account
+    std::shared_ptr<common::IQueuedDemandRegistry> queuedDemandRegistry_;
     std::shared_ptr<common::AsyncTaskService> asyncTaskService_;
+    std::shared_ptr<common::IClock> clock_;
 
-    QList<std::shared_ptr<AsyncLock>> asyncLocks_;
+    // waiters in arrival order, keyed by their sequence so that leaving the queue is no scan
+    using Waiters = std::map<quint64, std::shared_ptr<AsyncLock>>;
+    Waiters asyncLocks_;
+    // waiters by the resources they need, type-level waiters are filed under the id -1
+    std::map<LockableResource, Waiters> waitersByResource_;
+    FairnessPolicy fairnessPolicy_ = FairnessPolicy::PriorityWithAging;
+    std::map<db::EntityType, int> queueDepth_;
+    std::map<QString, int> queuedPerOwner_;
+    std::map<QString, std::shared_ptr<AsyncLock>> waitersByCoalesceKey_;
+    DelayedLockQueueLimits queueLimits_;
     std::mutex asyncLocksMutex_;
 
+    QList<LockableResource> releasedResources_;
+    std::mutex releasedResourcesMutex_;
+
+    // counters and histograms only, the queue state is added by getStatistics()
+    DelayedLockStatistics statistics_;
+    std::mutex statisticsMutex_;
+
+    struct Deadline {
+        QDateTime at;
+        std::weak_ptr<AsyncLock> asyncLock;
+
+        bool operator>(const Deadline& other) const { return at > other.at; }
+    };
+
+    // min-heap, granted waiters are not removed, their entries are skipped when they come up
+    std::vector<Deadline> deadlines_;
+    std::optional<QDateTime> armedDeadline_;
+    quint64 timerGeneration_ = 0;
+    std::mutex deadlinesMutex_;
+
+    std::map<QString, JobFactory> jobFactories_;
+    QString journalPath_;
+    // journaled entries of unregistered kinds or failing factories, kept for a later restart
+    QJsonArray unrestoredJournalEntries_;
+    // guards the factories and the journal file, taken before asyncLocksMutex_
+    std::mutex journalMutex_;
+    std::atomic_bool journalOpen_           = false;
+    std::atomic_bool journalFlushScheduled_ = false;
+
     std::atomic_bool inProgress_      = false;
     std::atomic_bool hasMissedSignal_ = false;
 
 private:
+    static const int AgingIntervalMs;
+    static const int LeaseRenewalsPerLease;
+    static std::atomic<quint64> nextSequence_;
     static std::shared_ptr<DelayedResourceLockService> instance_;
 };
 
@@ -2,6 +2,7 @@
 
 #include "utils/Finally.h"
 
+#include "common/src/LockAuditLog.h"
 
 #include "persistence/Administrator.h"
 #include "persistence/User.h"
@@ -42,26 +43,430 @@ bool ResourceLockService::ResourceLock::operator<(const ResourceLock& other) con
 
 const int ResourceLockService::SecondsToLive = 120;
 
+const int ResourceLockService::DefaultLockEscalationThreshold = 100;
+
+const int ResourceLockService::LeaseWarningSeconds = 30;
+
+const int ResourceLockService::MaxLockChangeLogSize = 4096;
+
 std::shared_ptr<ResourceLockService> ResourceLockService::instance_;
 
 std::shared_ptr<ResourceLockService> ResourceLockService::getInstance() {
     if (instance_ == nullptr)
         instance_ = std::shared_ptr<ResourceLockService>(
             new ResourceLockService(common::EntityService::getInstance(),
-                                    common::AsyncTaskService::getInstance()));
+                                    common::AsyncTaskService::getInstance(),
+                                    common::RealClock::getInstance()));
 
     return instance_;
 }
 
 ResourceLockService::ResourceLockService(
         std::shared_ptr<EntityService> entityService,
-        std::shared_ptr<common::AsyncTaskService> asyncTaskService)
+        std::shared_ptr<common::AsyncTaskService> asyncTaskService,
+        std::shared_ptr<common::IClock> clock)
     : entityService_(entityService)
     , asyncTaskService_(asyncTaskService)
+    , clock_(clock)
+    , escalationThreshold_(DefaultLockEscalationThreshold)
+    , admission_(clock)
 {
+    qRegisterMetaType<QList<common::LockableResource>>("QList<common::LockableResource>");
+
     connectToChangedSignal();
 }
 
+void ResourceLockService::setClock(std::shared_ptr<common::IClock> clock) {
+    if (clock == nullptr)
+        throw std::invalid_argument("Clock is not specified.");
+
+    {
+        std::lock_guard<std::recursive_mutex> guard(lockMutex_);
+
+        // the clocks may start at different times, the leases keep their remaining time
+        auto shiftMs = clock_->now().msecsTo(clock->now());
+        clock_       = clock;
+        for (auto& [adminId, lockList] : locksByAdmins_) {
+            for (auto& lock : lockList) {
+                lock.acquired         = lock.acquired.addMSecs(shiftMs);
+                lock.timeout          = lock.timeout.addMSecs(shiftMs);
+                lock.announcedTimeout = lock.announcedTimeout.addMSecs(shiftMs);
+                for (auto& rowTimeout : lock.escalatedRows)
+                    rowTimeout = rowTimeout.addMSecs(shiftMs);
+            }
+        }
+
+        // the watch pending on the old clock is dropped
+        ++leaseWatchGeneration_;
+        leaseWatchDue_.reset();
+        scheduleLeaseWatch();
+    }
+    admission_.setClock(clock);
+}
+
+std::shared_ptr<IClock> ResourceLockService::getClock() const {
+    std::lock_guard<std::recursive_mutex> guard(lockMutex_);
+    return clock_;
+}
+
+void ResourceLockService::setLockEscalationThreshold(int threshold) {
+    std::lock_guard<std::recursive_mutex> guard(lockMutex_);
+    escalationThreshold_ = threshold;
+}
+
+int ResourceLockService::getLockEscalationThreshold() const {
+    std::lock_guard<std::recursive_mutex> guard(lockMutex_);
+    return escalationThreshold_;
+}
+
+void ResourceLockService::setAdmissionLimits(AdmissionLimits limits) {
+    admission_.setLimits(limits);
+}
+
+AdmissionLimits ResourceLockService::getAdmissionLimits() const {
+    return admission_.getLimits();
+}
+
+AdmissionStatistics ResourceLockService::getAdmissionStatistics() const {
+    return admission_.getStatistics();
+}
+
+// rejections are only counted in the admission statistics, logging each of them would flood the
+// log from the very client that is misbehaving
+void ResourceLockService::admit(const CallerContext& context) {
+    auto result = admission_.tryAdmit(context.token);
+    if (result != AdmissionControl::Result::Admitted)
+        throw AdmissionRejected(result);
+}
+
+void ResourceLockService::setQueuedDemand(
+        QString demandId,
+        std::map<common::LockableResource, common::ResourceLockType> resources,
+        int priority)
+{
+    bool writer = std::any_of(resources.begin(), resources.end(), [](const auto& entry) {
+        return entry.second == common::ResourceLockType::Write;
+    });
+
+    std::lock_guard<std::recursive_mutex> guard(lockMutex_);
+    queuedDemands_[demandId] = {resources, priority, writer};
+}
+
+void ResourceLockService::clearQueuedDemand(QString demandId) {
+    QList<common::LockableResource> releasedResources;
+    {
+        std::lock_guard<std::recursive_mutex> guard(lockMutex_);
+        auto it = queuedDemands_.find(demandId);
+        if (it == queuedDemands_.end())
+            return;
+
+        for (const auto& [res, type] : it->second.resources)
+            releasedResources.append(res);
+        queuedDemands_.erase(it);
+    }
+
+    // waiters held back only by this demand may proceed now
+    emit meta()->resourcesReleased(releasedResources);
+}
+
+int ResourceLockService::getLeaseDuration() const {
+    return SecondsToLive;
+}
+
+void ResourceLockService::setQueuedDemandOrder(QueuedDemandOrder order) {
+    std::lock_guard<std::recursive_mutex> guard(lockMutex_);
+    queuedDemandOrder_ = order;
+}
+
+AsyncFuncPtr<LockSnapshot> ResourceLockService::getLockSnapshot(
+        db::EntityType entityType,
+        std::optional<quint64> sinceVersion)
+{
+    return asyncTaskService_->createFunction<LockSnapshot>(
+            [this, entityType, sinceVersion](AsyncFuncPtr<LockSnapshot> f) {
+                std::lock_guard<std::recursive_mutex> guard(lockMutex_);
+
+                auto typeName = db::entityTypeToString(entityType);
+                auto now      = clock_->now();
+
+                LockSnapshot snapshot;
+                snapshot.version = lockVersion_;
+
+                // a delta is possible only if the log still holds every change after sinceVersion
+                bool hasChangesSince =
+                        sinceVersion && *sinceVersion <= lockVersion_ &&
+                        (lockChangeLog_.empty()
+                                 ? *sinceVersion == lockVersion_
+                                 : lockChangeLog_.front().version <= *sinceVersion + 1);
+
+                std::optional<QSet<int>> changedIds;
+                if (hasChangesSince) {
+                    changedIds = QSet<int>();
+                    for (auto it = lockChangeLog_.rbegin();
+                         it != lockChangeLog_.rend() && it->version > *sinceVersion;
+                         ++it) {
+                        if (getResourceTypeName(it->resource) != typeName)
+                            continue;
+
+                        // type-level changes affect every row, send everything
+                        int id = getResourceId(it->resource);
+                        if (id < 0) {
+                            changedIds = std::nullopt;
+                            break;
+                        }
+
+                        changedIds->insert(id);
+                    }
+                }
+                snapshot.isDelta = changedIds.has_value();
+
+                auto addEntry = [&snapshot, &changedIds](const ResourceLock& lock,
+                                                         int id,
+                                                         quint16 owner) {
+                    if (changedIds && !changedIds->contains(id))
+                        return;
+
+                    LockSnapshotEntry entry;
+                    entry.expiresAtMs = lock.timeout.toMSecsSinceEpoch();
+                    entry.id          = id;
+                    entry.owner       = owner;
+                    entry.mode        = static_cast<quint8>(lock.type);
+                    entry.flags       = LockSnapshotEntry::None;
+                    snapshot.entries.append(entry);
+                };
+
+                QSet<int> lockedIds;
+                for (const auto& [adminId, lockList] : locksByAdmins_) {
+                    for (const auto& lock : lockList) {
+                        if (lock.timeout < now || getResourceTypeName(lock.resource) != typeName)
+                            continue;
+
+                        auto owner = getOwnerHandle(adminId);
+                        if (!lock.escalatedRows.isEmpty()) {
+                            for (int id : lock.escalatedRows.keys()) {
+                                auto rowLock = getEscalatedRowLock(lock, id);
+                                if (rowLock.timeout < now)
+                                    continue;
+
+                                addEntry(rowLock, id, owner);
+                                lockedIds.insert(id);
+                            }
+                        } else {
+                            int id = getResourceId(lock.resource);
+                            addEntry(lock, id, owner);
+                            lockedIds.insert(id);
+                        }
+                    }
+                }
+
+                if (changedIds) {
+                    for (int id : changedIds.value()) {
+                        if (lockedIds.contains(id))
+                            continue;
+
+                        LockSnapshotEntry entry;
+                        entry.expiresAtMs = 0;
+                        entry.id          = id;
+                        entry.owner       = 0;
+                        entry.mode        = 0;
+                        entry.flags       = LockSnapshotEntry::Removed;
+                        snapshot.entries.append(entry);
+                    }
+                }
+
+                snapshot.owners = ownerNames_;
+                f->setResult(snapshot);
+            });
+}
+
+AsyncTaskPtr ResourceLockService::listenLeaseEvents(
+        util::Callback<void(QList<LeaseEvent>)> callback)
+{
+    return asyncTaskService_->createTask([this, callback](AsyncTaskPtr f) {
+        if (callback == nullptr)
+            throw std::invalid_argument("Callback is not specified.");
+
+        std::lock_guard<std::recursive_mutex> guard(lockMutex_);
+        leaseEventCallbacks_.insert(callback.getToken(), callback);
+    });
+}
+
+AsyncTaskPtr ResourceLockService::stopListenLeaseEvents(QString token) {
+    return asyncTaskService_->createTask([this, token](AsyncTaskPtr f) {
+        std::lock_guard<std::recursive_mutex> guard(lockMutex_);
+        leaseEventCallbacks_.remove(token);
+    });
+}
+
+AsyncTaskPtr ResourceLockService::forceReleaseLocks(
+        std::map<common::LockableResource, common::ResourceLockType> resources)
+{
+    return asyncTaskService_->createTask([this, resources](AsyncTaskPtr f) {
+        QList<QPair<std::optional<ResourceLock>, std::optional<ResourceLock>>> changedLocks;
+        {
+            std::lock_guard<std::recursive_mutex> guard(lockMutex_);
+
+            // every lock on the resource that conflicts with the given type is taken away,
+            // an id of -1 stands for all locks of the EntityType
+            for (const auto& [res, type] : resources) {
+                auto typeName = db::entityTypeToString(res.entityType());
+
+                for (auto& [adminId, lockList] : locksByAdmins_) {
+                    for (int i = 0; i < lockList.length(); i++) {
+                        const auto& lock = lockList.at(i);
+                        bool covered =
+                                checkIfLockIsValid(lock, res) ||
+                                (res.targetId < 0 &&
+                                 getResourceTypeName(lock.resource) == typeName);
+                        if (!covered || compatible(lock.type, type))
+                            continue;
+
+                        auditLockEvent(LockAuditEventKind::Release, lock);
+                        queueLeaseEvent(LeaseEventKind::Revoked, lock);
+                        changedLocks.append({lock, std::nullopt});
+                        lockList.removeAt(i);
+                        i--;
+                    }
+                }
+            }
+        }
+
+        dispatchLeaseEvents();
+        if (changedLocks.size() > 0)
+            emit locksChanged(changedLocks);
+
+        emit meta()->locksChanged();
+    });
+}
+
+void ResourceLockService::scheduleLeaseWatch() {
+    // the next lease event is a warning or an expiry, without locks nothing is watched
+    std::optional<QDateTime> due;
+    for (const auto& [adminId, lockList] : locksByAdmins_) {
+        for (const auto& lock : lockList) {
+            auto event = lock.announcedTimeout != lock.timeout
+                                 ? lock.timeout.addSecs(-LeaseWarningSeconds)
+                                 : lock.timeout.addMSecs(1);
+            // a row of an escalated lock may expire before the lock
+            for (const auto& rowTimeout : lock.escalatedRows)
+                event = qMin(event, rowTimeout.addMSecs(1));
+            if (!due || event < due.value())
+                due = event;
+        }
+    }
+
+    if (due)
+        armLeaseWatch(due.value());
+}
+
+void ResourceLockService::armLeaseWatch(const QDateTime& due) {
+    if (leaseWatchDue_ && leaseWatchDue_.value() <= due)
+        return;
+
+    leaseWatchDue_  = due;
+    auto generation = ++leaseWatchGeneration_;
+    auto delayMs    = qBound<qint64>(
+            0, clock_->now().msecsTo(due), std::numeric_limits<int>::max());
+
+    clock_->singleShot(static_cast<int>(delayMs), leaseWatchGuard_.get(), [this, generation] {
+        {
+            // an earlier watch or another clock has replaced this one meanwhile
+            std::lock_guard<std::recursive_mutex> guard(lockMutex_);
+            if (generation != leaseWatchGeneration_)
+                return;
+
+            leaseWatchDue_.reset();
+        }
+
+        asyncTaskService_->createTask([this](AsyncTaskPtr) { watchLeases(); })->runUnmanaged();
+    });
+}
+
+void ResourceLockService::watchLeases() {
+    QList<QPair<std::optional<ResourceLock>, std::optional<ResourceLock>>> changedLocks;
+    {
+        std::lock_guard<std::recursive_mutex> guard(lockMutex_);
+        auto now = clock_->now();
+
+        for (auto& [adminId, lockList] : locksByAdmins_) {
+            for (int i = 0; i < lockList.length(); i++) {
+                auto& lock = lockList[i];
+                if (lock.timeout < now) {
+                    auditLockEvent(LockAuditEventKind::Expire, lock);
+                    queueLeaseEvent(LeaseEventKind::Expired, lock);
+                    changedLocks.append({lock, std::nullopt});
+                    lockList.removeAt(i);
+                    i--;
+                    continue;
+                }
+
+                if (lock.announcedTimeout != lock.timeout &&
+                    now.secsTo(lock.timeout) <= LeaseWarningSeconds) {
+                    // a renewal moves the timeout, so the owner is warned again next time
+                    lock.announcedTimeout = lock.timeout;
+                    queueLeaseEvent(LeaseEventKind::AboutToExpire, lock);
+                }
+
+                // rows not renewed leave the escalated lock, which lasts for the others
+                for (int id : lock.escalatedRows.keys()) {
+                    if (lock.escalatedRows.value(id) >= now)
+                        continue;
+
+                    auto rowLock = getEscalatedRowLock(lock, id);
+                    lock.escalatedRows.remove(id);
+                    auditLockEvent(LockAuditEventKind::Expire, rowLock);
+                    queueLeaseEvent(LeaseEventKind::Expired, rowLock);
+                    recordLockChange(rowLock.resource);
+                }
+            }
+        }
+
+        scheduleLeaseWatch();
+    }
+
+    dispatchLeaseEvents();
+    if (changedLocks.size() > 0) {
+        emit locksChanged(changedLocks);
+        emit meta()->locksChanged();
+    }
+}
+
+void ResourceLockService::queueLeaseEvent(LeaseEventKind kind, const ResourceLock& lock) {
+    std::lock_guard<std::recursive_mutex> guard(lockMutex_);
+
+    auto owner = lock.adminId == -1 ? lock.tag : lock.adminToken;
+    if (!leaseEventCallbacks_.contains(owner))
+        return;
+
+    LeaseEvent event;
+    event.kind     = kind;
+    event.resource = getResource(lock.resource);
+    event.type     = lock.type;
+    event.timeout  = lock.timeout;
+    pendingLeaseEvents_.append({owner, event});
+}
+
+void ResourceLockService::dispatchLeaseEvents() {
+    QMap<QString, QList<LeaseEvent>> eventsByOwner;
+    QMultiMap<QString, util::Callback<void(QList<LeaseEvent>)>> callbacks;
+    {
+        std::lock_guard<std::recursive_mutex> guard(lockMutex_);
+        if (pendingLeaseEvents_.isEmpty())
+            return;
+
+        for (const auto& ownerAndEvent : pendingLeaseEvents_)
+            eventsByOwner[ownerAndEvent.first].append(ownerAndEvent.second);
+
+        pendingLeaseEvents_.clear();
+        callbacks = leaseEventCallbacks_;
+    }
+
+    for (auto it = eventsByOwner.begin(); it != eventsByOwner.end(); ++it) {
+        for (const auto& callback : callbacks.values(it.key()))
+            callback(it.value());
+    }
+}
+
 AsyncTaskPtr ResourceLockService::listenLocksChanged(QString token,
                                                      util::Callback<void()> callback,
                                                      QList<db::EntityType> filter,
@@ -122,6 +527,27 @@ AsyncTaskPtr ResourceLockService::stopListenLocksChanged(util::Callback<void()>
 }
 
 void ResourceLockService::connectToChangedSignal() {
+    connect(this,
+            &ResourceLockService::locksChanged,
+            [this](QList<QPair<std::optional<ResourceLock>, std::optional<ResourceLock>>>
+                           changedLocks) {
+                QList<common::LockableResource> releasedResources;
+                {
+                    std::lock_guard<std::recursive_mutex> guard(lockMutex_);
+                    for (const auto& data : changedLocks) {
+                        if (data.first != std::nullopt) {
+                            recordLockChange(data.first->resource);
+                            releasedResources.append(getResource(data.first->resource));
+                        }
+                        if (data.second != std::nullopt)
+                            recordLockChange(data.second->resource);
+                    }
+                }
+
+                if (!releasedResources.isEmpty())
+                    emit meta()->resourcesReleased(releasedResources);
+            });
+
     connect(this,
             &ResourceLockService::locksChanged,
             [this](QList<QPair<std::optional<ResourceLock>, std::optional<ResourceLock>>>
@@ -200,17 +626,27 @@ AsyncFuncPtr<bool> ResourceLockService::acquireLocks(
 {
     return asyncTaskService_->createFunction<bool>([this, resources, context]
                                                    (AsyncFuncPtr<bool> f) {
+        // a rejection must not look like a conflict, nothing would wake up its queued retry
+        if (!context.admitted)
+            admit(context);
+        auto finAdmission = util::finally([this, context] {
+            if (!context.admitted)
+                admission_.leave(context.token);
+        });
+
         QList<QPair<std::optional<ResourceLock>, std::optional<ResourceLock>>> changedLocks;
 
         auto fin = util::finally([this, &changedLocks] {
+            dispatchLeaseEvents();
             if (changedLocks.size() > 0)
                 emit locksChanged(changedLocks);
         });
 
         {
             std::lock_guard<std::recursive_mutex> guard(lockMutex_);
-            QDateTime now = QDateTime::currentDateTime();
+            QDateTime now = clock_->now();
 
+            std::optional<common::LockableResource> conflicting;
             auto resourcesToLock =
                     getResourcesToLock(resources,
                                        changedLocks,
@@ -225,9 +661,16 @@ AsyncFuncPtr<bool> ResourceLockService::acquireLocks(
                 return lockOwner != nullptr &&
                        lockOwner->getUsername() == context.username &&
                        lock.adminToken == context.token;
-            });
+            }, &conflicting);
+
+            if (!resourcesToLock ||
+                overtakesQueuedDemand(resourcesToLock.value(),
+                                      static_cast<int>(AsyncTask::getCurrentPriority()),
+                                      &conflicting)) {
+                auto res = conflicting.value();
+                auditLockEvent(
+                        LockAuditEventKind::Conflict, res, resources.at(res), 0, context.token);
 
-            if (!resourcesToLock) {
                 f->setResult(false);
                 return;
             }
@@ -248,10 +691,18 @@ AsyncFuncPtr<bool> ResourceLockService::acquireLocks(
                 lock.adminId    = admin->getId();
                 lock.adminToken = context.token;
                 locksByAdmins_[admin->getId()].append(lock);
+                auditLockEvent(LockAuditEventKind::Acquire, lock);
 
                 changedLocks.append({std::nullopt, lock});
             }
 
+            escalateLocksIfPossible(admin->getId(),
+                                    [context](const ResourceLock& lock) {
+                                        return lock.adminToken == context.token;
+                                    },
+                                    now,
+                                    changedLocks);
+
             f->setResult(true);
         }
 
@@ -269,13 +720,14 @@ AsyncFuncPtr<bool> ResourceLockService::renewLocksIfPossible(
         QList<QPair<std::optional<ResourceLock>, std::optional<ResourceLock>>> changedLocks;
 
         auto fin = util::finally([this, &changedLocks] {
+            dispatchLeaseEvents();
             if (changedLocks.size() > 0)
                 emit locksChanged(changedLocks);
         });
 
         {
             std::lock_guard<std::recursive_mutex> guard(lockMutex_);
-            QDateTime now = QDateTime::currentDateTime();
+            QDateTime now = clock_->now();
 
             auto resourcesToLock = getResourcesToLock(
                     resources, changedLocks, now, [this, context](ResourceLock lock) -> bool {
@@ -321,9 +773,19 @@ AsyncTaskPtr ResourceLockService::releaseLocks(
                     if (lock.resource == resourceName && lock.type == type &&
                         lock.adminToken == context.token) {
                         locksByAdmins_[admin->getId()].removeOne(lock);
+                        auditLockEvent(LockAuditEventKind::Release, lock);
                         changedLocks.append({lock, std::nullopt});
                     }
                 }
+
+                // the row may be covered by an escalated lock instead of its own
+                releaseEscalatedLock(admin->getId(),
+                                     [context](const ResourceLock& lock) {
+                                         return lock.adminToken == context.token;
+                                     },
+                                     res,
+                                     type,
+                                     changedLocks);
             }
 
             //        qDebug() << "[LOCKS] Locks after releasing...";
@@ -346,20 +808,30 @@ AsyncFuncPtr<bool> ResourceLockService::acquireSystemLocks(
         QList<QPair<std::optional<ResourceLock>, std::optional<ResourceLock>>> changedLocks;
 
         auto fin = util::finally([this, &changedLocks] {
+            dispatchLeaseEvents();
             if (changedLocks.size() > 0)
                 emit locksChanged(changedLocks);
         });
 
         {
             std::lock_guard<std::recursive_mutex> guard(lockMutex_);
-            auto now = QDateTime::currentDateTime();
+            auto now = clock_->now();
 
-            auto resourcesToLock =
-                    getResourcesToLock(resources, changedLocks, now, [tag](auto lock) {
-                        return lock.tag == tag;
-                    });
+            std::optional<common::LockableResource> conflicting;
+            auto resourcesToLock = getResourcesToLock(
+                    resources,
+                    changedLocks,
+                    now,
+                    [tag](auto lock) { return lock.tag == tag; },
+                    &conflicting);
+
+            if (!resourcesToLock ||
+                overtakesQueuedDemand(resourcesToLock.value(),
+                                      static_cast<int>(AsyncTask::getCurrentPriority()),
+                                      &conflicting)) {
+                auto res = conflicting.value();
+                auditLockEvent(LockAuditEventKind::Conflict, res, resources.at(res), -1, tag);
 
-            if (!resourcesToLock) {
                 f->setResult(false);
                 return;
             }
@@ -378,8 +850,15 @@ AsyncFuncPtr<bool> ResourceLockService::acquireSystemLocks(
                 lock.adminToken = "";
                 lock.tag        = tag;
                 locksByAdmins_[-1].append(lock);
+                auditLockEvent(LockAuditEventKind::Acquire, lock);
+                recordLockChange(lock.resource);
             }
 
+            escalateLocksIfPossible(-1,
+                                    [tag](const ResourceLock& lock) { return lock.tag == tag; },
+                                    now,
+                                    changedLocks);
+
             f->setResult(true);
         }
 
@@ -387,6 +866,32 @@ AsyncFuncPtr<bool> ResourceLockService::acquireSystemLocks(
     });
 }
 
+AsyncFuncPtr<bool> ResourceLockService::renewSystemLocksIfPossible(
+        std::map<common::LockableResource, common::ResourceLockType> resources,
+        QString tag)
+{
+    return asyncTaskService_->createFunction<bool>([this,
+                                                    resources,
+                                                    tag](AsyncFuncPtr<bool> f) {
+        QList<QPair<std::optional<ResourceLock>, std::optional<ResourceLock>>> changedLocks;
+
+        auto fin = util::finally([this, &changedLocks] {
+            dispatchLeaseEvents();
+            if (changedLocks.size() > 0)
+                emit locksChanged(changedLocks);
+        });
+
+        std::lock_guard<std::recursive_mutex> guard(lockMutex_);
+        auto resourcesToLock =
+                getResourcesToLock(resources, changedLocks, clock_->now(), [tag](auto lock) {
+                    return lock.tag == tag;
+                });
+
+        // if we would need to lock something it is failed
+        f->setResult(resourcesToLock && resourcesToLock->size() == 0);
+    });
+}
+
 AsyncTaskPtr ResourceLockService::releaseSystemLocks(
         std::map<common::LockableResource, common::ResourceLockType> resources,
         QString tag)
@@ -394,6 +899,8 @@ AsyncTaskPtr ResourceLockService::releaseSystemLocks(
     return asyncTaskService_->createTask([this,
                                           resources,
                                           tag](AsyncTaskPtr f) {
+        QList<QPair<std::optional<ResourceLock>, std::optional<ResourceLock>>> changedLocks;
+        QList<common::LockableResource> releasedResources;
         {
             std::lock_guard<std::recursive_mutex> guard(lockMutex_);
 
@@ -401,11 +908,27 @@ AsyncTaskPtr ResourceLockService::releaseSystemLocks(
                 auto resourceName = getResourceName(res);
 
                 for (auto lock : locksByAdmins_[-1]) {
-                    if (lock.resource == resourceName && lock.type == type && lock.tag == tag)
+                    if (lock.resource == resourceName && lock.type == type && lock.tag == tag) {
                         locksByAdmins_[-1].removeOne(lock);
+                        auditLockEvent(LockAuditEventKind::Release, lock);
+                        recordLockChange(lock.resource);
+                        releasedResources.append(res);
+                    }
                 }
+
+                releaseEscalatedLock(-1,
+                                     [tag](const ResourceLock& lock) { return lock.tag == tag; },
+                                     res,
+                                     type,
+                                     changedLocks);
             }
         }
+        if (changedLocks.size() > 0)
+            emit locksChanged(changedLocks);
+
+        // system locks are not reported through locksChanged(changedLocks)
+        if (!releasedResources.isEmpty())
+            emit meta()->resourcesReleased(releasedResources);
 
         emit meta()->locksChanged();
     });
@@ -421,9 +944,16 @@ AsyncFuncPtr<std::map<int, QString>> ResourceLockService::getLocks(db::EntityTyp
                 QList<ResourceLock> locks;
                 for (const auto& [_, lockList] : locksByAdmins_) {
                     for (auto lock : lockList) {
-                        if (lock.type == common::ResourceLockType::Write &&
-                            lock.resource.contains(db::entityTypeToString(entityType) + "#"))
+                        if (lock.type != common::ResourceLockType::Write)
+                            continue;
+
+                        if (lock.resource.contains(db::entityTypeToString(entityType) + "#")) {
                             locks.append(lock);
+                        } else if (lock.resource == db::entityTypeToString(entityType) + "*") {
+                            // report escalated rows as if they were still locked one by one
+                            for (int id : lock.escalatedRows.keys())
+                                locks.append(getEscalatedRowLock(lock, id));
+                        }
                     }
                 }
 
@@ -449,32 +979,44 @@ AsyncFuncPtr<QSet<QPair<QString, QString>>> ResourceLockService::getConcurrentLo
                                             resources,
                                             context]
                                        (AsyncFuncPtr<QSet<QPair<QString, QString>>> f) {
-        std::lock_guard<std::recursive_mutex> guard(lockMutex_);
-
-        QDateTime now = QDateTime::currentDateTime();
         QSet<QPair<QString, QString>> admins;
+        QList<common::LockableResource> releasedResources;
+        // the lease events and the signal are delivered once lockMutex_ is released
+        auto fin = util::finally([this, &releasedResources] {
+            dispatchLeaseEvents();
+            if (!releasedResources.isEmpty())
+                emit meta()->resourcesReleased(releasedResources);
+        });
 
-        for (const auto& [res, type] : resources) {
-            auto existing = getConcurrentLocks(res, type);
-            for (const auto& [lock, _] : existing) {
-                // if lock is expired, remove it
-                if (lock.timeout < now) {
-                    locksByAdmins_[lock.adminId].removeOne(lock);
-                    continue;
-                }
-
-                // lock is compatible
-                if (existing[lock])
-                    continue;
+        {
+            std::lock_guard<std::recursive_mutex> guard(lockMutex_);
+            QDateTime now = clock_->now();
+            for (const auto& [res, type] : resources) {
+                auto existing = getConcurrentLocks(res, type);
+                for (const auto& [lock, _] : existing) {
+                    // if lock is expired, remove it
+                    if (lock.timeout < now) {
+                        locksByAdmins_[lock.adminId].removeOne(lock);
+                        auditLockEvent(LockAuditEventKind::Expire, lock);
+                        queueLeaseEvent(LeaseEventKind::Expired, lock);
+                        recordLockChange(lock.resource);
+                        releasedResources.append(getResource(lock.resource));
+                        continue;
+                    }
 
-                auto lockOwner = entityService_->getById<db::Administrator>(lock.adminId);
-                if (lock.adminToken != context.token) {
-                    if (lockOwner == nullptr) {
-                        auto systemName = QString{"[%1]"}.arg(
-                                QT_TRANSLATE_NOOP("ResourceLock", "System"));
-                        admins.insert({systemName, systemName});
-                    } else {
-                        admins.insert({lockOwner->getUsername(), lockOwner->getFullName()});
+                    // lock is compatible
+                    if (existing[lock])
+                        continue;
+
+                    auto lockOwner = entityService_->getById<db::Administrator>(lock.adminId);
+                    if (lock.adminToken != context.token) {
+                        if (lockOwner == nullptr) {
+                            auto systemName = QString{"[%1]"}.arg(
+                                    QT_TRANSLATE_NOOP("ResourceLock", "System"));
+                            admins.insert({systemName, systemName});
+                        } else {
+                            admins.insert({lockOwner->getUsername(), lockOwner->getFullName()});
+                        }
                     }
                 }
             }
@@ -498,6 +1040,59 @@ QString ResourceLockService::getResourceName(common::LockableResource resource)
     throw std::runtime_error("Unknown resource type");
 }
 
+QString ResourceLockService::getResourceTypeName(const QString& resourceName) {
+    int pos = resourceName.indexOf("#");
+    if (pos == -1)
+        pos = resourceName.indexOf("*");
+
+    return pos >= 0 ? resourceName.left(pos) : resourceName;
+}
+
+void ResourceLockService::recordLockChange(const QString& resource) {
+    ++lockVersion_;
+    lockChangeLog_.push_back({lockVersion_, resource});
+    if (lockChangeLog_.size() > MaxLockChangeLogSize)
+        lockChangeLog_.pop_front();
+
+    // a created or renewed lease is due for its warning first
+    armLeaseWatch(clock_->now().addSecs(SecondsToLive - LeaseWarningSeconds));
+}
+
+quint16 ResourceLockService::getOwnerHandle(int adminId) {
+    if (ownerNames_.isEmpty())
+        ownerNames_.append(QString{"[%1]"}.arg(QT_TRANSLATE_NOOP("ResourceLock", "System")));
+
+    if (adminId == -1)
+        return 0;
+
+    auto it = ownerHandles_.find(adminId);
+    if (it != ownerHandles_.end())
+        return it->second;
+
+    if (ownerNames_.size() > std::numeric_limits<quint16>::max())
+        throw std::runtime_error("Too many lock owners.");
+
+    auto admin = entityService_->getById<db::Administrator>(adminId);
+    ownerNames_.append(admin != nullptr ? admin->getUsername() : QString());
+
+    quint16 handle         = ownerNames_.size() - 1;
+    ownerHandles_[adminId] = handle;
+    return handle;
+}
+
+common::LockableResource ResourceLockService::getResource(const QString& resourceName) {
+    return common::LockableResource(db::stringToEntityType(getResourceTypeName(resourceName)),
+                                    getResourceId(resourceName));
+}
+
+int ResourceLockService::getResourceId(const QString& resourceName) {
+    int pos = resourceName.indexOf("#");
+    if (pos == -1)
+        return -1;
+
+    return resourceName.mid(pos + 1).toInt();
+}
+
 std::map<ResourceLockService::ResourceLock, bool> ResourceLockService::getConcurrentLocks(
         common::LockableResource resource,
         common::ResourceLockType lock) const
@@ -533,14 +1128,69 @@ bool ResourceLockService::checkIfLockIsValid(ResourceLockService::ResourceLock l
     return false;
 }
 
+ResourceLockService::ResourceLock ResourceLockService::getEscalatedRowLock(
+        const ResourceLock& escalated,
+        int id) const
+{
+    auto rowLock     = escalated;
+    rowLock.resource = getResourceTypeName(escalated.resource) + "#" + QString::number(id);
+    rowLock.timeout  = escalated.escalatedRows.value(id, escalated.timeout);
+    rowLock.escalatedRows.clear();
+    return rowLock;
+}
+
+bool ResourceLockService::overtakesQueuedDemand(
+        const std::map<common::LockableResource, common::ResourceLockType>& resources,
+        int priority,
+        std::optional<common::LockableResource>* conflicting) const
+{
+    bool writer = std::any_of(resources.begin(), resources.end(), [](const auto& entry) {
+        return entry.second == common::ResourceLockType::Write;
+    });
+
+    for (const auto& [demandId, demand] : queuedDemands_) {
+        bool ahead = true;
+        switch (queuedDemandOrder_) {
+        case QueuedDemandOrder::Priority:
+            ahead = demand.priority > priority;
+            break;
+        case QueuedDemandOrder::WritersFirst:
+            ahead = demand.writer || !writer;
+            break;
+        case QueuedDemandOrder::Arrival:
+            break;
+        }
+
+        if (!ahead)
+            continue;
+
+        for (const auto& [res, lockType] : resources) {
+            for (const auto& [demanded, demandedType] : demand.resources) {
+                bool sameResource = demanded.entityType() == res.entityType() &&
+                                    (demanded.targetId == res.targetId ||
+                                     demanded.targetId < 0 || res.targetId < 0);
+                if (sameResource && !compatible(demandedType, lockType)) {
+                    if (conflicting != nullptr)
+                        *conflicting = res;
+                    return true;
+                }
+            }
+        }
+    }
+
+    return false;
+}
+
 std::optional<std::map<common::LockableResource, common::ResourceLockType>>
 ResourceLockService::getResourcesToLock(
         const std::map<common::LockableResource, common::ResourceLockType>& resources,
         QList<QPair<std::optional<ResourceLock>, std::optional<ResourceLock>>>& changedLocks,
         const QDateTime& now,
-        std::function<bool(ResourceLock lock)> isLockOurs)
+        std::function<bool(ResourceLock lock)> isLockOurs,
+        std::optional<common::LockableResource>* conflicting)
 {
     QList<ResourceLock*> locksToRenew;
+    QList<QPair<ResourceLock*, int>> rowsToRenew;
     std::map<common::LockableResource, common::ResourceLockType> resourcesToLock;
 
     for (const auto& [res, lockType] : resources) {
@@ -552,13 +1202,20 @@ ResourceLockService::getResourcesToLock(
                     if (isLockOurs(lockList.at(i))) {
                         // if lock is ours and of the same type, just renew it
                         if (lockType == lockList.at(i).type) {
-                            locksToRenew.append(&(lockList[i]));
+                            // a row covered by our escalated lock joins it, or renews its own
+                            // timeout only, the other rows keep theirs
+                            if (!lockList.at(i).escalatedRows.isEmpty() && res.targetId >= 0)
+                                rowsToRenew.append({&(lockList[i]), res.targetId});
+                            else
+                                locksToRenew.append(&(lockList[i]));
                             hasLock = true;
                             continue;
                         }
                     } else {
                         // if lock is expired, remove it
                         if (lockList.at(i).timeout < now) {
+                            auditLockEvent(LockAuditEventKind::Expire, lockList.at(i));
+                            queueLeaseEvent(LeaseEventKind::Expired, lockList.at(i));
                             changedLocks.append({lockList.at(i), std::nullopt});
                             lockList.removeAt(i);
                             i--;
@@ -570,6 +1227,8 @@ ResourceLockService::getResourcesToLock(
                             continue;
 
                         // incompatible lock found, locking failed
+                        if (conflicting != nullptr)
+                            *conflicting = res;
                         return std::nullopt;
                     }
                 }
@@ -584,11 +1243,126 @@ ResourceLockService::getResourcesToLock(
     // renew if locking didn't failed
     for (auto lock : locksToRenew) {
         lock->timeout = now.addSecs(SecondsToLive);
+        auditLockEvent(LockAuditEventKind::Renew, *lock);
+        recordLockChange(lock->resource);
+    }
+
+    for (auto [lock, id] : rowsToRenew) {
+        lock->escalatedRows[id] = now.addSecs(SecondsToLive);
+        lock->timeout           = qMax(lock->timeout, lock->escalatedRows[id]);
+        auto rowLock            = getEscalatedRowLock(*lock, id);
+        auditLockEvent(LockAuditEventKind::Renew, rowLock);
+        recordLockChange(rowLock.resource);
     }
 
     return resourcesToLock;
 }
 
+void ResourceLockService::escalateLocksIfPossible(
+        int adminId,
+        std::function<bool(const ResourceLock& lock)> isLockOurs,
+        const QDateTime& now,
+        QList<QPair<std::optional<ResourceLock>, std::optional<ResourceLock>>>& changedLocks)
+{
+    if (escalationThreshold_ <= 0)
+        return;
+
+    auto& lockList = locksByAdmins_[adminId];
+
+    // our row locks grouped by EntityType and lock type
+    std::map<QPair<QString, common::ResourceLockType>, QList<ResourceLock>> rowLocks;
+    for (const auto& lock : lockList) {
+        if (isLockOurs(lock) && getResourceId(lock.resource) >= 0)
+            rowLocks[{getResourceTypeName(lock.resource), lock.type}].append(lock);
+    }
+
+    for (const auto& [key, locks] : rowLocks) {
+        const auto& [typeName, lockType] = key;
+        if (locks.count() <= escalationThreshold_)
+            continue;
+
+        // anyone else holding a conflicting lock on this EntityType prevents escalation
+        bool conflicts = false;
+        for (const auto& [otherAdminId, otherLockList] : locksByAdmins_) {
+            for (const auto& other : otherLockList) {
+                if ((otherAdminId == adminId && isLockOurs(other)) || other.timeout < now)
+                    continue;
+
+                if (getResourceTypeName(other.resource) == typeName &&
+                    !compatible(other.type, lockType)) {
+                    conflicts = true;
+                    break;
+                }
+            }
+
+            if (conflicts)
+                break;
+        }
+
+        if (conflicts)
+            continue;
+
+        auto escalated     = locks.first();
+        escalated.resource = typeName + "*";
+        escalated.acquired = now;
+        escalated.escalatedRows.clear();
+        for (const auto& lock : locks) {
+            escalated.timeout = qMax(escalated.timeout, lock.timeout);
+            escalated.escalatedRows.insert(getResourceId(lock.resource), lock.timeout);
+            lockList.removeOne(lock);
+            changedLocks.append({lock, std::nullopt});
+        }
+        lockList.append(escalated);
+        auditLockEvent(LockAuditEventKind::Escalate, escalated);
+
+        changedLocks.append({std::nullopt, escalated});
+    }
+}
+
+bool ResourceLockService::releaseEscalatedLock(
+        int adminId,
+        std::function<bool(const ResourceLock& lock)> isLockOurs,
+        common::LockableResource resource,
+        common::ResourceLockType type,
+        QList<QPair<std::optional<ResourceLock>, std::optional<ResourceLock>>>& changedLocks)
+{
+    if (resource.targetId < 0)
+        return false;
+
+    auto& lockList     = locksByAdmins_[adminId];
+    auto escalatedName = db::entityTypeToString(resource.targetSet) + "*";
+    for (int i = 0; i < lockList.length(); i++) {
+        auto& lock = lockList[i];
+        if (lock.resource != escalatedName || lock.type != type || !isLockOurs(lock) ||
+            !lock.escalatedRows.contains(resource.targetId))
+            continue;
+
+        lock.escalatedRows.remove(resource.targetId);
+
+        // de-escalate once the lock covers too few rows to be worth it
+        if (lock.escalatedRows.count() <= escalationThreshold_ / 2) {
+            auto escalated = lock;
+            lockList.removeAt(i);
+            auditLockEvent(LockAuditEventKind::Release, escalated);
+            changedLocks.append({escalated, std::nullopt});
+
+            // every row gets back its own timeout
+            for (int id : escalated.escalatedRows.keys()) {
+                auto rowLock = getEscalatedRowLock(escalated, id);
+                lockList.append(rowLock);
+                changedLocks.append({std::nullopt, rowLock});
+            }
+        } else {
+            // the lock stays, but the rows reported by the snapshots change
+            recordLockChange(escalatedName);
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
 void ResourceLockService::printLocks(const common::CallerContext& context, AsyncTaskPtr task) {
     std::lock_guard<std::recursive_mutex> guard(lockMutex_);
 
@@ -605,6 +1379,24 @@ void ResourceLockService::printLocks(const common::CallerContext& context, Async
     }
 }
 
+void ResourceLockService::auditLockEvent(LockAuditEventKind kind, const ResourceLock& lock) {
+    LockAuditLog::record(kind,
+                         db::stringToEntityType(getResourceTypeName(lock.resource)),
+                         getResourceId(lock.resource),
+                         lock.type,
+                         lock.adminId,
+                         lock.adminId == -1 ? lock.tag : lock.adminToken);
+}
+
+void ResourceLockService::auditLockEvent(LockAuditEventKind kind,
+                                         common::LockableResource resource,
+                                         common::ResourceLockType type,
+                                         int adminId,
+                                         const QString& owner)
+{
+    LockAuditLog::record(kind, resource.targetSet, resource.targetId, type, adminId, owner);
+}
+
 std::shared_ptr<db::Administrator> ResourceLockService::getAdmynByUsername(
     const QString& username) const
 {
@@ -3,10 +3,15 @@
 #include <mutex>
 #include <shared_mutex>
 #include <optional>
+#include <deque>
 
+#include "common/src/service/interface/IQueuedDemandRegistry.h"
 #include "common/src/service/interface/IResourceLockService.h"
 #include "common/src/service/EntityService.h"
 #include "common/src/service/AsyncTaskService.h"
+#include "common/src/LockAuditRecord.h"
+#include "common/src/Clock.h"
+#include "common/src/AdmissionControl.h"
 
 namespace db {
 class Administrator;
@@ -19,6 +24,7 @@ namespace common {
 class ResourceLockService
     : public QObject
     , public IResourceLockService
+    , public IQueuedDemandRegistry
 {
     Q_OBJECT
 
@@ -38,11 +44,19 @@ private:
 
         int adminId;
         QString adminToken;
+
+        // row locks an escalated type-level lock ("Type*") stands for, by id, with the timeout
+        // of every row; renewing a row moves its own timeout, the lock lasts till the latest
+        QMap<int, QDateTime> escalatedRows;
+
+        // timeout the owner has already been warned about
+        QDateTime announcedTimeout;
     };
 
 private:
     ResourceLockService(std::shared_ptr<EntityService> entityService,
-                        std::shared_ptr< AsyncTaskService> asyncTaskService);
+                        std::shared_ptr< AsyncTaskService> asyncTaskService,
+                        std::shared_ptr<IClock> clock);
 
 public:
     AsyncFuncPtr<bool> acquireLocks(
@@ -62,6 +76,10 @@ public:
             std::map< LockableResource,  ResourceLockType> resources,
             QString tag) override;
 
+    AsyncFuncPtr<bool> renewSystemLocksIfPossible(
+            std::map< LockableResource,  ResourceLockType> resources,
+            QString tag) override;
+
     AsyncTaskPtr releaseSystemLocks(
             std::map< LockableResource,  ResourceLockType> resources,
             QString tag) override;
@@ -78,6 +96,42 @@ public:
 
     AsyncFuncPtr<std::map<int, QString>> getLocks(db::EntityType entityType) override;
 
+    AsyncFuncPtr<LockSnapshot> getLockSnapshot(
+            db::EntityType entityType,
+            std::optional<quint64> sinceVersion = std::nullopt) override;
+
+    // acquires use the priority of the task they run in
+    void setQueuedDemand(QString demandId,
+                         std::map<LockableResource, ResourceLockType> resources,
+                         int priority) override;
+    void clearQueuedDemand(QString demandId) override;
+    // acquires are writers if they lock any resource for writing
+    void setQueuedDemandOrder(QueuedDemandOrder order) override;
+
+    AsyncTaskPtr listenLeaseEvents(util::Callback<void(QList<LeaseEvent>)> callback) override;
+    AsyncTaskPtr stopListenLeaseEvents(QString token) override;
+    AsyncTaskPtr forceReleaseLocks(
+            std::map<LockableResource, ResourceLockType> resources) override;
+    int getLeaseDuration() const override;
+
+    // more than threshold row locks of one owner on one EntityType are merged into a single
+    // type-level lock if nobody else conflicts, zero or negative value disables escalation;
+    // the rows keep their own leases within it and get them back when it is de-escalated
+    void setLockEscalationThreshold(int threshold);
+    int getLockEscalationThreshold() const;
+
+    // lease times are measured on this clock, the real clock is used by default, the leases
+    // held already keep their remaining time
+    void setClock(std::shared_ptr<IClock> clock);
+    std::shared_ptr<IClock> getClock() const;
+
+    // limits for acquireLocks() calls of one token, rejected calls fail with AdmissionRejected
+    // without touching the lock table, renewals, system locks and calls of an admitted
+    // context are not limited so leases do not lapse and queued requests are charged once
+    void setAdmissionLimits(AdmissionLimits limits);
+    AdmissionLimits getAdmissionLimits() const;
+    AdmissionStatistics getAdmissionStatistics() const;
+
 signals:
     // this signal is considered internal, and supports only direct connections
     void locksChanged(QList<QPair<std::optional<ResourceLock>, std::optional<ResourceLock>>>
@@ -86,31 +140,78 @@ signals:
 private:
     static bool compatible( ResourceLockType existing,  ResourceLockType lock);
     static QString getResourceName( LockableResource resource);
+    static QString getResourceTypeName(const QString& resourceName);
+    static int getResourceId(const QString& resourceName);
+    static LockableResource getResource(const QString& resourceName);
     std::map<ResourceLockService::ResourceLock, bool> getConcurrentLocks(
              LockableResource resource,
              ResourceLockType lock) const;
     bool checkIfLockIsValid(ResourceLockService::ResourceLock lock,
                              LockableResource res) const;
+    // the row lock an escalated lock stands for, with the timeout of the row
+    ResourceLock getEscalatedRowLock(const ResourceLock& escalated, int id) const;
+    // conflicting receives the first resource which a queued demand ranking ahead waits for
+    bool overtakesQueuedDemand(const std::map<LockableResource, ResourceLockType>& resources,
+                               int priority,
+                               std::optional<LockableResource>* conflicting = nullptr) const;
 
+    // conflicting receives the resource held by someone else if locking fails
     std::optional<std::map< LockableResource,  ResourceLockType>> getResourcesToLock(
             const std::map< LockableResource,  ResourceLockType>& resources,
             QList<QPair<std::optional<ResourceLock>, std::optional<ResourceLock>>>&
                     changedLocks,
             const QDateTime& now,
-            std::function<bool(ResourceLock lock)> isLockOurs);
+            std::function<bool(ResourceLock lock)> isLockOurs,
+            std::optional<LockableResource>* conflicting = nullptr);
+
+    void escalateLocksIfPossible(
+            int adminId,
+            std::function<bool(const ResourceLock& lock)> isLockOurs,
+            const QDateTime& now,
+            QList<QPair<std::optional<ResourceLock>, std::optional<ResourceLock>>>& changedLocks);
+
+    bool releaseEscalatedLock(
+            int adminId,
+            std::function<bool(const ResourceLock& lock)> isLockOurs,
+            LockableResource resource,
+            ResourceLockType type,
+            QList<QPair<std::optional<ResourceLock>, std::optional<ResourceLock>>>& changedLocks);
 
     // debug
     void printLocks(const  CallerContext& context, AsyncTaskPtr task);
 
+    static void auditLockEvent(LockAuditEventKind kind, const ResourceLock& lock);
+    static void auditLockEvent(LockAuditEventKind kind,
+                               LockableResource resource,
+                               ResourceLockType type,
+                               int adminId,
+                               const QString& owner);
+
     void connectToChangedSignal();
 
+    // every change of the lock table gets a new version, callers hold lockMutex_
+    void recordLockChange(const QString& resource);
+    quint16 getOwnerHandle(int adminId);
+
+    // the watch wakes up for the next lease event only, callers hold lockMutex_
+    void scheduleLeaseWatch();
+    void armLeaseWatch(const QDateTime& due);
+    void watchLeases();
+    // lease events are collected under lockMutex_ and delivered after it is released
+    void queueLeaseEvent(LeaseEventKind kind, const ResourceLock& lock);
+    void dispatchLeaseEvents();
+
+    // throws AdmissionRejected, every admitted call has to leave the admission control
+    void admit(const CallerContext& context);
+
     std::shared_ptr<db::Administrator> getAdmynByUsername(const QString& username) const;
 
 private:
     std::shared_ptr<EntityService> entityService_;
     std::shared_ptr<AsyncTaskService> asyncTaskService_;
+    std::shared_ptr<IClock> clock_;
 
-    std::recursive_mutex lockMutex_;
+    mutable std::recursive_mutex lockMutex_;
 
     QMultiMap<QString, QPair<QPair<util::Callback<void()>, QList<db::EntityType>>, bool>>
             locksChangedCallbacks_;
@@ -118,8 +219,40 @@ private:
 
     std::map<int, QList<ResourceLock>> locksByAdmins_;
 
+    struct QueuedDemand {
+        std::map<LockableResource, ResourceLockType> resources;
+        int priority;
+        bool writer;
+    };
+
+    std::map<QString, QueuedDemand> queuedDemands_;
+    QueuedDemandOrder queuedDemandOrder_ = QueuedDemandOrder::Priority;
+
+    struct LockChange {
+        quint64 version;
+        QString resource;
+    };
+
+    quint64 lockVersion_ = 0;
+    std::deque<LockChange> lockChangeLog_;
+    std::map<int, quint16> ownerHandles_;
+    QStringList ownerNames_;
+
+    QMultiMap<QString, util::Callback<void(QList<LeaseEvent>)>> leaseEventCallbacks_;
+    QList<QPair<QString, LeaseEvent>> pendingLeaseEvents_;
+    std::unique_ptr<QObject> leaseWatchGuard_ = std::make_unique<QObject>();
+    quint64 leaseWatchGeneration_             = 0;
+    std::optional<QDateTime> leaseWatchDue_;
+
+    int escalationThreshold_;
+
+    AdmissionControl admission_;
+
 private:
     static const int SecondsToLive;
+    static const int DefaultLockEscalationThreshold;
+    static const int LeaseWarningSeconds;
+    static const int MaxLockChangeLogSize;
     static std::shared_ptr<ResourceLockService> instance_;
 };
 
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <map>
+#include <memory>
 
 #include "common/src/CallerContext.h"
 #include "common/src/AsyncTask.h"
@@ -9,17 +10,77 @@
 
 namespace common {
 
+struct AsyncLockOptions {
+  // under the default fairness policy queued waiters are granted in priority order, waiting
+  // raises the priority gradually, the priority of the calling task is used if not set
+  std::optional<AsyncTask::Priority> priority;
+  // a queued request with the same key is replaced by this one, which takes over its place in
+  // the queue, so work requested repeatedly runs once, empty means no coalescing
+  QString coalesceKey;
+  // the locks are renewed while the task runs, for tasks that may outlive the lease
+  bool renewLease = false;
+};
+
+enum class AsyncLockStatus {
+  // the first attempt to acquire the resources has not finished yet
+  Pending,
+  Queued,
+  Granted,
+  TimedOut,
+  Cancelled,
+  Failed,
+  // the queue was full, or the owner was over its admission limits
+  Rejected,
+  Dropped,
+  // replaced by a newer request taking its place in the queue
+  Coalesced
+};
+
+// Handle of a request added to the queue, it does not keep the request alive.
+class IAsyncLockHandle {
+public:
+  virtual ~IAsyncLockHandle() = default;
+
+  virtual AsyncLockStatus getStatus() const = 0;
+  // withdraws the request unless it has been granted already, neither its task nor its timeout
+  // task runs, returns false if it was too late
+  virtual bool cancel() = 0;
+  // returns false if the request is no longer waiting
+  virtual bool setPriority(AsyncTask::Priority priority) = 0;
+};
+
+using AsyncLockHandlePtr = std::shared_ptr<IAsyncLockHandle>;
+
 class IDelayedResourceLockService {
 public:
-  virtual void addAsyncLock(CallerContext context,
+  virtual AsyncLockHandlePtr addAsyncLock(CallerContext context,
                             std::map<common::LockableResource, common::ResourceLockType> resources,
                             AsyncTaskPtr task,
                             int timeoutMs,
-                            AsyncTaskPtr timeoutTask = nullptr) = 0;
-  virtual void addAsyncSystemLock(
+                            AsyncTaskPtr timeoutTask = nullptr,
+                            AsyncLockOptions options = {}) = 0;
+  virtual AsyncLockHandlePtr addAsyncSystemLock(
             QString tag,
             std::map<LockableResource, ResourceLockType> resources,
             AsyncTaskPtr task,            int timeoutMs,
-            AsyncTaskPtr timeoutTask = nullptr) = 0;
+            AsyncTaskPtr timeoutTask = nullptr,
+            AsyncLockOptions options = {}) = 0;
+
+  // the steps run one after another under a single acquisition of the resources, a failing
+  // step ends the pipeline
+  virtual AsyncLockHandlePtr addAsyncLockPipeline(
+            CallerContext context,
+            std::map<LockableResource, ResourceLockType> resources,
+            QList<AsyncTaskPtr> steps,
+            int timeoutMs,
+            AsyncTaskPtr timeoutTask = nullptr,
+            AsyncLockOptions options = {}) = 0;
+  virtual AsyncLockHandlePtr addAsyncSystemLockPipeline(
+            QString tag,
+            std::map<LockableResource, ResourceLockType> resources,
+            QList<AsyncTaskPtr> steps,
+            int timeoutMs,
+            AsyncTaskPtr timeoutTask = nullptr,
+            AsyncLockOptions options = {}) = 0;
 };
 } // namespace common
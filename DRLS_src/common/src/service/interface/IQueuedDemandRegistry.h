@@ -0,0 +1,35 @@
+#pragma once
+
+#include <QtCore>
+
+#include "common/src/LockableResource.h"
+
+namespace common {
+
+// How queued demands rank against a new acquire, which does not queue and has no deadline.
+enum class QueuedDemandOrder {
+    // a demand is ahead of acquires of lower priority
+    Priority,
+    // a demand has arrived earlier, so it is ahead of every acquire
+    Arrival,
+    // a writer demand is ahead of every acquire, a reader demand of readers only
+    WritersFirst
+};
+
+// Internal hook between DelayedResourceLockService and the lock service it queues in front of,
+// not meant for the clients of IResourceLockService.
+class IQueuedDemandRegistry {
+public:
+    virtual ~IQueuedDemandRegistry() = default;
+
+    // announces resources a queued waiter is waiting for, a new acquire conflicting with a
+    // demand ranking ahead of it fails, so it cannot overtake the queue
+    virtual void setQueuedDemand(QString demandId, std::map<common::LockableResource,common::ResourceLockType> resources, int priority) = 0;
+
+    virtual void clearQueuedDemand(QString demandId) = 0;
+
+    // follows the fairness policy of the queue, applies to the demands announced already too
+    virtual void setQueuedDemandOrder(QueuedDemandOrder order) = 0;
+};
+
+}  // namespace common
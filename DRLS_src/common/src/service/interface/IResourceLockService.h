@@ -17,10 +17,47 @@ class IResourceLockServiceMeta : public common::details::IServiceMeta {
 
 signals:
     void locksChanged();
+
+    // locks on these resources have been released or have expired, or a queued demand stopped
+    // holding them back, the id -1 stands for every resource of the EntityType
+    void resourcesReleased(QList<common::LockableResource> resources);
 };
 
 }  // namespace details
 
+enum class LeaseEventKind { AboutToExpire, Expired, Revoked };
+
+struct LeaseEvent {
+    LeaseEventKind kind;
+    // type-level and escalated locks are reported with the id -1
+    common::LockableResource resource;
+    common::ResourceLockType type;
+    QDateTime timeout;
+};
+
+// one lock of a compact snapshot, trivially copyable so a snapshot can be copied as a block
+struct LockSnapshotEntry {
+    enum Flags : quint8 { None = 0, Removed = 1 };
+
+    qint64 expiresAtMs;  // msecs since epoch
+    qint32 id;           // -1 for type-level locks
+    quint16 owner;       // index into LockSnapshot::owners
+    quint8 mode;         // ResourceLockType
+    quint8 flags;
+};
+
+static_assert(sizeof(LockSnapshotEntry) == 16, "LockSnapshotEntry must stay compact");
+
+struct LockSnapshot {
+    quint64 version = 0;
+    // a delta holds every current entry of the ids changed since the requested version,
+    // and a Removed entry for changed ids that are not locked anymore
+    bool isDelta = false;
+    QList<LockSnapshotEntry> entries;
+    // owner handles are stable for the lifetime of the service, 0 stands for system locks
+    QStringList owners;
+};
+
 class IResourceLockService
         : public common::ITypedService<IResourceLockService, details::IResourceLockServiceMeta>
 {
@@ -36,6 +73,9 @@ public:
 
     virtual AsyncFuncPtr<bool> acquireSystemLocks(std::map<common::LockableResource,common::ResourceLockType> resources, QString tag) = 0;
 
+    // renews the leases only, it fails instead of acquiring locks that have expired or have been revoked
+    virtual AsyncFuncPtr<bool> renewSystemLocksIfPossible(std::map<common::LockableResource,common::ResourceLockType> resources, QString tag) = 0;
+
     virtual AsyncTaskPtr releaseSystemLocks(std::map<common::LockableResource,common::ResourceLockType> resources, QString tag) = 0;
 
     virtual AsyncFuncPtr<QSet<QPair<QString,QString>>> getConcurrentLockOwnerNames(std::map<common::LockableResource,common::ResourceLockType> resources, common::CallerContext context) = 0;
@@ -45,5 +85,21 @@ public:
     virtual AsyncTaskPtr stopListenLocksChanged(util::Callback<void()> callback) = 0;
 
     virtual AsyncFuncPtr<std::map<int,QString>> getLocks(db::EntityType entityType) = 0;
+
+    // a full snapshot is returned if sinceVersion is not set or too old to build a delta from
+    virtual AsyncFuncPtr<common::LockSnapshot> getLockSnapshot(db::EntityType entityType, std::optional<quint64> sinceVersion = std::nullopt) = 0;
+
+    // the token of the callback is the admin token or the system tag whose leases are watched, events are delivered in batches on an arbitrary thread
+    virtual AsyncTaskPtr listenLeaseEvents(util::Callback<void(QList<common::LeaseEvent>)> callback) = 0;
+
+    virtual AsyncTaskPtr stopListenLeaseEvents(QString token) = 0;
+
+    // releases the locks of anyone on the resources, their owners are notified with Revoked events
+    virtual AsyncTaskPtr forceReleaseLocks(std::map<common::LockableResource,common::ResourceLockType> resources) = 0;
+
+    // how long a granted or renewed lock lasts unless it is renewed again, in seconds
+    virtual int getLeaseDuration() const = 0;
 };
 }
+
+Q_DECLARE_METATYPE(common::LockableResource)
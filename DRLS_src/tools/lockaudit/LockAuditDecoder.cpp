@@ -0,0 +1,135 @@
+// Decodes a lock audit dump written by common::LockAuditLog::dumpToFile into readable text.
+//
+// usage: LockAuditDecoder <dump file>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "common/src/LockAuditRecord.h"
+
+using namespace common;
+
+namespace {
+
+// keep in sync with db::EntityType
+const char* entityTypeName(uint8_t entityType) {
+    switch (entityType) {
+    case 0:
+        return "Entity";
+    case 1:
+        return "Administrator";
+    case 2:
+        return "Fruit";
+    case 3:
+        return "User";
+    default:
+        return "Unknown";
+    }
+}
+
+const char* kindName(uint8_t kind) {
+    switch (static_cast<LockAuditEventKind>(kind)) {
+    case LockAuditEventKind::Acquire:
+        return "ACQUIRE ";
+    case LockAuditEventKind::Conflict:
+        return "CONFLICT";
+    case LockAuditEventKind::Renew:
+        return "RENEW   ";
+    case LockAuditEventKind::Release:
+        return "RELEASE ";
+    case LockAuditEventKind::Expire:
+        return "EXPIRE  ";
+    case LockAuditEventKind::Escalate:
+        return "ESCALATE";
+    default:
+        return "UNKNOWN ";
+    }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        std::fprintf(stderr, "usage: %s <dump file>\n", argv[0]);
+        return 2;
+    }
+
+    std::FILE* file = std::fopen(argv[1], "rb");
+    if (file == nullptr) {
+        std::perror(argv[1]);
+        return 1;
+    }
+
+    LockAuditFileHeader header;
+    if (std::fread(&header, sizeof(header), 1, file) != 1 ||
+        std::memcmp(header.magic, LockAuditFileMagic, sizeof(header.magic)) != 0) {
+        std::fprintf(stderr, "%s: not a lock audit dump\n", argv[1]);
+        std::fclose(file);
+        return 1;
+    }
+
+    if (header.version != LockAuditFileVersion || header.eventSize != sizeof(LockAuditEvent)) {
+        std::fprintf(stderr,
+                     "%s: unsupported dump version %u (event size %u)\n",
+                     argv[1],
+                     header.version,
+                     header.eventSize);
+        std::fclose(file);
+        return 1;
+    }
+
+    // a corrupted header must not make us allocate more than the file can hold
+    long start = std::ftell(file);
+    long end   = std::fseek(file, 0, SEEK_END) == 0 ? std::ftell(file) : -1;
+    if (start < 0 || end < 0 || std::fseek(file, start, SEEK_SET) != 0) {
+        std::fprintf(stderr, "%s: cannot determine the size of the dump\n", argv[1]);
+        std::fclose(file);
+        return 1;
+    }
+
+    size_t expected  = header.eventCount;
+    size_t available = static_cast<size_t>(end - start) / sizeof(LockAuditEvent);
+    std::vector<LockAuditEvent> events(std::min(expected, available));
+    size_t read = events.empty()
+                          ? 0
+                          : std::fread(events.data(), sizeof(LockAuditEvent), events.size(), file);
+    std::fclose(file);
+
+    if (read != expected)
+        std::fprintf(stderr,
+                     "%s: truncated dump, %zu of %zu events read\n",
+                     argv[1],
+                     read,
+                     expected);
+
+    std::printf("# %zu events, times relative to dump (ms)\n", read);
+    for (size_t i = 0; i < read; i++) {
+        const auto& event = events[i];
+        double relativeMs = (static_cast<double>(event.timestampNs) -
+                             static_cast<double>(header.dumpedAtNs)) /
+                            1e6;
+
+        char resource[64];
+        if (event.resourceId >= 0)
+            std::snprintf(resource,
+                          sizeof(resource),
+                          "%s#%d",
+                          entityTypeName(event.entityType),
+                          event.resourceId);
+        else
+            std::snprintf(resource, sizeof(resource), "%s*", entityTypeName(event.entityType));
+
+        std::printf("%14.3f  t%-3u %s %-24s %-5s admin=%-4d owner=%08x\n",
+                    relativeMs,
+                    static_cast<unsigned>(event.threadIndex),
+                    kindName(event.kind),
+                    resource,
+                    event.lockType == 0 ? "Read" : "Write",
+                    event.adminId,
+                    event.ownerHash);
+    }
+
+    return 0;
+}
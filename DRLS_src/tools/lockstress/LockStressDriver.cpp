@@ -0,0 +1,666 @@
+// Long running stress and soak driver of the lock services.
+//
+// Simulated administrators and system taggers randomly acquire, renew, release, queue through
+// DelayedResourceLockService and abandon locks so their leases expire. Time runs on an
+// accelerated clock, so lease expiry is exercised within seconds. Throughput and latency
+// percentiles are reported periodically, and every grant is checked against a shadow lock table
+// for mutual exclusion violations.
+//
+// usage: LockStressDriver [--admins N] [--taggers N] [--resources N] [--duration SECONDS]
+//                         [--acceleration FACTOR] [--report-interval SECONDS]
+//                         [--min-ops-per-sec N] [--fairness aging|fifo|writers|edf]
+//                         [--executor pool|stealing]
+//
+// A --duration of 0 runs until interrupted. The exit code is 1 if an invariant was violated or
+// the throughput stayed below --min-ops-per-sec, so the driver can be used as a regression gate.
+
+#include <QCoreApplication>
+#include <QtCore>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <variant>
+#include <vector>
+
+#include "common/src/Clock.h"
+#include "common/src/service/AsyncTaskService.h"
+#include "common/src/service/DelayedResourceLockService.h"
+#include "common/src/service/EntityService.h"
+#include "common/src/service/ResourceLockService.h"
+
+#include "persistence/Administrator.h"
+
+using namespace common;
+
+namespace {
+
+using SteadyClock = std::chrono::steady_clock;
+
+struct Options {
+    int admins             = 16;
+    int taggers            = 4;
+    int resources          = 200;
+    int durationSeconds    = 60;
+    double acceleration    = 60;
+    int reportIntervalSecs = 5;
+    double minOpsPerSec    = 0;
+    DelayedResourceLockService::FairnessPolicy fairness =
+            DelayedResourceLockService::FairnessPolicy::PriorityWithAging;
+    bool workStealing = false;
+};
+
+enum Operation { Acquire, Renew, Release, Queue, Abandon, OperationCount };
+
+const char* operationName(int operation) {
+    switch (operation) {
+    case Acquire:
+        return "acquire";
+    case Renew:
+        return "renew";
+    case Release:
+        return "release";
+    case Queue:
+        return "queue";
+    case Abandon:
+        return "abandon";
+    default:
+        return "unknown";
+    }
+}
+
+// Locks the driver believes to be granted. A grant conflicting with a lock whose lease surely
+// had not run out when the grant was requested breaks mutual exclusion.
+class ShadowLockTable {
+public:
+    struct Holding {
+        QString owner;
+        LockableResource resource;
+        ResourceLockType type;
+        // the lease started after this time, so it cannot expire before it plus the lease length
+        QDateTime earliestExpiry;
+    };
+
+    void grant(const QString& owner,
+               const std::map<LockableResource, ResourceLockType>& resources,
+               const QDateTime& requestedAt,
+               const QDateTime& earliestExpiry)
+    {
+        std::lock_guard guard(mutex_);
+        for (const auto& [res, type] : resources) {
+            for (const auto& holding : holdings_) {
+                if (holding.owner == owner || !overlaps(holding.resource, res))
+                    continue;
+
+                bool compatible =
+                        holding.type == ResourceLockType::Read && type == ResourceLockType::Read;
+                if (!compatible && holding.earliestExpiry > requestedAt) {
+                    ++violations_;
+                    std::fprintf(stderr,
+                                 "VIOLATION: %s got %s #%d while %s holds it until %s\n",
+                                 qPrintable(owner),
+                                 type == ResourceLockType::Read ? "read" : "write",
+                                 res.targetId,
+                                 qPrintable(holding.owner),
+                                 qPrintable(holding.earliestExpiry.toString(Qt::ISODateWithMs)));
+                }
+            }
+        }
+
+        for (const auto& [res, type] : resources) {
+            revokeLocked(owner, res);
+            holdings_.append({owner, res, type, earliestExpiry});
+        }
+    }
+
+    void renew(const QString& owner,
+               const std::map<LockableResource, ResourceLockType>& resources,
+               const QDateTime& earliestExpiry)
+    {
+        std::lock_guard guard(mutex_);
+        for (auto& holding : holdings_) {
+            if (holding.owner == owner && resources.count(holding.resource) > 0)
+                holding.earliestExpiry = earliestExpiry;
+        }
+    }
+
+    // has to be called before the locks are released in the lock service
+    void revoke(const QString& owner,
+                const std::map<LockableResource, ResourceLockType>& resources)
+    {
+        std::lock_guard guard(mutex_);
+        for (const auto& [res, type] : resources)
+            revokeLocked(owner, res);
+    }
+
+    void forgetExpired(const QDateTime& now) {
+        std::lock_guard guard(mutex_);
+        holdings_.erase(std::remove_if(holdings_.begin(),
+                                       holdings_.end(),
+                                       [&now](const Holding& holding) {
+                                           return holding.earliestExpiry < now;
+                                       }),
+                        holdings_.end());
+    }
+
+    int getNumberOfViolations() const { return violations_; }
+
+private:
+    // the driver holds rows and the rare type-level lock, which the lock service names
+    // "Type#-1" and matches by that exact name only; escalation merges rows of one owner, so it
+    // never makes two owners share a resource and holdings overlap only if they are the same
+    static bool overlaps(const LockableResource& a, const LockableResource& b) {
+        return a.entityType() == b.entityType() && a.targetId == b.targetId;
+    }
+
+    void revokeLocked(const QString& owner, const LockableResource& resource) {
+        holdings_.erase(std::remove_if(holdings_.begin(),
+                                       holdings_.end(),
+                                       [&owner, &resource](const Holding& holding) {
+                                           return holding.owner == owner &&
+                                                  holding.resource.entityType() ==
+                                                          resource.entityType() &&
+                                                  holding.resource.targetId == resource.targetId;
+                                       }),
+                        holdings_.end());
+    }
+
+private:
+    std::mutex mutex_;
+    QList<Holding> holdings_;
+    std::atomic_int violations_ = 0;
+};
+
+class Statistics {
+public:
+    void record(int operation, bool succeeded, SteadyClock::duration latency) {
+        std::lock_guard guard(mutex_);
+        latencies_[operation].push_back(
+                std::chrono::duration_cast<std::chrono::microseconds>(latency).count());
+        ++counts_[operation];
+        ++totalCounts_[operation];
+        if (!succeeded)
+            ++failures_[operation];
+    }
+
+    // prints the interval since the previous report and starts a new one
+    void report(double intervalSeconds,
+                double elapsedSeconds,
+                int violations,
+                int queued,
+                const DelayedLockStatistics& queue) {
+        std::lock_guard guard(mutex_);
+
+        qint64 total = 0;
+        for (int op = 0; op < OperationCount; ++op)
+            total += counts_[op];
+
+        std::printf("[%7.1fs] %9.0f ops/s  queued %5d  oldest wait %6lld ms  violations %d\n",
+                    elapsedSeconds,
+                    total / intervalSeconds,
+                    queued,
+                    static_cast<long long>(queue.oldestWaitMs),
+                    violations);
+
+        for (int op = 0; op < OperationCount; ++op) {
+            auto& latencies = latencies_[op];
+            if (latencies.empty())
+                continue;
+
+            std::sort(latencies.begin(), latencies.end());
+            auto percentile = [&latencies](double p) {
+                return latencies[std::min<size_t>(latencies.size() - 1,
+                                                  static_cast<size_t>(p * latencies.size()))];
+            };
+
+            std::printf("    %-8s %8.0f ops/s  failed %5.1f%%  p50 %6lld us  p90 %6lld us"
+                        "  p99 %6lld us  max %6lld us\n",
+                        operationName(op),
+                        counts_[op] / intervalSeconds,
+                        100.0 * failures_[op] / counts_[op],
+                        static_cast<long long>(percentile(0.5)),
+                        static_cast<long long>(percentile(0.9)),
+                        static_cast<long long>(percentile(0.99)),
+                        static_cast<long long>(latencies.back()));
+
+            latencies.clear();
+            counts_[op]   = 0;
+            failures_[op] = 0;
+        }
+
+        // cumulative, queue times are on the accelerated clock
+        std::printf("    grant    p50 %6lld ms  p99 %6lld ms  retries p99 %4lld  timed out %llu"
+                    " (%.1f%%)  cancelled %llu\n",
+                    static_cast<long long>(queue.timeToGrantMs.getPercentile(0.5)),
+                    static_cast<long long>(queue.timeToGrantMs.getPercentile(0.99)),
+                    static_cast<long long>(queue.retriesPerGrant.getPercentile(0.99)),
+                    static_cast<unsigned long long>(queue.timedOut),
+                    100.0 * queue.deadlineMissRate,
+                    static_cast<unsigned long long>(queue.cancelled));
+        std::fflush(stdout);
+    }
+
+    qint64 getTotalNumberOfOperations() {
+        std::lock_guard guard(mutex_);
+        qint64 total = 0;
+        for (int op = 0; op < OperationCount; ++op)
+            total += totalCounts_[op];
+        return total;
+    }
+
+private:
+    std::mutex mutex_;
+    std::vector<qint64> latencies_[OperationCount];
+    qint64 counts_[OperationCount]      = {};
+    qint64 failures_[OperationCount]    = {};
+    qint64 totalCounts_[OperationCount] = {};
+};
+
+// Requests queued in DelayedResourceLockService by the actors. Their tasks refer to the shadow
+// table, so the ones still outstanding when the driver stops are canceled, and the ones
+// already inside the table are waited for.
+class QueuedRequests {
+public:
+    void add(AsyncLockHandlePtr handle, std::weak_ptr<AsyncTask> task) {
+        std::lock_guard guard(mutex_);
+        // deleted tasks are dropped now and then, so a long soak does not pile them up
+        if (requests_.size() >= pruneAt_) {
+            std::erase_if(requests_, [](const auto& request) { return request.second.expired(); });
+            pruneAt_ = std::max<size_t>(1024, 2 * requests_.size());
+        }
+        requests_.push_back({handle, task});
+    }
+
+    // false if the task has been stopped meanwhile, it must not touch the shadow table then
+    bool enter(const AsyncTaskPtr& task) {
+        ++running_;
+        if (task->isRunning())
+            return true;
+
+        --running_;
+        return false;
+    }
+
+    void leave() { --running_; }
+
+    void cancelAll() {
+        std::lock_guard guard(mutex_);
+        for (const auto& [handle, weakTask] : requests_) {
+            handle->cancel();
+            // granted but not started yet, terminating keeps its function from running
+            if (auto task = weakTask.lock())
+                task->terminate();
+        }
+        requests_.clear();
+    }
+
+    int getNumberOfRunning() const { return running_; }
+
+    // requests which have neither ended nor been terminated yet
+    std::atomic_int pending = 0;
+
+private:
+    std::mutex mutex_;
+    std::vector<std::pair<AsyncLockHandlePtr, std::weak_ptr<AsyncTask>>> requests_;
+    size_t pruneAt_ = 1024;
+    std::atomic_int running_ = 0;
+};
+
+// one simulated administrator or system tagger
+class Actor {
+public:
+    Actor(std::variant<CallerContext, QString> contextOrTag,
+          const Options& options,
+          ShadowLockTable& shadow,
+          Statistics& statistics,
+          std::shared_ptr<QueuedRequests> queued,
+          unsigned seed)
+        : contextOrTag_(contextOrTag)
+        , options_(options)
+        , shadow_(shadow)
+        , statistics_(statistics)
+        , queued_(queued)
+        , random_(seed)
+    {}
+
+    void run(const std::atomic_bool& stopped) {
+        while (!stopped) {
+            int dice = std::uniform_int_distribution(0, 99)(random_);
+            if (held_.empty() || dice < 40)
+                acquire();
+            else if (dice < 60)
+                renew();
+            else if (dice < 85)
+                release();
+            else if (dice < 95)
+                queue();
+            else
+                abandon();
+        }
+
+        if (!held_.empty())
+            release();
+    }
+
+private:
+    QString owner() const {
+        return std::holds_alternative<CallerContext>(contextOrTag_)
+                       ? std::get<CallerContext>(contextOrTag_).token
+                       : std::get<QString>(contextOrTag_);
+    }
+
+    std::map<LockableResource, ResourceLockType> randomResources() {
+        std::map<LockableResource, ResourceLockType> resources;
+
+        // a rare type-level lock, named "User#-1" by the service, independent of the row locks
+        if (std::uniform_int_distribution(0, 199)(random_) == 0) {
+            resources[LockableResource(db::EntityType::User)] = ResourceLockType::Write;
+            return resources;
+        }
+
+        int count = std::uniform_int_distribution(1, 4)(random_);
+        for (int i = 0; i < count; ++i) {
+            int id    = std::uniform_int_distribution(1, options_.resources)(random_);
+            auto type = std::uniform_int_distribution(0, 2)(random_) == 0 ? ResourceLockType::Write
+                                                                           : ResourceLockType::Read;
+            resources[LockableResource(db::EntityType::User, id)] = type;
+        }
+        return resources;
+    }
+
+    bool computeSync(AsyncFuncPtr<bool> function) {
+        try {
+            return function->computeSync()->getResult();
+        } catch (const std::exception&) {
+            return false;
+        }
+    }
+
+    void acquire() {
+        auto resources   = randomResources();
+        auto lockService = ResourceLockService::getInstance();
+        auto requestedAt = lockService->getClock()->now();
+
+        auto started = SteadyClock::now();
+        bool granted =
+                std::holds_alternative<CallerContext>(contextOrTag_)
+                        ? computeSync(lockService->acquireLocks(
+                                  resources, std::get<CallerContext>(contextOrTag_)))
+                        : computeSync(lockService->acquireSystemLocks(
+                                  resources, std::get<QString>(contextOrTag_)));
+        statistics_.record(Acquire, granted, SteadyClock::now() - started);
+
+        if (granted) {
+            shadow_.grant(owner(),
+                          resources,
+                          requestedAt,
+                          requestedAt.addSecs(lockService->getLeaseDuration()));
+            for (const auto& [res, type] : resources)
+                held_[res] = type;
+        }
+    }
+
+    void renew() {
+        auto lockService = ResourceLockService::getInstance();
+        auto requestedAt = lockService->getClock()->now();
+
+        auto started  = SteadyClock::now();
+        bool renewed  = std::holds_alternative<CallerContext>(contextOrTag_)
+                                ? computeSync(lockService->renewLocksIfPossible(
+                                         held_, std::get<CallerContext>(contextOrTag_)))
+                                : computeSync(lockService->renewSystemLocksIfPossible(
+                                         held_, std::get<QString>(contextOrTag_)));
+        statistics_.record(Renew, renewed, SteadyClock::now() - started);
+
+        if (renewed) {
+            shadow_.renew(owner(), held_, requestedAt.addSecs(lockService->getLeaseDuration()));
+        } else {
+            // some leases ran out and were taken over, start over
+            shadow_.revoke(owner(), held_);
+            releaseHeld();
+        }
+    }
+
+    void release() {
+        auto started = SteadyClock::now();
+        shadow_.revoke(owner(), held_);
+        releaseHeld();
+        statistics_.record(Release, true, SteadyClock::now() - started);
+    }
+
+    void releaseHeld() {
+        auto lockService = ResourceLockService::getInstance();
+        if (std::holds_alternative<CallerContext>(contextOrTag_)) {
+            lockService->releaseLocks(held_, std::get<CallerContext>(contextOrTag_))->runSync();
+        } else {
+            lockService->releaseSystemLocks(held_, std::get<QString>(contextOrTag_))->runSync();
+        }
+        held_.clear();
+    }
+
+    void queue() {
+        auto resources   = randomResources();
+        auto drls        = DelayedResourceLockService::getInstance();
+        auto lockService = ResourceLockService::getInstance();
+        auto requestedAt = drls->getClock()->now();
+        auto leaseEnd    = requestedAt.addSecs(lockService->getLeaseDuration());
+        auto owner       = this->owner() + "/queued-" + QString::number(++queuedRequests_);
+        auto& shadow     = shadow_;
+        auto queued      = queued_;
+
+        ++queued->pending;
+        auto task = AsyncTaskService::getInstance()->createTask(
+                [&shadow, queued, owner, resources, requestedAt, leaseEnd](AsyncTaskPtr self) {
+                    if (!queued->enter(self))
+                        return;
+
+                    shadow.grant(owner, resources, requestedAt, leaseEnd);
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    shadow.revoke(owner, resources);
+                    queued->leave();
+                });
+
+        // timed out, rejected, dropped and coalesced requests are terminated without ending,
+        // and a granted task is terminated on release after it has ended
+        auto counted = std::make_shared<std::atomic_bool>(false);
+        auto done    = [queued, counted] {
+            if (!counted->exchange(true))
+                --queued->pending;
+        };
+        task->onEnded([done](auto, bool) { done(); }, false);
+        task->onTerminated([done](auto) { done(); }, false);
+
+        static constexpr AsyncTask::Priority Priorities[] = {AsyncTask::Priority::Low,
+                                                             AsyncTask::Priority::BelowNormal,
+                                                             AsyncTask::Priority::Normal,
+                                                             AsyncTask::Priority::AboveNormal,
+                                                             AsyncTask::Priority::High};
+        AsyncLockOptions lockOptions;
+        lockOptions.priority = Priorities[std::uniform_int_distribution(0, 4)(random_)];
+        // interactive and batch like deadlines, so the order of the queue matters
+        int timeoutMs =
+                std::uniform_int_distribution(QueueTimeoutMs / 4, QueueTimeoutMs * 2)(random_);
+
+        // every queued request is a separate owner, so it never counts as ours in the shadow table
+        auto started = SteadyClock::now();
+        AsyncLockHandlePtr handle;
+        if (std::holds_alternative<CallerContext>(contextOrTag_)) {
+            auto context  = std::get<CallerContext>(contextOrTag_);
+            context.token = owner;
+            handle = drls->addAsyncLock(context, resources, task, timeoutMs, nullptr, lockOptions);
+        } else {
+            handle = drls->addAsyncSystemLock(
+                    owner, resources, task, timeoutMs, nullptr, lockOptions);
+        }
+        statistics_.record(Queue, true, SteadyClock::now() - started);
+        queued->add(handle, task);
+    }
+
+    void abandon() {
+        // the leases stay in the shadow table until they run out
+        held_.clear();
+        statistics_.record(Abandon, true, SteadyClock::duration::zero());
+    }
+
+private:
+    static constexpr int QueueTimeoutMs = 2000;
+
+    std::variant<CallerContext, QString> contextOrTag_;
+    const Options& options_;
+    ShadowLockTable& shadow_;
+    Statistics& statistics_;
+    std::shared_ptr<QueuedRequests> queued_;
+    std::mt19937 random_;
+    std::map<LockableResource, ResourceLockType> held_;
+    int queuedRequests_ = 0;
+};
+
+Options parseOptions(const QStringList& arguments) {
+    Options options;
+    for (int i = 1; i + 1 < arguments.size(); i += 2) {
+        auto name  = arguments[i];
+        auto value = arguments[i + 1];
+        if (name == "--admins")
+            options.admins = value.toInt();
+        else if (name == "--taggers")
+            options.taggers = value.toInt();
+        else if (name == "--resources")
+            options.resources = std::max(1, value.toInt());
+        else if (name == "--duration")
+            options.durationSeconds = value.toInt();
+        else if (name == "--acceleration")
+            options.acceleration = value.toDouble();
+        else if (name == "--report-interval")
+            options.reportIntervalSecs = std::max(1, value.toInt());
+        else if (name == "--min-ops-per-sec")
+            options.minOpsPerSec = value.toDouble();
+        else if (name == "--fairness" && value == "aging")
+            options.fairness = DelayedResourceLockService::FairnessPolicy::PriorityWithAging;
+        else if (name == "--fairness" && value == "fifo")
+            options.fairness = DelayedResourceLockService::FairnessPolicy::FifoPerResource;
+        else if (name == "--fairness" && value == "writers")
+            options.fairness = DelayedResourceLockService::FairnessPolicy::WriterPreferring;
+        else if (name == "--fairness" && value == "edf")
+            options.fairness = DelayedResourceLockService::FairnessPolicy::EarliestDeadlineFirst;
+        else if (name == "--executor" && (value == "pool" || value == "stealing"))
+            options.workStealing = value == "stealing";
+        else
+            throw std::invalid_argument("Unknown option: " + name.toStdString());
+    }
+    return options;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    QCoreApplication app(argc, argv);
+
+    Options options;
+    try {
+        options = parseOptions(app.arguments());
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "%s\n", e.what());
+        return 2;
+    }
+
+    if (options.workStealing)
+        AsyncTaskService::createInstance(std::make_shared<WorkStealingExecutor>());
+
+    auto entityService = EntityService::getInstance();
+    auto lockService   = ResourceLockService::getInstance();
+    auto drls          = DelayedResourceLockService::getInstance();
+
+    auto clock = std::make_shared<AcceleratedClock>(options.acceleration);
+    lockService->setClock(clock);
+    drls->setClock(clock);
+    drls->setFairnessPolicy(options.fairness);
+
+    ShadowLockTable shadow;
+    Statistics statistics;
+    auto queued              = std::make_shared<QueuedRequests>();
+    std::atomic_bool stopped = false;
+
+    std::vector<std::unique_ptr<Actor>> actors;
+    for (int i = 0; i < options.admins; ++i) {
+        auto username = QString("stress-admin-%1").arg(i);
+        entityService->create<db::Administrator>()->setUsername(username)->setFullName(username);
+
+        CallerContext context(QString("stress-token-%1").arg(i), username);
+        actors.push_back(
+                std::make_unique<Actor>(context, options, shadow, statistics, queued, i + 1));
+    }
+    for (int i = 0; i < options.taggers; ++i) {
+        actors.push_back(std::make_unique<Actor>(QString("stress-tagger-%1").arg(i),
+                                                 options,
+                                                 shadow,
+                                                 statistics,
+                                                 queued,
+                                                 options.admins + i + 1));
+    }
+
+    std::vector<std::thread> threads;
+    for (auto& actor : actors)
+        threads.emplace_back([&actor, &stopped] { actor->run(stopped); });
+
+    auto startedAt    = SteadyClock::now();
+    auto lastReportAt = startedAt;
+
+    QTimer reportTimer;
+    QObject::connect(&reportTimer, &QTimer::timeout, [&] {
+        auto now = SteadyClock::now();
+        shadow.forgetExpired(clock->now());
+        statistics.report(std::chrono::duration<double>(now - lastReportAt).count(),
+                          std::chrono::duration<double>(now - startedAt).count(),
+                          shadow.getNumberOfViolations(),
+                          queued->pending,
+                          drls->getStatistics());
+        lastReportAt = now;
+    });
+    reportTimer.start(options.reportIntervalSecs * 1000);
+
+    if (options.durationSeconds > 0)
+        QTimer::singleShot(options.durationSeconds * 1000, &app, [&app] { app.quit(); });
+
+    app.exec();
+
+    stopped = true;
+    for (auto& thread : threads)
+        thread.join();
+
+    // queued tasks refer to the shadow table, let them finish or time out
+    QElapsedTimer drainTimer;
+    drainTimer.start();
+    while (queued->pending > 0 && drainTimer.elapsed() < 10000) {
+        app.processEvents();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    // whatever is left must not reach the shadow table once main has returned
+    queued->cancelAll();
+    while (queued->getNumberOfRunning() > 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    double elapsed = std::chrono::duration<double>(SteadyClock::now() - startedAt).count();
+    double opsPerSec = statistics.getTotalNumberOfOperations() / elapsed;
+    std::printf("total: %.0f ops/s over %.1f s, %d violations\n",
+                opsPerSec,
+                elapsed,
+                shadow.getNumberOfViolations());
+
+    if (shadow.getNumberOfViolations() > 0)
+        return 1;
+
+    if (options.minOpsPerSec > 0 && opsPerSec < options.minOpsPerSec) {
+        std::fprintf(stderr,
+                     "throughput %.0f ops/s is below the required %.0f ops/s\n",
+                     opsPerSec,
+                     options.minOpsPerSec);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,154 @@
+// Micro benchmark of the task life cycle.
+//
+// Measures the cost of creating and destroying tasks, running them synchronously and connecting
+// and emitting their handlers. Every scenario is repeated for a number of rounds and the best
+// round is reported, as time and as heap allocations per task, so changes to AsyncTask::Core,
+// the handler slots or the task registration can be compared before and after.
+//
+// usage: TaskBenchmark [--tasks N] [--handlers N] [--rounds N]
+//
+// Allocations are counted by replacing the global operator new, so only allocations of the
+// benchmark thread between the start and the end of a round are reported.
+
+#include <QCoreApplication>
+#include <QtCore>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <vector>
+
+#include "common/src/service/AsyncTaskService.h"
+
+using namespace common;
+
+namespace {
+
+using SteadyClock = std::chrono::steady_clock;
+
+thread_local bool countAllocations = false;
+thread_local long long allocations = 0;
+
+}  // namespace
+
+void* operator new(std::size_t size) {
+    if (countAllocations)
+        ++allocations;
+
+    if (void* block = std::malloc(size == 0 ? 1 : size))
+        return block;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* block) noexcept {
+    std::free(block);
+}
+
+void operator delete(void* block, std::size_t) noexcept {
+    std::free(block);
+}
+
+namespace {
+
+struct Options {
+    int tasks    = 100'000;
+    int handlers = 4;
+    int rounds   = 5;
+};
+
+struct Result {
+    double nsPerTask          = 0;
+    double allocationsPerTask = 0;
+};
+
+// runs the scenario for every task of a round, the best of the rounds is kept
+Result measure(const Options& options, const std::function<void()>& scenario) {
+    Result best{1e300, 1e300};
+    for (int round = 0; round < options.rounds; ++round) {
+        allocations      = 0;
+        countAllocations = true;
+        auto start       = SteadyClock::now();
+
+        for (int i = 0; i < options.tasks; ++i)
+            scenario();
+
+        auto elapsed     = SteadyClock::now() - start;
+        countAllocations = false;
+
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        best.nsPerTask = std::min(best.nsPerTask, double(ns) / options.tasks);
+        best.allocationsPerTask =
+                std::min(best.allocationsPerTask, double(allocations) / options.tasks);
+    }
+    return best;
+}
+
+void report(const char* scenario, const Result& result) {
+    std::printf("%-28s %10.1f ns/task %8.2f allocations/task\n",
+                scenario,
+                result.nsPerTask,
+                result.allocationsPerTask);
+}
+
+Options parseOptions(const QStringList& arguments) {
+    Options options;
+    for (int i = 1; i + 1 < arguments.size(); i += 2) {
+        auto name  = arguments[i];
+        auto value = arguments[i + 1];
+        if (name == "--tasks")
+            options.tasks = std::max(1, value.toInt());
+        else if (name == "--handlers")
+            options.handlers = std::max(0, value.toInt());
+        else if (name == "--rounds")
+            options.rounds = std::max(1, value.toInt());
+        else
+            throw std::invalid_argument("Unknown option: " + name.toStdString());
+    }
+    return options;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    QCoreApplication app(argc, argv);
+
+    Options options;
+    try {
+        options = parseOptions(app.arguments());
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "%s\n", e.what());
+        return 2;
+    }
+
+    auto taskService = AsyncTaskService::getInstance();
+    auto function    = [](std::shared_ptr<AsyncTask>) {};
+
+    std::printf("%d tasks, %d handlers, best of %d rounds\n",
+                options.tasks,
+                options.handlers,
+                options.rounds);
+
+    report("create/destroy", measure(options, [&]() { taskService->createTask(function); }));
+
+    report("create/run/destroy",
+           measure(options, [&]() { taskService->createTask(function)->runSync(); }));
+
+    report("create/connect/destroy", measure(options, [&]() {
+               auto task = taskService->createTask(function);
+               for (int i = 0; i < options.handlers; ++i)
+                   task->onFinished([](std::shared_ptr<AsyncTask>) {}, false);
+           }));
+
+    report("create/connect/run/destroy", measure(options, [&]() {
+               auto task = taskService->createTask(function);
+               for (int i = 0; i < options.handlers; ++i)
+                   task->onFinished([](std::shared_ptr<AsyncTask>) {}, false);
+               task->runSync();
+           }));
+
+    return 0;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+
+namespace util {
+
+// Allocator of fixed-size blocks carved out of larger slabs. Freed blocks are kept on a
+// per-thread list first, so a thread which keeps creating and destroying objects of the same
+// type takes no lock; the shared list is only touched when a thread runs dry or has cached too
+// many blocks. Slabs are never returned to the system.
+template<std::size_t Size, std::size_t Alignment>
+class BlockPool {
+public:
+    static void* allocate() {
+        auto& cache = threadCache();
+        if (cache.head == nullptr)
+            cache.refill();
+
+        auto block = cache.head;
+        cache.head = block->next;
+        --cache.count;
+        return block;
+    }
+
+    static void deallocate(void* ptr) {
+        auto block = static_cast<Block*>(ptr);
+
+        // blocks freed while the thread is shutting down go straight to the shared list
+        if (threadCacheDestroyed()) {
+            auto& s = shared();
+            std::lock_guard<std::mutex> lock(s.mutex);
+            block->next = s.head;
+            s.head      = block;
+            return;
+        }
+
+        auto& cache = threadCache();
+        block->next = cache.head;
+        cache.head  = block;
+        if (++cache.count > MaxCachedBlocks)
+            cache.drain(MaxCachedBlocks / 2);
+    }
+
+private:
+    static constexpr int BlocksPerSlab   = 64;
+    static constexpr int MaxCachedBlocks = 4 * BlocksPerSlab;
+
+    union Block {
+        Block* next;
+        alignas(Alignment) unsigned char storage[Size];
+    };
+
+    struct Shared {
+        std::mutex mutex;
+        Block* head = nullptr;
+    };
+
+    struct ThreadCache {
+        Block* head = nullptr;
+        int count   = 0;
+
+        ~ThreadCache() {
+            drain(count);
+            threadCacheDestroyed() = true;
+        }
+
+        void refill() {
+            auto& s = shared();
+            std::lock_guard<std::mutex> lock(s.mutex);
+            if (s.head == nullptr) {
+                auto slab = new Block[BlocksPerSlab];
+                for (int i = 0; i < BlocksPerSlab; ++i) {
+                    slab[i].next = s.head;
+                    s.head       = &slab[i];
+                }
+            }
+
+            while (s.head != nullptr && count < BlocksPerSlab) {
+                auto block  = s.head;
+                s.head      = block->next;
+                block->next = head;
+                head        = block;
+                ++count;
+            }
+        }
+
+        void drain(int n) {
+            auto& s = shared();
+            std::lock_guard<std::mutex> lock(s.mutex);
+            for (; n > 0 && head != nullptr; --n, --count) {
+                auto block  = head;
+                head        = block->next;
+                block->next = s.head;
+                s.head      = block;
+            }
+        }
+    };
+
+    // never destroyed, blocks may be freed by static destructors running after main
+    static Shared& shared() {
+        static auto instance = new Shared();
+        return *instance;
+    }
+
+    static ThreadCache& threadCache() {
+        thread_local ThreadCache cache;
+        return cache;
+    }
+
+    static bool& threadCacheDestroyed() {
+        thread_local bool destroyed = false;
+        return destroyed;
+    }
+};
+
+}  // namespace util
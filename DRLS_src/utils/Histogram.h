@@ -0,0 +1,63 @@
+#pragma once
+
+#include <QtCore>
+#include <array>
+#include <bit>
+#include <cmath>
+
+
+namespace util {
+
+// Power-of-two buckets of non-negative values, cheap to record into and to copy for a snapshot.
+// Bucket 0 holds zeros, bucket i holds [2^(i-1), 2^i). Percentiles are reported as the upper
+// bound of their bucket, so they are at most twice the exact value.
+class Histogram {
+public:
+    static constexpr int NumberOfBuckets = 40;
+
+    void record(qint64 value) {
+        value = qMax<qint64>(0, value);
+
+        int bucket = qMin(static_cast<int>(std::bit_width(static_cast<quint64>(value))),
+                          NumberOfBuckets - 1);
+        ++buckets_[bucket];
+        ++count_;
+        sum_ += value;
+        max_ = qMax(max_, value);
+    }
+
+    quint64 getCount() const { return count_; }
+    qint64 getMax() const { return max_; }
+    double getMean() const { return count_ == 0 ? 0 : static_cast<double>(sum_) / count_; }
+
+    // p is between 0 and 1, 0 is returned for an empty histogram
+    qint64 getPercentile(double p) const {
+        if (count_ == 0)
+            return 0;
+
+        auto rank = static_cast<quint64>(std::ceil(qBound(0.0, p, 1.0) * count_));
+        rank      = qMax<quint64>(1, rank);
+
+        quint64 seen = 0;
+        for (int bucket = 0; bucket < NumberOfBuckets; ++bucket) {
+            seen += buckets_[bucket];
+            if (seen >= rank)
+                return qMin(getUpperBound(bucket), max_);
+        }
+        return max_;
+    }
+
+    const std::array<quint64, NumberOfBuckets>& getBuckets() const { return buckets_; }
+
+    static qint64 getUpperBound(int bucket) {
+        return bucket == 0 ? 0 : (qint64(1) << bucket) - 1;
+    }
+
+private:
+    std::array<quint64, NumberOfBuckets> buckets_ = {};
+    quint64 count_ = 0;
+    qint64 sum_    = 0;
+    qint64 max_    = 0;
+};
+
+}  // namespace util
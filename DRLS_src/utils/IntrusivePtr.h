@@ -0,0 +1,54 @@
+#pragma once
+
+#include <utility>
+
+namespace util {
+
+// Shared pointer whose reference count lives in the pointee. T provides static retain(T*) and
+// release(T*); release is expected to delete the object once the count drops to zero.
+template<typename T>
+class IntrusivePtr {
+public:
+    IntrusivePtr() = default;
+
+    explicit IntrusivePtr(T* ptr)
+        : ptr_(ptr)
+    {
+        if (ptr_ != nullptr)
+            T::retain(ptr_);
+    }
+
+    IntrusivePtr(const IntrusivePtr& other)
+        : ptr_(other.ptr_)
+    {
+        if (ptr_ != nullptr)
+            T::retain(ptr_);
+    }
+
+    IntrusivePtr(IntrusivePtr&& other) noexcept
+        : ptr_(std::exchange(other.ptr_, nullptr))
+    {}
+
+    ~IntrusivePtr() {
+        if (ptr_ != nullptr)
+            T::release(ptr_);
+    }
+
+    IntrusivePtr& operator=(IntrusivePtr other) noexcept {
+        std::swap(ptr_, other.ptr_);
+        return *this;
+    }
+
+    T* get() const { return ptr_; }
+    T* operator->() const { return ptr_; }
+    T& operator*() const { return *ptr_; }
+    explicit operator bool() const { return ptr_ != nullptr; }
+
+    bool operator==(const IntrusivePtr& other) const { return ptr_ == other.ptr_; }
+    bool operator!=(const IntrusivePtr& other) const { return ptr_ != other.ptr_; }
+
+private:
+    T* ptr_ = nullptr;
+};
+
+}  // namespace util